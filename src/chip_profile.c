@@ -0,0 +1,159 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "chip_profile.h"
+#include "state_dir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define PROFILE_MAGIC		"u3-tool-profile 1"
+#define PROFILE_PATH_LEN	1024
+#define PROFILE_LINE_LEN	256
+
+static const char *probe_names[] = { "unknown", "passed", "failed" };
+
+/**
+ * Copy a fixed width, space padded field of the chip info
+ */
+static size_t copy_field(char *dst, const char *field, size_t len) {
+	while (len > 0 && (field[len-1] == ' ' || field[len-1] == '\0'))
+		len--;
+	memcpy(dst, field, len);
+	return len;
+}
+
+/**
+ * Get path of profile file
+ */
+static int profile_path(const char *name, char *path, size_t path_len) {
+	char file_name[CHIP_PROFILE_NAME_LEN + 16];
+
+	snprintf(file_name, sizeof(file_name), "chip-%s.profile", name);
+	return state_dir_path(file_name, path, path_len);
+}
+
+static enum chip_probe parse_probe(const char *value) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(probe_names) / sizeof(probe_names[0]); i++) {
+		if (strcmp(value, probe_names[i]) == 0)
+			return (enum chip_probe) i;
+	}
+	return CHIP_PROBE_UNKNOWN;
+}
+
+int chip_profile_read(const struct chip_info *info,
+		struct chip_profile *profile)
+{
+	char path[PROFILE_PATH_LEN];
+	char line[PROFILE_LINE_LEN];
+	char key[PROFILE_LINE_LEN];
+	char value[PROFILE_LINE_LEN];
+	size_t len;
+	FILE *fp;
+
+	memset(profile, 0, sizeof(struct chip_profile));
+	len = copy_field(profile->name, info->manufacturer,
+			U3_MAX_CHIP_MANUFACTURER_LEN);
+	profile->name[len++] = ' ';
+	len += copy_field(profile->name + len, info->revision,
+			U3_MAX_CHIP_REVISION_LEN);
+	profile->name[len] = '\0';
+
+	if (profile_path(profile->name, path, sizeof(path)) == -1)
+		return -1;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		return -1;
+	}
+
+	if (fgets(line, sizeof(line), fp) == NULL ||
+	    strncmp(line, PROFILE_MAGIC, strlen(PROFILE_MAGIC)) != 0)
+	{
+		fclose(fp);
+		errno = EINVAL;
+		return -1;
+	}
+
+	// "<key> <value>" lines, unknown keys are ignored
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%255s %255s", key, value) != 2)
+			continue;
+
+		if (strcmp(key, "zero_after_partition") == 0)
+			profile->zero_after_partition = parse_probe(value);
+		else if (strcmp(key, "write_blocks") == 0)
+			profile->write_blocks = strtoul(value, NULL, 10);
+		else if (strcmp(key, "write_offset") == 0)
+			profile->write_offset = strtoul(value, NULL, 10);
+	}
+
+	// ignore tuning that doesn't fit the write command
+	if (profile->write_blocks > U3_MAX_CD_WRITE_BLOCKS ||
+	    profile->write_offset >= profile->write_blocks)
+	{
+		profile->write_blocks = 0;
+		profile->write_offset = 0;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int chip_profile_write(const struct chip_profile *profile) {
+	char path[PROFILE_PATH_LEN];
+	char tmp_path[PROFILE_PATH_LEN + 4];
+	FILE *fp;
+
+	if (profile_path(profile->name, path, sizeof(path)) == -1)
+		return -1;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+
+	if ((fp = fopen(tmp_path, "w")) == NULL)
+		return -1;
+
+	fprintf(fp, "%s\n", PROFILE_MAGIC);
+	fprintf(fp, "zero_after_partition %s\n",
+		probe_names[profile->zero_after_partition]);
+	if (profile->write_blocks != 0) {
+		fprintf(fp, "write_blocks %u\n", profile->write_blocks);
+		fprintf(fp, "write_offset %u\n", profile->write_offset);
+	}
+
+	if (fclose(fp) != 0) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	// replace old profile in one step
+	if (rename(tmp_path, path) == -1) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __CHIP_PROFILE_H__
+#define __CHIP_PROFILE_H__
+/**
+ * @file	chip_profile.h
+ *
+ *		Behaviour of U3 controller chips learned by probing. Profiles
+ *		are stored in the state directory, one file per chip
+ *		manufacturer and revision as reported by u3_chip_info().
+ */
+
+#include "u3_commands.h"
+
+#define CHIP_PROFILE_NAME_LEN \
+	(U3_MAX_CHIP_MANUFACTURER_LEN + U3_MAX_CHIP_REVISION_LEN + 1)
+
+/**
+ * Result of a probe
+ */
+enum chip_probe {
+	CHIP_PROBE_UNKNOWN = 0,	// not probed yet
+	CHIP_PROBE_PASSED = 1,	// chip has the probed behaviour
+	CHIP_PROBE_FAILED = 2,	// chip doesn't have the probed behaviour
+};
+
+/**
+ * Profile of one chip type
+ */
+struct chip_profile {
+	char name[CHIP_PROFILE_NAME_LEN+1];	// "<manufacturer> <revision>"
+	enum chip_probe zero_after_partition;	// CD area reads back as zero
+						// after repartitioning
+	unsigned int write_blocks;		// fastest blocks per CD write
+						// command, 0 if not tuned
+	unsigned int write_offset;		// CD writes don't cross block
+						// numbers equal to this modulo
+						// write_blocks
+};
+
+/**
+ * Read chip profile
+ *
+ * If no profile of the chip is stored yet, an empty profile with all probes
+ * set to CHIP_PROBE_UNKNOWN and no write tuning is returned.
+ *
+ * @param info		Chip info of device
+ * @param profile	Used to return the profile
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int chip_profile_read(const struct chip_info *info,
+		struct chip_profile *profile);
+
+/**
+ * Write chip profile
+ *
+ * @param profile	Profile to write
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int chip_profile_write(const struct chip_profile *profile);
+
+#endif // __CHIP_PROFILE_H__
@@ -16,31 +16,213 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */ 
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include "display_progress.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
 
-void display_progress(unsigned int cur, unsigned int total) {
-	static unsigned int last = 0;
+#define LINE_LEN	128
+
+/**
+ * Progress state of the current operation
+ */
+static struct {
+	const char	*label;		// name of operation
+	const char	*unit_name;	// name of iterations
+	unsigned int	unit_size;	// bytes per iteration, or 0
+	int		tty;		// stdout is a terminal
+	int		started;	// first progress is known
+	double		start_time;	// time of first progress
+	unsigned int	start_cur;	// iteration of first progress
+	double		last_time;	// time of last rate sample
+	unsigned int	last_cur;	// iteration of last rate sample
+	unsigned int	cur;		// current iteration
+	unsigned int	total;		// total iterations
+	double		rate;		// average iterations per second, or
+					// negative if not known yet
+	size_t		line_len;	// length of last line drawn on terminal
+} progress;
+
+/**
+ * Get monotonic time in seconds
+ */
+static double now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#endif
+	struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Format a duration as [h:]mm:ss
+ */
+static void format_time(char *buf, size_t len, double seconds) {
+	unsigned long secs = seconds + 0.5;
+
+	if (secs >= 3600) {
+		snprintf(buf, len, "%lu:%02lu:%02lu", secs / 3600,
+			(secs / 60) % 60, secs % 60);
+	} else {
+		snprintf(buf, len, "%lu:%02lu", secs / 60, secs % 60);
+	}
+}
+
+/**
+ * Format rate and time of progress
+ *
+ * @param final		Show average rate and elapsed time instead of the
+ * 			current rate and time left
+ */
+static void format_status(char *buf, size_t len, int final, double t) {
+	char time_str[32];
+	double rate = progress.rate;
+	size_t pos = 0;
+
+	if (final) {
+		rate = -1;
+		if (t > progress.start_time)
+			rate = (progress.cur - progress.start_cur) /
+				(t - progress.start_time);
+		format_time(time_str, sizeof(time_str),
+			t - progress.start_time);
+	} else if (rate > 0) {
+		format_time(time_str, sizeof(time_str),
+			(progress.total - progress.cur) / rate);
+	}
+
+	if (rate >= 0) {
+		if (progress.unit_size != 0) {
+			pos += snprintf(buf + pos, len - pos, "%.2f MB/s, ",
+				rate * progress.unit_size / (1024 * 1024));
+		}
+		pos += snprintf(buf + pos, len - pos, "%.0f %s/s, ", rate,
+			progress.unit_name);
+	}
+
+	if (final)
+		snprintf(buf + pos, len - pos, "%s elapsed", time_str);
+	else if (rate > 0)
+		snprintf(buf + pos, len - pos, "ETA %s", time_str);
+	else
+		snprintf(buf + pos, len - pos, "ETA --:--");
+}
+
+/**
+ * Draw progress
+ */
+static void draw(int final, double t) {
+	char status[LINE_LEN];
+	char line[LINE_LEN];
 	unsigned int percent;
 	unsigned int bar_len, i;
+	size_t len;
 
-	if (total == 0) return;
-
-	percent = (cur * 100) / total;
-	if (percent == last) return;
+	percent = ((uint64_t) progress.cur * 100) / progress.total;
+	format_status(status, sizeof(status), final, t);
 
-	putchar('|');
-	bar_len = (cur * PROGRESS_BAR_WIDTH) / total;
-	for (i = 0; i < bar_len; i++) {
-		putchar('*');
+	if (!progress.tty) {
+		printf("%s: %u%% (%u/%u %s), %s\n", progress.label, percent,
+			progress.cur, progress.total, progress.unit_name,
+			status);
+		fflush(stdout);
+		return;
 	}
-	for (i = bar_len; i < PROGRESS_BAR_WIDTH; i++) {
+
+	len = 0;
+	line[len++] = '|';
+	bar_len = ((uint64_t) progress.cur * PROGRESS_BAR_WIDTH) /
+			progress.total;
+	for (i = 0; i < PROGRESS_BAR_WIDTH; i++)
+		line[len++] = i < bar_len ? '*' : ' ';
+	line[len++] = '|';
+	len += snprintf(line + len, sizeof(line) - len, " %u%% %s", percent,
+			status);
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	// overwrite the rest of a longer previous line
+	printf("%s", line);
+	for (i = len; i < progress.line_len; i++)
 		putchar(' ');
+	putchar('\r');
+	fflush(stdout);
+
+	progress.line_len = len;
+}
+
+void display_progress_start(const char *label, const char *unit_name,
+		unsigned int unit_size)
+{
+	memset(&progress, 0, sizeof(progress));
+	progress.label = label;
+	progress.unit_name = unit_name;
+	progress.unit_size = unit_size;
+	progress.tty = isatty(fileno(stdout));
+	progress.rate = -1;
+}
+
+void display_progress(unsigned int cur, unsigned int total) {
+	double t, dt, interval, rate;
+
+	if (total == 0) return;
+
+	if (progress.label == NULL)
+		display_progress_start("Progress", "iterations", 0);
+
+	t = now();
+	progress.cur = cur;
+	progress.total = total;
+
+	if (!progress.started || cur < progress.last_cur) {
+		progress.started = 1;
+		progress.start_time = progress.last_time = t;
+		progress.start_cur = progress.last_cur = cur;
+		progress.rate = -1;
+		if (progress.tty)
+			draw(0, t);
+		return;
 	}
-	putchar('|');
 
-	printf(" %d%%\r", percent);
-	fflush(stdout);
+	interval = progress.tty ? PROGRESS_INTERVAL_TTY : PROGRESS_INTERVAL_LOG;
+	dt = t - progress.last_time;
+	if (dt < interval)
+		return;
+
+	// The weight of a sample grows with the time it covers, so the
+	// average doesn't depend on the redraw interval.
+	rate = (cur - progress.last_cur) / dt;
+	if (progress.rate < 0)
+		progress.rate = rate;
+	else
+		progress.rate += (rate - progress.rate) *
+				dt / (PROGRESS_RATE_TAU + dt);
+
+	progress.last_time = t;
+	progress.last_cur = cur;
+	draw(0, t);
+}
+
+void display_progress_end(void) {
+	if (progress.started) {
+		draw(1, now());
+		if (progress.tty)
+			putchar('\n');
+		fflush(stdout);
+	}
 
-	last = percent;
+	memset(&progress, 0, sizeof(progress));
 }
@@ -18,15 +18,50 @@
  */ 
 #ifndef __DISPLAY_PROGRESS_H__
 #define __DISPLAY_PROGRESS_H__
+/**
+ * @file	display_progress.h
+ *
+ *		Progress display of long running operations. On a terminal a
+ *		progress bar is redrawn in place, else a line is printed per
+ *		interval, so logs stay readable. Both show the throughput,
+ *		averaged with an exponentially weighted moving average, and the
+ *		estimated time left.
+ */
+
+#define PROGRESS_BAR_WIDTH 30 // width of the progress bar on screen
 
-#define PROGRESS_BAR_WIDTH 50 // width of the progress bar on screen
+#define PROGRESS_INTERVAL_TTY	0.2	// seconds between redraws on terminal
+#define PROGRESS_INTERVAL_LOG	5.0	// seconds between lines in a log
+#define PROGRESS_RATE_TAU	3.0	// time constant of rate average in s
+
+/**
+ * Start displaying progress of an operation
+ *
+ * @param label		Name of the operation, printed in log lines
+ * @param unit_name	Name of an iteration, like "blocks"
+ * @param unit_size	Size of an iteration in bytes, used for the MB/s
+ * 			rate, or 0 if iterations are not bytes
+ */
+void display_progress_start(const char *label, const char *unit_name,
+		unsigned int unit_size);
 
 /**
  * Display progress of an operation
  *
+ * The display is only updated once per interval, so this can be called for
+ * every iteration.
+ *
  * @param cur		Number of current itteration
  * @param total		Total number of iterations
  */
 void display_progress(unsigned int cur, unsigned int total);
- 
+
+/**
+ * Finish displaying progress
+ *
+ * This displays the last progress, with the average rate of the whole
+ * operation, and ends the line.
+ */
+void display_progress_end(void);
+
 #endif // __DISPLAY_PROGRESS_H__
@@ -0,0 +1,1087 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE		// O_DIRECT
+#endif
+
+#include "image_source.h"
+#include "iso_tree.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+# define USE_ZLIB 1
+# include <zlib.h>
+#endif
+#if defined(HAVE_LIBLZMA) && defined(HAVE_LZMA_H)
+# define USE_LZMA 1
+# include <lzma.h>
+#endif
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#define READAHEAD_WINDOW	(4 * 1024 * 1024)	// bytes hinted ahead
+
+#define ISO_PVD_BLOCK		16	// block of ISO9660 primary volume desc.
+
+#define IN_BUF_SIZE		(64 * 1024)	// size of raw input buffer
+#define MAGIC_LEN		6	// bytes needed to detect compression
+#define XZ_FOOTER_LEN		12	// size of xz stream header and footer
+
+static void set_error(struct image_source *src, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(src->err_msg, U3_MAX_ERROR_LEN, fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Read from file descriptor till 'len' bytes are read or end of file
+ *
+ * @returns	number of bytes read, or -1 on error
+ */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len) {
+	size_t bytes_read = 0;
+	ssize_t res;
+
+	while (bytes_read < len) {
+		res = read(fd, buf + bytes_read, len - bytes_read);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (res == 0) {
+			break;
+		}
+		bytes_read += res;
+	}
+
+	return bytes_read;
+}
+
+/**
+ * Read 'len' bytes at 'offset' from file descriptor
+ *
+ * @returns	0 if successful, else -1
+ */
+static int read_at(int fd, uint8_t *buf, size_t len, uint64_t offset) {
+	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+		return -1;
+	if (read_full(fd, buf, len) != (ssize_t) len)
+		return -1;
+	return 0;
+}
+
+/**
+ * Read raw image data, data left in the input buffer comes first
+ *
+ * @returns	number of bytes read, or -1 on error
+ */
+static ssize_t raw_read(struct image_source *src, uint8_t *buf, size_t len) {
+	size_t bytes_read = 0;
+	ssize_t res;
+
+	if (src->in_pos < src->in_len) {
+		bytes_read = src->in_len - src->in_pos;
+		if (bytes_read > len)
+			bytes_read = len;
+		memcpy(buf, src->in_buf + src->in_pos, bytes_read);
+		src->in_pos += bytes_read;
+	}
+
+	res = read_full(src->fd, buf + bytes_read, len - bytes_read);
+	if (res == -1)
+		return -1;
+
+	return bytes_read + res;
+}
+
+/**
+ * Refill the input buffer of the decoder if it is empty
+ *
+ * @returns	number of bytes available, 0 at end of file or -1 on error
+ */
+static ssize_t fill_input(struct image_source *src) {
+	ssize_t res;
+
+	if (src->in_pos < src->in_len)
+		return src->in_len - src->in_pos;
+
+	do {
+		res = read(src->fd, src->in_buf, IN_BUF_SIZE);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) {
+		set_error(src, "Failed reading iso file: %s", strerror(errno));
+		return -1;
+	}
+
+	src->in_len = res;
+	src->in_pos = 0;
+	return res;
+}
+
+/**
+ * Detect compression of image by its magic bytes
+ */
+static enum image_compression detect_compression(const uint8_t *magic,
+		size_t len)
+{
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return IMAGE_GZIP;
+	if (len >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+		return IMAGE_XZ;
+	return IMAGE_PLAIN;
+}
+
+/************************************ gzip ************************************/
+
+#ifdef USE_ZLIB
+static int gzip_init(struct image_source *src) {
+	z_stream *strm;
+
+	strm = (z_stream *) calloc(1, sizeof(z_stream));
+	if (strm == NULL) {
+		set_error(src, "Failed allocating memory for decompressor");
+		return U3_FAILURE;
+	}
+
+	// maximum window size, +32 for gzip header detection
+	if (inflateInit2(strm, 15 + 32) != Z_OK) {
+		set_error(src, "Failed initializing gzip decompressor");
+		free(strm);
+		return U3_FAILURE;
+	}
+
+	src->decoder = strm;
+	return U3_SUCCESS;
+}
+
+/**
+ * Decompress gzip data
+ *
+ * @returns	number of bytes decompressed, or -1 on error
+ */
+static ssize_t gzip_read(struct image_source *src, uint8_t *buf, size_t len)
+{
+	z_stream *strm = (z_stream *) src->decoder;
+	ssize_t avail;
+	int res;
+
+	strm->next_out = buf;
+	strm->avail_out = len;
+
+	while (strm->avail_out > 0) {
+		if ((avail = fill_input(src)) == -1)
+			return -1;
+		else if (avail == 0)
+			break;
+
+		strm->next_in = src->in_buf + src->in_pos;
+		strm->avail_in = avail;
+		res = inflate(strm, Z_NO_FLUSH);
+		src->in_pos += avail - strm->avail_in;
+
+		if (res == Z_STREAM_END) {
+			// concatenated gzip members form one image
+			inflateReset(strm);
+		} else if (res != Z_OK && res != Z_BUF_ERROR) {
+			set_error(src, "Failed decompressing gzip image: %s",
+				strm->msg ? strm->msg : "unknown error");
+			return -1;
+		}
+	}
+
+	return len - strm->avail_out;
+}
+
+static void gzip_free(struct image_source *src) {
+	inflateEnd((z_stream *) src->decoder);
+	free(src->decoder);
+}
+
+/**
+ * Get uncompressed size from the ISIZE field of the gzip trailer
+ */
+static int gzip_size(struct image_source *src, uint64_t file_size) {
+	uint8_t isize[4];
+
+	if (file_size < 18 || read_at(src->fd, isize, 4, file_size - 4) == -1)
+	{
+		set_error(src, "Failed reading gzip trailer");
+		return U3_FAILURE;
+	}
+
+	// ISIZE is the size modulo 2^32, a larger image fails the check at
+	// the end of the image
+	src->size = isize[0] | (isize[1] << 8) | (isize[2] << 16) |
+			((uint32_t) isize[3] << 24);
+	return U3_SUCCESS;
+}
+#endif // USE_ZLIB
+
+/************************************* xz *************************************/
+
+#ifdef USE_LZMA
+static int xz_init(struct image_source *src) {
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_stream *strm;
+
+	strm = (lzma_stream *) malloc(sizeof(lzma_stream));
+	if (strm == NULL) {
+		set_error(src, "Failed allocating memory for decompressor");
+		return U3_FAILURE;
+	}
+	*strm = init;
+
+	if (lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED) !=
+		LZMA_OK)
+	{
+		set_error(src, "Failed initializing xz decompressor");
+		free(strm);
+		return U3_FAILURE;
+	}
+
+	src->decoder = strm;
+	return U3_SUCCESS;
+}
+
+/**
+ * Decompress xz data
+ *
+ * @returns	number of bytes decompressed, or -1 on error
+ */
+static ssize_t xz_read(struct image_source *src, uint8_t *buf, size_t len) {
+	lzma_stream *strm = (lzma_stream *) src->decoder;
+	ssize_t avail;
+	lzma_ret res;
+
+	strm->next_out = buf;
+	strm->avail_out = len;
+
+	while (strm->avail_out > 0 && !src->decoder_end) {
+		if ((avail = fill_input(src)) == -1)
+			return -1;
+
+		// LZMA_CONCATENATED needs LZMA_FINISH to end the last stream
+		strm->next_in = src->in_buf + src->in_pos;
+		strm->avail_in = avail;
+		res = lzma_code(strm, avail == 0 ? LZMA_FINISH : LZMA_RUN);
+		src->in_pos += avail - strm->avail_in;
+
+		if (res == LZMA_STREAM_END) {
+			src->decoder_end = 1;
+		} else if (res == LZMA_BUF_ERROR && avail == 0) {
+			// truncated file
+			break;
+		} else if (res != LZMA_OK) {
+			set_error(src, "Failed decompressing xz image: "
+				"liblzma error %d", res);
+			return -1;
+		}
+	}
+
+	return len - strm->avail_out;
+}
+
+static void xz_free(struct image_source *src) {
+	lzma_end((lzma_stream *) src->decoder);
+	free(src->decoder);
+}
+
+/**
+ * Get uncompressed size from the index of the xz file
+ *
+ * Only the index of the last stream is read, if streams are concatenated
+ * the image is larger and fails the check at the end of the image.
+ */
+static int xz_size(struct image_source *src, uint64_t file_size) {
+	uint8_t footer[XZ_FOOTER_LEN];
+	uint8_t *index_buf;
+	lzma_stream_flags flags;
+	lzma_index *index = NULL;
+	uint64_t memlimit = UINT64_MAX;
+	uint64_t end = file_size;
+	size_t in_pos = 0;
+	lzma_ret res;
+
+	// skip stream padding, a multiple of four zero bytes
+	for (;;) {
+		if (end < 2 * XZ_FOOTER_LEN ||
+		    read_at(src->fd, footer, 4, end - 4) == -1)
+		{
+			set_error(src, "Failed reading xz footer");
+			return U3_FAILURE;
+		}
+		if (memcmp(footer, "\0\0\0\0", 4) != 0)
+			break;
+		end -= 4;
+	}
+
+	if (read_at(src->fd, footer, XZ_FOOTER_LEN, end - XZ_FOOTER_LEN) ==
+		-1 || lzma_stream_footer_decode(&flags, footer) != LZMA_OK ||
+	    flags.backward_size > end - 2 * XZ_FOOTER_LEN)
+	{
+		set_error(src, "Failed reading xz footer");
+		return U3_FAILURE;
+	}
+
+	index_buf = (uint8_t *) malloc(flags.backward_size);
+	if (index_buf == NULL) {
+		set_error(src, "Failed allocating memory for xz index");
+		return U3_FAILURE;
+	}
+	if (read_at(src->fd, index_buf, flags.backward_size,
+		end - XZ_FOOTER_LEN - flags.backward_size) == -1)
+	{
+		set_error(src, "Failed reading xz index");
+		free(index_buf);
+		return U3_FAILURE;
+	}
+
+	res = lzma_index_buffer_decode(&index, &memlimit, NULL, index_buf,
+			&in_pos, flags.backward_size);
+	free(index_buf);
+	if (res != LZMA_OK) {
+		set_error(src, "Failed decoding xz index: liblzma error %d",
+			res);
+		return U3_FAILURE;
+	}
+
+	src->size = lzma_index_uncompressed_size(index);
+	lzma_index_end(index, NULL);
+	return U3_SUCCESS;
+}
+#endif // USE_LZMA
+
+/********************************* decoding ***********************************/
+
+/**
+ * Start decompressing at the current position of the image file
+ */
+static int decoder_init(struct image_source *src) {
+	src->decoder_end = 0;
+
+	switch (src->compression) {
+		case IMAGE_PLAIN:
+			return U3_SUCCESS;
+#ifdef USE_ZLIB
+		case IMAGE_GZIP:
+			return gzip_init(src);
+#endif
+#ifdef USE_LZMA
+		case IMAGE_XZ:
+			return xz_init(src);
+#endif
+		default:
+			set_error(src, "Image is %s compressed, which is not "
+				"supported by this build",
+				src->compression == IMAGE_GZIP ? "gzip" : "xz");
+			return U3_FAILURE;
+	}
+}
+
+static void decoder_free(struct image_source *src) {
+	if (src->decoder == NULL)
+		return;
+
+	switch (src->compression) {
+#ifdef USE_ZLIB
+		case IMAGE_GZIP:
+			gzip_free(src);
+			break;
+#endif
+#ifdef USE_LZMA
+		case IMAGE_XZ:
+			xz_free(src);
+			break;
+#endif
+		default:
+			break;
+	}
+	src->decoder = NULL;
+}
+
+/**
+ * Read image data, decompressing it if needed
+ *
+ * @returns	number of bytes read, less then 'len' only at end of file, or
+ *		-1 on error
+ */
+static ssize_t decoded_read(struct image_source *src, uint8_t *buf,
+		size_t len)
+{
+	ssize_t res;
+
+	switch (src->compression) {
+#ifdef USE_ZLIB
+		case IMAGE_GZIP:
+			return gzip_read(src, buf, len);
+#endif
+#ifdef USE_LZMA
+		case IMAGE_XZ:
+			return xz_read(src, buf, len);
+#endif
+		default:
+			res = raw_read(src, buf, len);
+			if (res == -1) {
+				set_error(src, "Failed reading iso file: %s",
+					strerror(errno));
+			}
+			return res;
+	}
+}
+
+/**
+ * Check that a compressed image file holds no data beyond the size recorded
+ * in its trailer. Streams end at the size of the ISO9660 volume, data after
+ * it is padding.
+ */
+static int check_image_end(struct image_source *src) {
+	uint8_t extra;
+	ssize_t res;
+
+	if (src->compression == IMAGE_PLAIN || !src->seekable)
+		return U3_SUCCESS;
+
+	if ((res = decoded_read(src, &extra, 1)) == -1)
+		return U3_FAILURE;
+	if (res != 0) {
+		set_error(src, "Compressed image is larger than the %llu bytes "
+			"recorded in its trailer",
+			(unsigned long long) src->size);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/******************************* opening images *******************************/
+
+/**
+ * Try to map a regular file into memory
+ *
+ * @returns	U3_SUCCESS if the image is mapped, else U3_FAILURE and the
+ *		caller should fall back to read()
+ */
+static int map_image(struct image_source *src) {
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	void *map;
+
+	if ((uint64_t)(size_t) src->size != src->size)
+		return U3_FAILURE;
+
+	map = mmap(NULL, src->size, PROT_READ, MAP_SHARED, src->fd, 0);
+	if (map == MAP_FAILED)
+		return U3_FAILURE;
+
+# ifdef HAVE_MADVISE
+	madvise(map, src->size, MADV_SEQUENTIAL);
+# endif
+	src->map = (uint8_t *) map;
+	src->type = IMAGE_SOURCE_MMAP;
+	return U3_SUCCESS;
+#else
+	return U3_FAILURE;
+#endif
+}
+
+/**
+ * Initialize image source state for file descriptor 'fd'
+ */
+static int source_init(struct image_source *src, int fd) {
+	memset(src, 0, sizeof(struct image_source));
+	src->type = IMAGE_SOURCE_READ;
+	src->compression = IMAGE_PLAIN;
+	src->fd = fd;
+
+	src->in_buf = (uint8_t *) malloc(IN_BUF_SIZE);
+	if (src->in_buf == NULL) {
+		set_error(src, "Failed allocating memory for input buffer");
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+int image_source_open(struct image_source *src, const char *filename) {
+	struct stat file_stat;
+	uint8_t magic[MAGIC_LEN];
+	int fd;
+	int res = U3_SUCCESS;
+
+	memset(src, 0, sizeof(struct image_source));
+	src->fd = -1;
+
+	if (stat(filename, &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+		return image_source_open_tree(src, filename);
+
+	if ((fd = open(filename, O_RDONLY | O_BINARY)) == -1) {
+		set_error(src, "Failed opening iso file: %s", strerror(errno));
+		return U3_FAILURE;
+	}
+
+	if (fstat(fd, &file_stat) == -1) {
+		set_error(src, "Failed stating iso file: %s", strerror(errno));
+		close(fd);
+		return U3_FAILURE;
+	}
+
+	// pipes, character devices, etc.
+	if (!S_ISREG(file_stat.st_mode))
+		return image_source_open_stream(src, fd, 0);
+
+	if (source_init(src, fd) != U3_SUCCESS) {
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+	src->size = file_stat.st_size;
+	src->seekable = 1;
+
+	if (src->size >= MAGIC_LEN && read_at(fd, magic, MAGIC_LEN, 0) == 0)
+		src->compression = detect_compression(magic, MAGIC_LEN);
+
+	switch (src->compression) {
+		case IMAGE_PLAIN:
+			if (src->size > 0 && map_image(src) != U3_SUCCESS) {
+#ifdef HAVE_POSIX_FADVISE
+				posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			}
+			break;
+#ifdef USE_ZLIB
+		case IMAGE_GZIP:
+			res = gzip_size(src, file_stat.st_size);
+			break;
+#endif
+#ifdef USE_LZMA
+		case IMAGE_XZ:
+			res = xz_size(src, file_stat.st_size);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if (res == U3_SUCCESS && lseek(fd, 0, SEEK_SET) == (off_t) -1) {
+		set_error(src, "Failed seeking in iso file: %s",
+			strerror(errno));
+		res = U3_FAILURE;
+	}
+	if (res == U3_SUCCESS)
+		res = decoder_init(src);
+
+	if (res != U3_SUCCESS) {
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+int image_source_open_tree(struct image_source *src, const char *dirname) {
+	memset(src, 0, sizeof(struct image_source));
+	src->type = IMAGE_SOURCE_TREE;
+	src->fd = -1;
+
+	src->tree = (struct iso_tree *) malloc(sizeof(struct iso_tree));
+	if (src->tree == NULL) {
+		set_error(src, "Failed allocating memory for directory tree");
+		return U3_FAILURE;
+	}
+
+	if (iso_tree_open(src->tree, dirname) != U3_SUCCESS) {
+		set_error(src, "%s", src->tree->err_msg);
+		free(src->tree);
+		src->tree = NULL;
+		return U3_FAILURE;
+	}
+
+	src->size = (uint64_t) src->tree->blocks * U3_BLOCK_SIZE;
+	src->seekable = 1;
+	return U3_SUCCESS;
+}
+
+int image_source_open_direct(struct image_source *src, const char *filename)
+{
+#ifdef O_DIRECT
+	struct stat file_stat;
+	ssize_t res;
+	int fd;
+	int err;
+
+	memset(src, 0, sizeof(struct image_source));
+	src->fd = -1;
+
+	if ((fd = open(filename, O_RDONLY | O_BINARY | O_DIRECT)) == -1) {
+		if (errno == EINVAL) {
+			set_error(src, "File system of iso file doesn't "
+				"support direct I/O");
+		} else {
+			set_error(src, "Failed opening iso file: %s",
+				strerror(errno));
+		}
+		return U3_FAILURE;
+	}
+
+	if (fstat(fd, &file_stat) == -1) {
+		set_error(src, "Failed stating iso file: %s", strerror(errno));
+		close(fd);
+		return U3_FAILURE;
+	}
+	if (!S_ISREG(file_stat.st_mode)) {
+		set_error(src, "Direct I/O needs a regular iso file");
+		close(fd);
+		return U3_FAILURE;
+	}
+
+	src->type = IMAGE_SOURCE_DIRECT;
+	src->compression = IMAGE_PLAIN;
+	src->fd = fd;
+	src->size = file_stat.st_size;
+	src->seekable = 1;
+
+	// the input buffer is the bounce buffer of unaligned reads
+	err = posix_memalign((void **) &src->in_buf, IMAGE_DIRECT_ALIGN,
+			IN_BUF_SIZE);
+	if (err != 0) {
+		src->in_buf = NULL;
+		set_error(src, "Failed allocating memory for input buffer: %s",
+			strerror(err));
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	res = pread(fd, src->in_buf, IMAGE_DIRECT_ALIGN, 0);
+	if (res == -1) {
+		set_error(src, "Failed reading iso file: %s", strerror(errno));
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+	if (res >= MAGIC_LEN &&
+	    detect_compression(src->in_buf, MAGIC_LEN) != IMAGE_PLAIN)
+	{
+		set_error(src, "Compressed iso files can't be read with direct "
+			"I/O");
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+#else
+	memset(src, 0, sizeof(struct image_source));
+	src->fd = -1;
+	set_error(src, "Direct I/O is not supported on this platform");
+	return U3_FAILURE;
+#endif
+}
+
+/**
+ * Get image size from ISO9660 primary volume descriptor
+ *
+ * @param pvd	Volume descriptor, one block
+ *
+ * @returns	image size in bytes, or 0 if this is not a primary volume
+ *		descriptor
+ */
+static uint64_t iso_pvd_size(const uint8_t *pvd) {
+	uint32_t volume_blocks;
+	uint16_t block_size;
+
+	if (pvd[0] != 0x01 || memcmp(pvd + 1, "CD001", 5) != 0)
+		return 0;
+
+	// both-endian fields, use the little endian half
+	volume_blocks = pvd[80] | (pvd[81] << 8) | (pvd[82] << 16) |
+			((uint32_t) pvd[83] << 24);
+	block_size = pvd[128] | (pvd[129] << 8);
+
+	return (uint64_t) volume_blocks * block_size;
+}
+
+int image_source_open_stream(struct image_source *src, int fd, uint64_t size)
+{
+	ssize_t res;
+
+	if (source_init(src, fd) != U3_SUCCESS) {
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	// The magic bytes stay in the input buffer, from where they are
+	// passed to the decoder or returned as image data.
+	res = read_full(fd, src->in_buf, MAGIC_LEN);
+	if (res == -1) {
+		set_error(src, "Failed reading iso stream: %s",
+			strerror(errno));
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+	src->in_len = res;
+	src->compression = detect_compression(src->in_buf, res);
+	if (decoder_init(src) != U3_SUCCESS) {
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	src->size = size;
+	if (size != 0)
+		return U3_SUCCESS;
+
+	// read ahead up to and including the primary volume descriptor
+	src->peek = (uint8_t *) malloc((ISO_PVD_BLOCK + 1) * U3_BLOCK_SIZE);
+	if (src->peek == NULL) {
+		set_error(src, "Failed allocating memory for stream buffer");
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	res = decoded_read(src, src->peek, (ISO_PVD_BLOCK + 1) * U3_BLOCK_SIZE);
+	if (res == -1) {
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+	src->peek_len = res;
+
+	if (res == (ISO_PVD_BLOCK + 1) * U3_BLOCK_SIZE)
+		src->size = iso_pvd_size(src->peek + ISO_PVD_BLOCK * U3_BLOCK_SIZE);
+	if (src->size == 0) {
+		set_error(src, "Can't determine size of iso stream, no ISO9660 "
+			"volume descriptor found. Specify the size using "
+			"--size");
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/******************************* reading images *******************************/
+
+/**
+ * Touch every page of a mapped range, so page faults are taken by the
+ * reading thread instead of the thread consuming the data.
+ */
+static void prefault(const uint8_t *data, uint64_t len) {
+	volatile uint8_t sink;
+	uint64_t pos;
+#ifdef WIN32
+	int page_size = 4096;	// images aren't mapped on Windows
+#else
+	int page_size = getpagesize();
+#endif
+
+	for (pos = 0; pos < len; pos += page_size)
+		sink = data[pos];
+	(void) sink;
+}
+
+/**
+ * Read blocks from a memory mapped image
+ */
+static int read_mapped(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks, uint8_t **data)
+{
+	uint64_t remaining = src->size - src->offset;
+	uint64_t len = (uint64_t) max_blocks * U3_BLOCK_SIZE;
+
+#ifdef HAVE_MADVISE
+	// Ask the kernel to read ahead of us, the consumer of the data is
+	// usually waiting for the device.
+	if (src->advised < src->offset + len && src->advised < src->size) {
+		uint64_t start = src->offset & ~((uint64_t) getpagesize() - 1);
+		uint64_t end = src->offset + READAHEAD_WINDOW;
+
+		if (end > src->size)
+			end = src->size;
+		madvise(src->map + start, end - start, MADV_WILLNEED);
+		src->advised = end;
+	}
+#endif
+
+	// Whole blocks are used directly from the mapping, only the partial
+	// last block is copied.
+	if (remaining < len)
+		len = remaining - remaining % U3_BLOCK_SIZE;
+	if (len > 0) {
+		*data = src->map + src->offset;
+		prefault(*data, len);
+		src->offset += len;
+		return len / U3_BLOCK_SIZE;
+	}
+
+	memcpy(buf, src->map + src->offset, remaining);
+	memset(buf + remaining, 0, U3_BLOCK_SIZE - remaining);
+	*data = buf;
+	src->offset += remaining;
+	return 1;
+}
+
+/**
+ * Read blocks from an image using read()
+ */
+static int read_file(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks, uint8_t **data)
+{
+	size_t len = (size_t) max_blocks * U3_BLOCK_SIZE;
+	size_t bytes_read = 0;
+	ssize_t res;
+
+	// never read beyond the image size
+	if (len > src->size - src->offset)
+		len = src->size - src->offset;
+
+	// data read ahead from a stream comes first
+	if (src->peek_pos < src->peek_len) {
+		bytes_read = src->peek_len - src->peek_pos;
+		if (bytes_read > len)
+			bytes_read = len;
+		memcpy(buf, src->peek + src->peek_pos, bytes_read);
+		src->peek_pos += bytes_read;
+	}
+
+	res = decoded_read(src, buf + bytes_read, len - bytes_read);
+	if (res == -1)
+		return -1;
+	bytes_read += res;
+	src->offset += bytes_read;
+
+	if (bytes_read < len) {
+		set_error(src, "Unexpected end of iso file after %llu of %llu "
+			"bytes", (unsigned long long) src->offset,
+			(unsigned long long) src->size);
+		return -1;
+	}
+	if (src->offset == src->size && check_image_end(src) != U3_SUCCESS)
+		return -1;
+
+	if (bytes_read % U3_BLOCK_SIZE) {
+		// zeroize rest of block to prevent writing garbage
+		memset(buf + bytes_read, 0,
+			U3_BLOCK_SIZE - bytes_read % U3_BLOCK_SIZE);
+		bytes_read += U3_BLOCK_SIZE - bytes_read % U3_BLOCK_SIZE;
+	}
+
+	*data = buf;
+	return bytes_read / U3_BLOCK_SIZE;
+}
+
+#ifdef O_DIRECT
+/**
+ * Read blocks from an image opened with O_DIRECT
+ *
+ * Direct reads must start at an aligned file offset and have an aligned
+ * length and buffer. At the end of the file the kernel returns the bytes up
+ * to the end, so the unaligned tail is read with an aligned length as well,
+ * if the buffer has room for it. Everything else is read into the bounce
+ * buffer, which returns fewer blocks than asked for.
+ */
+static int read_direct(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks, uint8_t **data)
+{
+	uint64_t remaining = src->size - src->offset;
+	size_t cap = (size_t) max_blocks * U3_BLOCK_SIZE;
+	size_t len = cap;
+	size_t want = 0;
+	size_t skip;
+	ssize_t res;
+
+	if (len > remaining)
+		len = remaining;
+
+	if (src->offset % IMAGE_DIRECT_ALIGN == 0 &&
+	    (uintptr_t) buf % IMAGE_DIRECT_ALIGN == 0)
+	{
+		want = (len + IMAGE_DIRECT_ALIGN - 1) &
+			~(size_t) (IMAGE_DIRECT_ALIGN - 1);
+		if (want > cap) {
+			// no room for the aligned tail, leave it for later
+			want = len & ~(size_t) (IMAGE_DIRECT_ALIGN - 1);
+			if (want > 0)
+				len = want;
+		}
+	}
+
+	if (want > 0) {
+		res = pread(src->fd, buf, want, src->offset);
+		if (res == -1) {
+			set_error(src, "Failed reading iso file: %s",
+				strerror(errno));
+			return -1;
+		}
+		if ((size_t) res > len)
+			res = len;
+	} else {
+		// read the aligned window around the read position
+		skip = src->offset % IMAGE_DIRECT_ALIGN;
+		res = pread(src->fd, src->in_buf, IN_BUF_SIZE,
+				src->offset - skip);
+		if (res == -1) {
+			set_error(src, "Failed reading iso file: %s",
+				strerror(errno));
+			return -1;
+		}
+		res = (size_t) res > skip ? res - skip : 0;
+		if ((size_t) res > len)
+			res = len;
+		// end on a block boundary, unless this is the end of the image
+		if ((size_t) res < len)
+			res -= res % U3_BLOCK_SIZE;
+		len = res;
+		memcpy(buf, src->in_buf + skip, res);
+	}
+
+	if (res == 0 || (size_t) res < len) {
+		set_error(src, "Unexpected end of iso file after %llu of %llu "
+			"bytes", (unsigned long long) (src->offset + res),
+			(unsigned long long) src->size);
+		return -1;
+	}
+	src->offset += res;
+
+	if (res % U3_BLOCK_SIZE) {
+		// zeroize rest of block to prevent writing garbage
+		memset(buf + res, 0, U3_BLOCK_SIZE - res % U3_BLOCK_SIZE);
+		res += U3_BLOCK_SIZE - res % U3_BLOCK_SIZE;
+	}
+
+	*data = buf;
+	return res / U3_BLOCK_SIZE;
+}
+#endif
+
+/**
+ * Read blocks of an image generated from a directory tree
+ */
+static int read_tree(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks)
+{
+	uint32_t block_num = src->offset / U3_BLOCK_SIZE;
+
+	if (max_blocks > src->tree->blocks - block_num)
+		max_blocks = src->tree->blocks - block_num;
+
+	if (iso_tree_read(src->tree, block_num, max_blocks, buf)
+		!= U3_SUCCESS)
+	{
+		set_error(src, "%s", src->tree->err_msg);
+		return -1;
+	}
+
+	src->offset += (uint64_t) max_blocks * U3_BLOCK_SIZE;
+	return max_blocks;
+}
+
+int image_source_read(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks, uint8_t **data)
+{
+	*data = buf;
+
+	if (max_blocks == 0 || src->offset >= src->size)
+		return 0;
+
+	switch (src->type) {
+		case IMAGE_SOURCE_MMAP:
+			return read_mapped(src, buf, max_blocks, data);
+#ifdef O_DIRECT
+		case IMAGE_SOURCE_DIRECT:
+			return read_direct(src, buf, max_blocks, data);
+#endif
+		case IMAGE_SOURCE_TREE:
+			return read_tree(src, buf, max_blocks);
+		case IMAGE_SOURCE_READ:
+		default:
+			return read_file(src, buf, max_blocks, data);
+	}
+}
+
+int image_source_seek(struct image_source *src, uint32_t block_num) {
+	uint64_t offset = (uint64_t) block_num * U3_BLOCK_SIZE;
+
+	if (offset == src->offset)
+		return U3_SUCCESS;
+
+	if (src->type == IMAGE_SOURCE_READ) {
+		if (!src->seekable) {
+			set_error(src, "Can't seek in iso stream");
+			return U3_FAILURE;
+		} else if (src->compression != IMAGE_PLAIN && offset != 0) {
+			set_error(src, "Can't seek in compressed iso file");
+			return U3_FAILURE;
+		}
+
+		if (lseek(src->fd, offset, SEEK_SET) == (off_t) -1) {
+			set_error(src, "Failed seeking in iso file: %s",
+				strerror(errno));
+			return U3_FAILURE;
+		}
+
+		// restart decompression from the start of the file
+		src->in_len = src->in_pos = 0;
+		decoder_free(src);
+		if (decoder_init(src) != U3_SUCCESS)
+			return U3_FAILURE;
+	}
+
+	src->offset = offset;
+	src->advised = 0;
+	src->peek_pos = src->peek_len;
+	return U3_SUCCESS;
+}
+
+void image_source_close(struct image_source *src) {
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if (src->map != NULL)
+		munmap(src->map, src->size);
+#endif
+	src->map = NULL;
+	if (src->tree != NULL) {
+		iso_tree_close(src->tree);
+		free(src->tree);
+	}
+	src->tree = NULL;
+	decoder_free(src);
+	free(src->in_buf);
+	src->in_buf = NULL;
+	free(src->peek);
+	src->peek = NULL;
+	if (src->fd != -1)
+		close(src->fd);
+	src->fd = -1;
+}
+
+const char *image_source_error(struct image_source *src) {
+	return src->err_msg;
+}
@@ -0,0 +1,207 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __IMAGE_SOURCE_H__
+#define __IMAGE_SOURCE_H__
+/**
+ * @file	image_source.h
+ *
+ *		Sources of CD image data. An image source hands out the image
+ *		in whole blocks, either copied into a caller supplied buffer or,
+ *		if the image is memory mapped, as a pointer into the mapping.
+ */
+
+#include <stdint.h>
+
+#include "u3.h"
+
+/**
+ * Type of image source
+ */
+enum image_source_type {
+	IMAGE_SOURCE_READ = 0,	// image is read into the caller's buffer
+	IMAGE_SOURCE_MMAP = 1,	// image is mapped into memory
+	IMAGE_SOURCE_DIRECT = 2,// image is read bypassing the page cache
+	IMAGE_SOURCE_TREE = 3,	// image is generated from a directory tree
+};
+
+#define IMAGE_DIRECT_ALIGN	4096	// alignment of direct reads
+
+/**
+ * Compression of image file
+ */
+enum image_compression {
+	IMAGE_PLAIN = 0,	// not compressed
+	IMAGE_GZIP = 1,		// gzip compressed, needs zlib
+	IMAGE_XZ = 2,		// xz compressed, needs liblzma
+};
+
+struct iso_tree;
+
+/**
+ * Image source state
+ */
+struct image_source {
+	enum image_source_type type;
+	enum image_compression compression;
+	int	 fd;		// image file descriptor
+	uint64_t size;		// size of image in bytes, uncompressed
+	uint64_t offset;	// position of next read in bytes, uncompressed
+	uint8_t	 *map;		// mapping of image for IMAGE_SOURCE_MMAP
+	uint64_t advised;	// end of range passed to the readahead hint
+	uint8_t	 *peek;		// data read ahead from a stream
+	uint32_t peek_len;	// number of bytes in 'peek'
+	uint32_t peek_pos;	// number of bytes of 'peek' consumed
+	void	 *decoder;	// z_stream or lzma_stream of compressed image
+	uint8_t	 *in_buf;	// raw data read from 'fd', not yet consumed
+	uint32_t in_len;	// number of bytes in 'in_buf'
+	uint32_t in_pos;	// number of bytes of 'in_buf' consumed
+	int	 decoder_end;	// decoder reached end of compressed data
+	int	 seekable;	// 'fd' can be seeked
+	struct iso_tree *tree;	// directory tree of IMAGE_SOURCE_TREE
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Open image source
+ *
+ * This opens the image file 'filename'. Regular files are memory mapped if
+ * the platform supports it, else they are read using read(). Files that are
+ * not regular files are opened as a stream. Directories are opened using
+ * image_source_open_tree().
+ *
+ * Images compressed with gzip or xz are detected by there magic bytes and
+ * decompressed while reading. The uncompressed size is taken from the gzip
+ * trailer or the xz index.
+ *
+ * @param src		Image source to initialize
+ * @param filename	Name of the image file
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_open(struct image_source *src, const char *filename);
+
+/**
+ * Open image file for direct reading
+ *
+ * This opens the uncompressed image file 'filename' with O_DIRECT, so
+ * reading it doesn't fill the page cache of the host. Reads go directly
+ * into the caller's buffer if it is aligned to IMAGE_DIRECT_ALIGN and the
+ * read position is too, else they go through a bounce buffer of the source.
+ * Compressed images and streams can't be opened this way.
+ *
+ * @param src		Image source to initialize
+ * @param filename	Name of the image file
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_open_direct(struct image_source *src, const char *filename);
+
+/**
+ * Open directory tree as image
+ *
+ * This makes an ISO9660 image with Joliet extensions of the files below
+ * 'dirname'. Only the directories and path tables of the image are kept in
+ * memory, the file extents are read from the files when they are reached.
+ * The size of the image is known once the tree is opened.
+ *
+ * @param src		Image source to initialize
+ * @param dirname	Name of the directory
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_open_tree(struct image_source *src, const char *dirname);
+
+/**
+ * Open image stream
+ *
+ * This opens an image that is read from a pipe or another stream that can't
+ * be seeked, like standard input. If 'size' is 0, the image size is taken
+ * from the ISO9660 primary volume descriptor at block 16, which is read
+ * ahead from the stream. Reading stops after 'size' bytes. Compressed
+ * streams are decompressed like compressed files.
+ *
+ * @param src		Image source to initialize
+ * @param fd		File descriptor of the stream
+ * @param size		Size of the image in bytes or 0 to detect it
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_open_stream(struct image_source *src, int fd, uint64_t size);
+
+/**
+ * Read blocks from image source
+ *
+ * This returns the next at most 'max_blocks' blocks of the image. The data
+ * is either copied into 'buf' or, for memory mapped images, returned as a
+ * pointer into the mapping. In both cases '*data' points to the blocks. The
+ * final block of the image is zero padded to U3_BLOCK_SIZE bytes; in a
+ * memory mapped image this block is copied into 'buf'.
+ *
+ * @param src		Image source
+ * @param buf		Buffer of at least 'max_blocks' blocks
+ * @param max_blocks	Maximum number of blocks to return
+ * @param data		Used to return a pointer to the blocks
+ *
+ * @returns		Number of blocks returned, 0 at end of image, or -1 on
+ * 			error, the error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_read(struct image_source *src, uint8_t *buf,
+		uint32_t max_blocks, uint8_t **data);
+
+/**
+ * Set read position of image source
+ *
+ * Streams can't be positioned, seeking a stream fails. Compressed images
+ * can only be positioned at the start of the image.
+ *
+ * @param src		Image source
+ * @param block_num	Number of the block to read next
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+int image_source_seek(struct image_source *src, uint32_t block_num);
+
+/**
+ * Close image source
+ *
+ * @param src		Image source
+ */
+void image_source_close(struct image_source *src);
+
+/**
+ * Get string error message of last error
+ *
+ * @param src		Image source
+ *
+ * @returns		error string of last error
+ */
+const char *image_source_error(struct image_source *src);
+
+#endif // __IMAGE_SOURCE_H__
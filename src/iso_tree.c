@@ -0,0 +1,1000 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "iso_tree.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#define BLOCK			U3_BLOCK_SIZE	// ISO9660 logical block size
+#define PVD_BLOCK		16	// primary volume descriptor
+#define SVD_BLOCK		17	// Joliet supplementary volume descriptor
+#define TERMINATOR_BLOCK	18	// volume descriptor set terminator
+#define PATH_TABLE_BLOCK	19	// first path table
+
+#define FILE_NAME_MAX		30	// name, dot and extension of a file
+#define EXT_MAX			8	// longest extension kept
+#define VOLUME_ID_MAX		32	// longest volume identifier
+#define JOLIET_VOLUME_ID_MAX	16	// longest Joliet volume identifier
+#define APPLICATION_ID		"U3-TOOL"
+
+// length of a directory record and of a path table record
+#define RECORD_LEN(id_len)	(33 + (id_len) + !((id_len) & 1))
+#define PATH_RECORD_LEN(id_len)	(8 + (id_len) + ((id_len) & 1))
+
+#define BLOCKS(bytes)		(((bytes) + BLOCK - 1) / BLOCK)
+
+static void set_error(struct iso_tree *tree, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(tree->err_msg, U3_MAX_ERROR_LEN, fmt, ap);
+	va_end(ap);
+}
+
+static void le16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void be16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void le32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void be32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/**
+ * Store value in both byte orders, little endian first
+ */
+static void both16(uint8_t *p, uint16_t v) {
+	le16(p, v);
+	be16(p + 2, v);
+}
+
+static void both32(uint8_t *p, uint32_t v) {
+	le32(p, v);
+	be32(p + 4, v);
+}
+
+/**
+ * Convert name to ISO9660 identifier
+ *
+ * Characters other than d-characters become '_'. Files get an extension
+ * and version number, directories don't. If 'n' is not zero, "_n" is
+ * appended to the name to make it unique.
+ *
+ * @param name		Original name
+ * @param is_dir	Name of a directory
+ * @param n		Number to make the name unique, or 0
+ * @param out		Buffer of ISO_NAME_MAX + 1 bytes
+ */
+static void make_name(const char *name, int is_dir, unsigned int n,
+	char *out)
+{
+	const char *dot = NULL;
+	char suffix[16] = "";
+	size_t base_len, ext_len = 0, max;
+	size_t i, len = 0;
+
+	if (!is_dir) {
+		dot = strrchr(name, '.');
+		if (dot == name)
+			dot = NULL;
+	}
+	base_len = dot != NULL ? (size_t) (dot - name) : strlen(name);
+	if (dot != NULL) {
+		ext_len = strlen(dot + 1);
+		if (ext_len > EXT_MAX)
+			ext_len = EXT_MAX;
+	}
+
+	if (n > 0)
+		snprintf(suffix, sizeof(suffix), "_%u", n);
+	max = (is_dir ? ISO_NAME_MAX - 1 : FILE_NAME_MAX - 1 - ext_len) -
+		strlen(suffix);
+	if (base_len > max)
+		base_len = max;
+
+	for (i = 0; i < base_len; i++)
+		out[len++] = name[i];
+	strcpy(out + len, suffix);
+	len += strlen(suffix);
+	if (!is_dir) {
+		out[len++] = '.';
+		for (i = 0; i < ext_len; i++)
+			out[len++] = dot[1 + i];
+	}
+	out[len] = '\0';
+
+	// d-characters only
+	for (i = 0; i < len; i++) {
+		if (out[i] >= 'a' && out[i] <= 'z')
+			out[i] -= 'a' - 'A';
+		else if (!(out[i] >= 'A' && out[i] <= 'Z') &&
+			 !(out[i] >= '0' && out[i] <= '9') &&
+			 !(out[i] == '.' && !is_dir && i == len - ext_len - 1))
+			out[i] = '_';
+	}
+
+	if (!is_dir)
+		strcpy(out + len, ";1");
+}
+
+/**
+ * Convert name to Joliet identifier
+ *
+ * The name is decoded as UTF-8. Characters that Joliet doesn't allow or
+ * that don't fit in UCS-2 become '_'. If 'n' is not zero, "~n" is appended
+ * to the name to make it unique.
+ *
+ * @param name		Original name
+ * @param is_dir	Name of a directory
+ * @param n		Number to make the name unique, or 0
+ * @param max		Maximum length of the identifier
+ * @param out		Buffer of 'max' characters
+ *
+ * @returns		Length of the identifier in characters
+ */
+static unsigned int make_jname(const char *name, int is_dir, unsigned int n,
+	unsigned int max, uint16_t *out)
+{
+	const unsigned char *p = (const unsigned char *) name;
+	char suffix[16] = "";
+	unsigned int len = 0, i;
+	uint32_t c;
+	int follow;
+
+	if (n > 0)
+		snprintf(suffix, sizeof(suffix), "~%u", n);
+	max -= strlen(suffix) + (is_dir ? 0 : 2);
+
+	while (*p != '\0' && len < max) {
+		c = *p++;
+		follow = 0;
+		if (c >= 0xF0) {
+			c &= 0x07;
+			follow = 3;
+		} else if (c >= 0xE0) {
+			c &= 0x0F;
+			follow = 2;
+		} else if (c >= 0xC0) {
+			c &= 0x1F;
+			follow = 1;
+		} else if (c >= 0x80) {
+			c = '_';
+		}
+		for (; follow > 0; follow--) {
+			if ((*p & 0xC0) != 0x80) {
+				c = '_';
+				break;
+			}
+			c = (c << 6) | (*p++ & 0x3F);
+		}
+
+		if (c < 0x20 || c > 0xFFFF || (c >= 0xD800 && c <= 0xDFFF) ||
+		    (c < 0x80 && strchr("*/:;?\\", (int) c) != NULL))
+			c = '_';
+		out[len++] = c;
+	}
+
+	for (i = 0; suffix[i] != '\0'; i++)
+		out[len++] = suffix[i];
+	if (!is_dir) {
+		out[len++] = ';';
+		out[len++] = '1';
+	}
+
+	return len;
+}
+
+/**
+ * Order of entries in an ISO9660 directory
+ */
+static int compare_name(const void *a, const void *b) {
+	const struct iso_node *na = *(const struct iso_node * const *) a;
+	const struct iso_node *nb = *(const struct iso_node * const *) b;
+
+	return strcmp(na->name, nb->name);
+}
+
+/**
+ * Order of entries in a Joliet directory
+ */
+static int compare_jname(const void *a, const void *b) {
+	const struct iso_node *na = *(const struct iso_node * const *) a;
+	const struct iso_node *nb = *(const struct iso_node * const *) b;
+	unsigned int i;
+
+	for (i = 0; i < na->jname_len && i < nb->jname_len; i++) {
+		if (na->jname[i] != nb->jname[i])
+			return na->jname[i] < nb->jname[i] ? -1 : 1;
+	}
+	return (int) na->jname_len - (int) nb->jname_len;
+}
+
+/**
+ * Name a new entry of a directory, unique among the entries so far
+ */
+static void name_node(struct iso_node *dir, struct iso_node *node,
+	const char *name)
+{
+	unsigned int i, n;
+
+	for (n = 0;; n++) {
+		make_name(name, node->is_dir, n, node->name);
+		for (i = 0; i < dir->nchildren; i++) {
+			if (strcmp(dir->children[i]->name, node->name) == 0)
+				break;
+		}
+		if (i == dir->nchildren)
+			break;
+	}
+
+	for (n = 0;; n++) {
+		node->jname_len = make_jname(name, node->is_dir, n,
+				ISO_JOLIET_NAME_MAX, node->jname);
+		for (i = 0; i < dir->nchildren; i++) {
+			if (compare_jname(&dir->children[i], &node) == 0)
+				break;
+		}
+		if (i == dir->nchildren)
+			break;
+	}
+}
+
+/**
+ * Free node and everything below it
+ */
+static void free_node(struct iso_node *node) {
+	unsigned int i;
+
+	for (i = 0; i < node->nchildren; i++)
+		free_node(node->children[i]);
+	free(node->children);
+	free(node->jchildren);
+	free(node->path);
+	free(node);
+}
+
+/**
+ * Scan directory and the directories below it
+ */
+static int scan_dir(struct iso_tree *tree, struct iso_node *dir,
+	unsigned int depth)
+{
+	struct iso_node **children;
+	struct iso_node *node;
+	struct dirent *de;
+	struct stat st;
+	unsigned int alloced = 0;
+	unsigned int i;
+	char *path;
+	DIR *d;
+
+	if (depth > ISO_MAX_DEPTH) {
+		set_error(tree, "Directory tree too deep at %s", dir->path);
+		return U3_FAILURE;
+	}
+
+	if ((d = opendir(dir->path)) == NULL) {
+		set_error(tree, "Failed opening directory %s: %s", dir->path,
+			strerror(errno));
+		return U3_FAILURE;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		path = (char *) malloc(strlen(dir->path) +
+				strlen(de->d_name) + 2);
+		if (path == NULL) {
+			set_error(tree, "Failed allocating memory for "
+				"directory tree");
+			closedir(d);
+			return U3_FAILURE;
+		}
+		sprintf(path, "%s/%s", dir->path, de->d_name);
+
+		if (stat(path, &st) == -1) {
+			set_error(tree, "Failed stating %s: %s", path,
+				strerror(errno));
+			free(path);
+			closedir(d);
+			return U3_FAILURE;
+		}
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			if (debug) {
+				fprintf(stderr, "Skipping %s, not a file or "
+					"directory\n", path);
+			}
+			free(path);
+			continue;
+		}
+		if (S_ISREG(st.st_mode) && (uint64_t) st.st_size > UINT32_MAX) {
+			set_error(tree, "File %s is too big for ISO9660", path);
+			free(path);
+			closedir(d);
+			return U3_FAILURE;
+		}
+
+		if (dir->nchildren == alloced) {
+			alloced = alloced ? 2 * alloced : 16;
+			children = (struct iso_node **) realloc(dir->children,
+					alloced * sizeof(struct iso_node *));
+			if (children == NULL) {
+				set_error(tree, "Failed allocating memory for "
+					"directory tree");
+				free(path);
+				closedir(d);
+				return U3_FAILURE;
+			}
+			dir->children = children;
+		}
+
+		node = (struct iso_node *) calloc(1, sizeof(struct iso_node));
+		if (node == NULL) {
+			set_error(tree, "Failed allocating memory for "
+				"directory tree");
+			free(path);
+			closedir(d);
+			return U3_FAILURE;
+		}
+		node->parent = dir;
+		node->path = path;
+		node->is_dir = S_ISDIR(st.st_mode);
+		node->size = node->is_dir ? 0 : st.st_size;
+		node->mtime = st.st_mtime;
+		name_node(dir, node, de->d_name);
+
+		dir->children[dir->nchildren++] = node;
+		if (node->is_dir)
+			tree->ndirs++;
+		else
+			tree->nfiles++;
+	}
+	closedir(d);
+
+	dir->jchildren = (struct iso_node **) malloc((dir->nchildren + 1) *
+			sizeof(struct iso_node *));
+	if (dir->jchildren == NULL) {
+		set_error(tree, "Failed allocating memory for directory tree");
+		return U3_FAILURE;
+	}
+	if (dir->nchildren > 0) {
+		memcpy(dir->jchildren, dir->children,
+			dir->nchildren * sizeof(struct iso_node *));
+		qsort(dir->children, dir->nchildren,
+			sizeof(struct iso_node *), compare_name);
+		qsort(dir->jchildren, dir->nchildren,
+			sizeof(struct iso_node *), compare_jname);
+	}
+
+	for (i = 0; i < dir->nchildren; i++) {
+		if (dir->children[i]->is_dir &&
+		    scan_dir(tree, dir->children[i], depth + 1) != U3_SUCCESS)
+			return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * List directories breadth first, which is the path table order
+ */
+static void list_dirs(struct iso_node *root, struct iso_node **dirs,
+	int joliet)
+{
+	struct iso_node **children;
+	unsigned int head, tail = 0;
+	unsigned int i;
+
+	dirs[tail++] = root;
+	for (head = 0; head < tail; head++) {
+		children = joliet ? dirs[head]->jchildren :
+				dirs[head]->children;
+		for (i = 0; i < dirs[head]->nchildren; i++) {
+			if (children[i]->is_dir)
+				dirs[tail++] = children[i];
+		}
+	}
+}
+
+/**
+ * Get identifier of a node in directory records and path tables
+ *
+ * @param buf		Buffer of 2 * ISO_JOLIET_NAME_MAX bytes
+ *
+ * @returns		Length of identifier in bytes
+ */
+static unsigned int node_id(const struct iso_node *node, int joliet,
+	uint8_t *buf)
+{
+	unsigned int i;
+
+	if (!joliet) {
+		memcpy(buf, node->name, strlen(node->name));
+		return strlen(node->name);
+	}
+
+	for (i = 0; i < node->jname_len; i++)
+		be16(buf + 2 * i, node->jname[i]);
+	return 2 * node->jname_len;
+}
+
+/**
+ * Get position of a directory record, records don't cross blocks
+ */
+static uint32_t record_pos(uint32_t pos, unsigned int len) {
+	if (pos % BLOCK + len > BLOCK)
+		pos += BLOCK - pos % BLOCK;
+	return pos;
+}
+
+/**
+ * Get size of directory in bytes, a multiple of the block size
+ */
+static uint32_t dir_size(const struct iso_node *dir, int joliet) {
+	struct iso_node **children = joliet ? dir->jchildren : dir->children;
+	uint8_t id[2 * ISO_JOLIET_NAME_MAX];
+	uint32_t pos = 2 * RECORD_LEN(1);	// "." and ".."
+	unsigned int len, i;
+
+	for (i = 0; i < dir->nchildren; i++) {
+		len = RECORD_LEN(node_id(children[i], joliet, id));
+		pos = record_pos(pos, len) + len;
+	}
+
+	return BLOCKS(pos) * BLOCK;
+}
+
+/**
+ * Write recording date of directory record
+ */
+static void record_date(uint8_t *p, time_t t) {
+	struct tm *tm = gmtime(&t);
+
+	memset(p, 0, 7);
+	if (tm == NULL)
+		return;
+	p[0] = tm->tm_year;
+	p[1] = tm->tm_mon + 1;
+	p[2] = tm->tm_mday;
+	p[3] = tm->tm_hour;
+	p[4] = tm->tm_min;
+	p[5] = tm->tm_sec;
+}
+
+/**
+ * Write directory record
+ */
+static void write_record(uint8_t *p, const uint8_t *id, unsigned int id_len,
+	uint32_t extent, uint32_t size, int is_dir, time_t mtime)
+{
+	p[0] = RECORD_LEN(id_len);
+	both32(p + 2, extent);
+	both32(p + 10, size);
+	record_date(p + 18, mtime);
+	p[25] = is_dir ? 0x02 : 0x00;
+	both16(p + 28, 1);		// volume sequence number
+	p[32] = id_len;
+	memcpy(p + 33, id, id_len);
+}
+
+/**
+ * Write the records of a directory
+ */
+static void write_dir(struct iso_tree *tree, const struct iso_node *dir,
+	int joliet)
+{
+	const struct iso_node *child;
+	const struct iso_node *parent = dir->parent;
+	uint8_t id[2 * ISO_JOLIET_NAME_MAX];
+	uint8_t *p;
+	uint32_t pos = 0;
+	unsigned int id_len, len, i;
+
+	p = tree->meta + (size_t) (joliet ? dir->jextent : dir->extent) * BLOCK;
+
+	id[0] = 0;
+	write_record(p + pos, id, 1, joliet ? dir->jextent : dir->extent,
+		joliet ? dir->jdir_size : dir->dir_size, 1, dir->mtime);
+	pos += RECORD_LEN(1);
+	id[0] = 1;
+	write_record(p + pos, id, 1, joliet ? parent->jextent : parent->extent,
+		joliet ? parent->jdir_size : parent->dir_size, 1,
+		parent->mtime);
+	pos += RECORD_LEN(1);
+
+	for (i = 0; i < dir->nchildren; i++) {
+		child = joliet ? dir->jchildren[i] : dir->children[i];
+		id_len = node_id(child, joliet, id);
+		len = RECORD_LEN(id_len);
+		pos = record_pos(pos, len);
+
+		if (child->is_dir) {
+			write_record(p + pos, id, id_len,
+				joliet ? child->jextent : child->extent,
+				joliet ? child->jdir_size : child->dir_size,
+				1, child->mtime);
+		} else {
+			write_record(p + pos, id, id_len, child->extent,
+				child->size, 0, child->mtime);
+		}
+		pos += len;
+	}
+}
+
+/**
+ * Get size of a path table in bytes
+ */
+static uint32_t path_table_size(struct iso_node **dirs, unsigned int ndirs,
+	int joliet)
+{
+	uint8_t id[2 * ISO_JOLIET_NAME_MAX];
+	uint32_t size = PATH_RECORD_LEN(1);	// root
+	unsigned int i;
+
+	for (i = 1; i < ndirs; i++)
+		size += PATH_RECORD_LEN(node_id(dirs[i], joliet, id));
+
+	return size;
+}
+
+/**
+ * Write path table
+ */
+static void write_path_table(uint8_t *p, struct iso_node **dirs,
+	unsigned int ndirs, int joliet, int big_endian)
+{
+	uint8_t id[2 * ISO_JOLIET_NAME_MAX];
+	unsigned int id_len, i;
+	uint32_t extent;
+	uint16_t parent;
+
+	for (i = 0; i < ndirs; i++) {
+		if (i == 0) {
+			id[0] = 0;
+			id_len = 1;
+		} else {
+			id_len = node_id(dirs[i], joliet, id);
+		}
+		extent = joliet ? dirs[i]->jextent : dirs[i]->extent;
+		parent = joliet ? dirs[i]->parent->jdir_num :
+				dirs[i]->parent->dir_num;
+
+		p[0] = id_len;
+		if (big_endian) {
+			be32(p + 2, extent);
+			be16(p + 6, parent);
+		} else {
+			le32(p + 2, extent);
+			le16(p + 6, parent);
+		}
+		memcpy(p + 8, id, id_len);
+		p += PATH_RECORD_LEN(id_len);
+	}
+}
+
+/**
+ * Fill text field of a volume descriptor, padded with spaces
+ */
+static void text_field(uint8_t *p, unsigned int len, const char *s,
+	int joliet)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (!joliet)
+			p[i] = ' ';
+		else
+			p[i] = i % 2 ? ' ' : 0;
+	}
+	for (i = 0; s[i] != '\0' && (joliet ? 2 * i + 1 : i) < len; i++) {
+		if (joliet)
+			p[2 * i + 1] = s[i];
+		else
+			p[i] = s[i];
+	}
+}
+
+/**
+ * Fill date field of a volume descriptor
+ */
+static void date_field(uint8_t *p, time_t t) {
+	struct tm *tm = t ? gmtime(&t) : NULL;
+	char buf[80];			// ints of any value fit
+
+	if (tm == NULL) {
+		memcpy(p, "0000000000000000", 16);
+	} else {
+		snprintf(buf, sizeof(buf), "%04d%02d%02d%02d%02d%02d00",
+			tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+			tm->tm_hour, tm->tm_min, tm->tm_sec);
+		memcpy(p, buf, 16);
+	}
+	p[16] = 0;
+}
+
+/**
+ * Write primary or Joliet volume descriptor
+ *
+ * @param volume_id	ISO9660 volume identifier
+ * @param jvolume_id	Joliet volume identifier
+ * @param jvolume_len	Characters in 'jvolume_id'
+ * @param path_table	Size of path table in bytes
+ * @param l_table	Block of little endian path table
+ * @param m_table	Block of big endian path table
+ */
+static void write_volume_descriptor(struct iso_tree *tree, int joliet,
+	const char *volume_id, const uint16_t *jvolume_id,
+	unsigned int jvolume_len, uint32_t path_table, uint32_t l_table,
+	uint32_t m_table)
+{
+	uint8_t *p = tree->meta + (joliet ? SVD_BLOCK : PVD_BLOCK) * BLOCK;
+	uint8_t id = 0;
+	time_t newest = 0;
+	unsigned int i;
+
+	// Date the volume by its newest entry, not by the clock, so an
+	// unchanged tree gives the same image. --diff and --resume rely on it.
+	for (i = 0; i < tree->ndirs; i++) {
+		if (tree->dirs[i]->mtime > newest)
+			newest = tree->dirs[i]->mtime;
+	}
+	for (i = 0; i < tree->nfiles; i++) {
+		if (tree->files[i]->mtime > newest)
+			newest = tree->files[i]->mtime;
+	}
+
+	p[0] = joliet ? 2 : 1;
+	memcpy(p + 1, "CD001", 5);
+	p[6] = 1;
+	text_field(p + 8, 32, "", joliet);		// system
+	text_field(p + 40, 32, joliet ? "" : volume_id, joliet);
+	if (joliet) {
+		for (i = 0; i < jvolume_len; i++)
+			be16(p + 40 + 2 * i, jvolume_id[i]);
+		// escape sequence of UCS-2 level 3
+		p[88] = 0x25;
+		p[89] = 0x2F;
+		p[90] = 0x45;
+	}
+	both32(p + 80, tree->blocks);
+	both16(p + 120, 1);			// volume set size
+	both16(p + 124, 1);			// volume sequence number
+	both16(p + 128, BLOCK);
+	both32(p + 132, path_table);
+	le32(p + 140, l_table);
+	be32(p + 148, m_table);
+	write_record(p + 156, &id, 1,
+		joliet ? tree->root->jextent : tree->root->extent,
+		joliet ? tree->root->jdir_size : tree->root->dir_size, 1,
+		tree->root->mtime);
+	text_field(p + 190, 128, "", joliet);		// volume set
+	text_field(p + 318, 128, "", joliet);		// publisher
+	text_field(p + 446, 128, "", joliet);		// data preparer
+	text_field(p + 574, 128, APPLICATION_ID, joliet);
+	text_field(p + 702, 37, "", joliet);		// copyright file
+	text_field(p + 739, 37, "", joliet);		// abstract file
+	text_field(p + 776, 37, "", joliet);		// bibliographic file
+	date_field(p + 813, newest);			// creation
+	date_field(p + 830, newest);			// modification
+	date_field(p + 847, 0);				// expiration
+	date_field(p + 864, 0);				// effective
+	p[881] = 1;					// file structure version
+}
+
+/**
+ * Compute the layout of the image and build its metadata
+ */
+static int layout(struct iso_tree *tree, const char *volume_name) {
+	char volume_id[ISO_NAME_MAX + 1];
+	uint16_t jvolume_id[JOLIET_VOLUME_ID_MAX];
+	unsigned int jvolume_len;
+	struct iso_node *dir;
+	uint32_t pt_size, jpt_size;
+	uint32_t l_table, m_table, jl_table, jm_table;
+	uint64_t block;
+	unsigned int i, j, k = 0;
+
+	tree->dirs = (struct iso_node **) malloc(tree->ndirs *
+			sizeof(struct iso_node *));
+	tree->jdirs = (struct iso_node **) malloc(tree->ndirs *
+			sizeof(struct iso_node *));
+	tree->files = (struct iso_node **) malloc((tree->nfiles + 1) *
+			sizeof(struct iso_node *));
+	if (tree->dirs == NULL || tree->jdirs == NULL || tree->files == NULL) {
+		set_error(tree, "Failed allocating memory for directory tree");
+		return U3_FAILURE;
+	}
+
+	list_dirs(tree->root, tree->dirs, 0);
+	list_dirs(tree->root, tree->jdirs, 1);
+	for (i = 0; i < tree->ndirs; i++) {
+		tree->dirs[i]->dir_num = i + 1;
+		tree->jdirs[i]->jdir_num = i + 1;
+	}
+	if (tree->ndirs > UINT16_MAX) {
+		set_error(tree, "Too many directories for ISO9660");
+		return U3_FAILURE;
+	}
+
+	// path tables, then the directories of both hierarchies
+	pt_size = path_table_size(tree->dirs, tree->ndirs, 0);
+	jpt_size = path_table_size(tree->jdirs, tree->ndirs, 1);
+	block = PATH_TABLE_BLOCK;
+	l_table = block;
+	block += BLOCKS(pt_size);
+	m_table = block;
+	block += BLOCKS(pt_size);
+	jl_table = block;
+	block += BLOCKS(jpt_size);
+	jm_table = block;
+	block += BLOCKS(jpt_size);
+
+	for (i = 0; i < tree->ndirs; i++) {
+		dir = tree->dirs[i];
+		dir->dir_size = dir_size(dir, 0);
+		dir->extent = block;
+		block += dir->dir_size / BLOCK;
+	}
+	for (i = 0; i < tree->ndirs; i++) {
+		dir = tree->jdirs[i];
+		dir->jdir_size = dir_size(dir, 1);
+		dir->jextent = block;
+		block += dir->jdir_size / BLOCK;
+	}
+	tree->meta_blocks = block;
+
+	// file extents in path table order of their directories
+	for (i = 0; i < tree->ndirs; i++) {
+		dir = tree->dirs[i];
+		for (j = 0; j < dir->nchildren; j++) {
+			if (dir->children[j]->is_dir)
+				continue;
+			tree->files[k++] = dir->children[j];
+			dir->children[j]->extent = block;
+			block += BLOCKS(dir->children[j]->size);
+			if (block > UINT32_MAX)
+				break;
+		}
+	}
+	if (block > UINT32_MAX) {
+		set_error(tree, "Directory tree too big for ISO9660");
+		return U3_FAILURE;
+	}
+	tree->blocks = block;
+
+	tree->meta = (uint8_t *) calloc(tree->meta_blocks, BLOCK);
+	if (tree->meta == NULL) {
+		set_error(tree, "Failed allocating memory for directories");
+		return U3_FAILURE;
+	}
+
+	make_name(volume_name, 1, 0, volume_id);
+	jvolume_len = make_jname(volume_name, 1, 0, JOLIET_VOLUME_ID_MAX,
+			jvolume_id);
+	write_volume_descriptor(tree, 0, volume_id, NULL, 0, pt_size,
+		l_table, m_table);
+	write_volume_descriptor(tree, 1, NULL, jvolume_id, jvolume_len,
+		jpt_size, jl_table, jm_table);
+
+	tree->meta[TERMINATOR_BLOCK * BLOCK] = 255;
+	memcpy(tree->meta + TERMINATOR_BLOCK * BLOCK + 1, "CD001", 5);
+	tree->meta[TERMINATOR_BLOCK * BLOCK + 6] = 1;
+
+	write_path_table(tree->meta + l_table * BLOCK, tree->dirs, tree->ndirs,
+		0, 0);
+	write_path_table(tree->meta + m_table * BLOCK, tree->dirs, tree->ndirs,
+		0, 1);
+	write_path_table(tree->meta + jl_table * BLOCK, tree->jdirs,
+		tree->ndirs, 1, 0);
+	write_path_table(tree->meta + jm_table * BLOCK, tree->jdirs,
+		tree->ndirs, 1, 1);
+
+	for (i = 0; i < tree->ndirs; i++) {
+		write_dir(tree, tree->dirs[i], 0);
+		write_dir(tree, tree->jdirs[i], 1);
+	}
+
+	return U3_SUCCESS;
+}
+
+int iso_tree_open(struct iso_tree *tree, const char *dir) {
+	struct stat st;
+	const char *name;
+	size_t len;
+
+	memset(tree, 0, sizeof(struct iso_tree));
+	tree->fd = -1;
+
+	if (stat(dir, &st) == -1) {
+		set_error(tree, "Failed stating %s: %s", dir, strerror(errno));
+		return U3_FAILURE;
+	}
+
+	tree->root = (struct iso_node *) calloc(1, sizeof(struct iso_node));
+	if (tree->root == NULL || (tree->root->path = strdup(dir)) == NULL) {
+		set_error(tree, "Failed allocating memory for directory tree");
+		iso_tree_close(tree);
+		return U3_FAILURE;
+	}
+	tree->root->parent = tree->root;
+	tree->root->is_dir = 1;
+	tree->root->mtime = st.st_mtime;
+	tree->ndirs = 1;
+
+	// the volume is named after the directory
+	len = strlen(tree->root->path);
+	while (len > 1 && tree->root->path[len - 1] == '/')
+		tree->root->path[--len] = '\0';
+	name = strrchr(tree->root->path, '/');
+	name = name != NULL ? name + 1 : tree->root->path;
+	if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		name = "CDROM";
+
+	if (scan_dir(tree, tree->root, 0) != U3_SUCCESS ||
+	    layout(tree, name) != U3_SUCCESS)
+	{
+		iso_tree_close(tree);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Find the file that holds a block, the block must be beyond 'meta'
+ */
+static unsigned int find_file(struct iso_tree *tree, uint32_t block_num) {
+	unsigned int lo = 0, hi = tree->nfiles, mid;
+
+	// last file starting at or before the block, empty files come first
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (tree->files[mid]->extent <= block_num)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int iso_tree_read(struct iso_tree *tree, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *buf)
+{
+	struct iso_node *file;
+	unsigned int index;
+	uint32_t cnt, first;
+	uint64_t offset;
+	size_t len, done;
+	ssize_t res;
+
+	while (block_cnt > 0) {
+		if (block_num < tree->meta_blocks) {
+			cnt = tree->meta_blocks - block_num;
+			if (cnt > block_cnt)
+				cnt = block_cnt;
+			memcpy(buf, tree->meta + (size_t) block_num * BLOCK,
+				(size_t) cnt * BLOCK);
+		} else if (block_num >= tree->blocks || tree->nfiles == 0) {
+			set_error(tree, "Read beyond end of image");
+			return U3_FAILURE;
+		} else {
+			index = find_file(tree, block_num);
+			file = tree->files[index];
+			first = block_num - file->extent;
+			cnt = BLOCKS(file->size) - first;
+			if (cnt > block_cnt)
+				cnt = block_cnt;
+
+			if (tree->fd == -1 || tree->cur != index) {
+				if (tree->fd != -1)
+					close(tree->fd);
+				tree->fd = open(file->path, O_RDONLY | O_BINARY);
+				if (tree->fd == -1) {
+					set_error(tree, "Failed opening %s: %s",
+						file->path, strerror(errno));
+					return U3_FAILURE;
+				}
+				tree->cur = index;
+			}
+
+			offset = (uint64_t) first * BLOCK;
+			len = (size_t) cnt * BLOCK;
+			if (len > file->size - offset)
+				len = file->size - offset;
+			if (lseek(tree->fd, offset, SEEK_SET) == (off_t) -1) {
+				set_error(tree, "Failed seeking in %s: %s",
+					file->path, strerror(errno));
+				return U3_FAILURE;
+			}
+			for (done = 0; done < len; done += res) {
+				res = read(tree->fd, buf + done, len - done);
+				if (res == -1 && errno == EINTR) {
+					res = 0;
+					continue;
+				}
+				if (res == -1) {
+					set_error(tree, "Failed reading %s: %s",
+						file->path, strerror(errno));
+					return U3_FAILURE;
+				}
+				if (res == 0) {
+					set_error(tree, "File %s shrank while "
+						"loading", file->path);
+					return U3_FAILURE;
+				}
+			}
+			// zero the rest of the last block of the file
+			memset(buf + len, 0, (size_t) cnt * BLOCK - len);
+		}
+
+		buf += (size_t) cnt * BLOCK;
+		block_num += cnt;
+		block_cnt -= cnt;
+	}
+
+	return U3_SUCCESS;
+}
+
+void iso_tree_close(struct iso_tree *tree) {
+	if (tree->fd != -1)
+		close(tree->fd);
+	tree->fd = -1;
+	if (tree->root != NULL)
+		free_node(tree->root);
+	tree->root = NULL;
+	free(tree->dirs);
+	free(tree->jdirs);
+	free(tree->files);
+	free(tree->meta);
+	tree->dirs = tree->jdirs = tree->files = NULL;
+	tree->meta = NULL;
+}
@@ -0,0 +1,125 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __ISO_TREE_H__
+#define __ISO_TREE_H__
+/**
+ * @file	iso_tree.h
+ *
+ *		ISO9660 images generated from a directory tree. The layout of
+ *		the image is computed when the tree is opened: the volume
+ *		descriptors, the path tables and the directories of both the
+ *		ISO9660 and the Joliet hierarchy are built in memory. The file
+ *		extents follow and are read from the source files only when
+ *		their blocks are asked for, so no temporary image is written.
+ *
+ *		ISO9660 names follow interchange level 2: up to 30 upper case
+ *		d-characters plus ";1". The Joliet names keep the original
+ *		names, up to 64 UCS-2 characters. Both hierarchies share the
+ *		file extents.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "u3.h"
+
+#define ISO_NAME_MAX		32	// longest ISO9660 identifier
+#define ISO_JOLIET_NAME_MAX	64	// longest Joliet identifier, in UCS-2
+#define ISO_MAX_DEPTH		32	// deepest directory scanned
+
+/**
+ * A file or directory of the tree
+ */
+struct iso_node {
+	struct iso_node	 *parent;	// parent directory, root is its own
+	struct iso_node	 **children;	// entries in ISO9660 order
+	struct iso_node	 **jchildren;	// entries in Joliet order
+	unsigned int	 nchildren;	// number of entries
+	int		 is_dir;	// node is a directory
+	char		 *path;		// path of source file
+	char		 name[ISO_NAME_MAX + 1];	// ISO9660 identifier
+	uint16_t	 jname[ISO_JOLIET_NAME_MAX];	// Joliet identifier
+	unsigned int	 jname_len;	// characters in 'jname'
+	uint64_t	 size;		// size of file in bytes
+	time_t		 mtime;		// modification time
+	uint32_t	 extent;	// first block of file or ISO9660
+					// directory
+	uint32_t	 jextent;	// first block of Joliet directory
+	uint32_t	 dir_size;	// bytes of ISO9660 directory
+	uint32_t	 jdir_size;	// bytes of Joliet directory
+	unsigned int	 dir_num;	// number in ISO9660 path table
+	unsigned int	 jdir_num;	// number in Joliet path table
+};
+
+/**
+ * Image of a directory tree
+ */
+struct iso_tree {
+	struct iso_node	 *root;		// root directory
+	struct iso_node	 **dirs;	// directories in ISO9660 path table
+					// order
+	struct iso_node	 **jdirs;	// directories in Joliet path table order
+	unsigned int	 ndirs;		// number of directories
+	struct iso_node	 **files;	// files in extent order
+	unsigned int	 nfiles;	// number of files
+	uint8_t		 *meta;		// blocks before the first file extent
+	uint32_t	 meta_blocks;	// number of blocks in 'meta'
+	uint32_t	 blocks;	// number of blocks in image
+	int		 fd;		// source file being read, or -1
+	unsigned int	 cur;		// index in 'files' of 'fd'
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Open directory tree as image
+ *
+ * This scans the tree below 'dir' and computes the layout of the image.
+ * Symbolic links are followed, entries that are neither regular files nor
+ * directories are skipped. Files must be smaller than 4 GiB.
+ *
+ * @param tree		Tree to initialize
+ * @param dir		Path of the directory that becomes the root
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be found in tree->err_msg
+ */
+int iso_tree_open(struct iso_tree *tree, const char *dir);
+
+/**
+ * Read blocks of the image
+ *
+ * @param tree		Tree opened using iso_tree_open()
+ * @param block_num	First block to read
+ * @param block_cnt	Number of blocks to read
+ * @param buf		Buffer of 'block_cnt' blocks
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be found in tree->err_msg
+ */
+int iso_tree_read(struct iso_tree *tree, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *buf);
+
+/**
+ * Close tree
+ *
+ * @param tree		Tree opened using iso_tree_open()
+ */
+void iso_tree_close(struct iso_tree *tree);
+
+#endif // __ISO_TREE_H__
@@ -0,0 +1,139 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "load_journal.h"
+#include "state_dir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define JOURNAL_MAGIC		"u3-tool-journal 2"
+#define JOURNAL_MAGIC_V1	"u3-tool-journal 1"	// without clean_from
+#define JOURNAL_PATH_LEN	1024
+
+/**
+ * Get path of journal file of a device
+ */
+static int journal_path(const char *serial, char *path, size_t path_len) {
+	char name[U3_MAX_SERIAL_LEN + 16];
+
+	snprintf(name, sizeof(name), "%s.journal", serial);
+	return state_dir_path(name, path, path_len);
+}
+
+int load_journal_read(const char *serial, struct load_journal *journal) {
+	char path[JOURNAL_PATH_LEN];
+	char magic[32];
+	char digest[2 * LOAD_JOURNAL_DIGEST_LEN + 1];
+	uint64_t image_size;
+	uint32_t blocks_done;
+	uint32_t clean_from = LOAD_JOURNAL_NOT_CLEAN;
+	unsigned int i, byte;
+	FILE *fp;
+	int res;
+
+	if (journal_path(serial, path, sizeof(path)) == -1)
+		return -1;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+
+	res = fscanf(fp, "%31[^\n]\nimage_size %" SCNu64 "\nblocks_done %"
+		SCNu32 "\ndigest %32s", magic, &image_size, &blocks_done,
+		digest);
+	if (res == 4 && strcmp(magic, JOURNAL_MAGIC) == 0) {
+		if (fscanf(fp, "\nclean_from %" SCNu32, &clean_from) != 1)
+			res = 0;
+	} else if (res == 4 && strcmp(magic, JOURNAL_MAGIC_V1) != 0) {
+		res = 0;
+	}
+	fclose(fp);
+
+	if (res != 4 || strlen(digest) != 2 * LOAD_JOURNAL_DIGEST_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(journal, 0, sizeof(struct load_journal));
+	strncpy(journal->serial, serial, U3_MAX_SERIAL_LEN);
+	journal->image_size = image_size;
+	journal->blocks_done = blocks_done;
+	journal->clean_from = clean_from;
+	for (i = 0; i < LOAD_JOURNAL_DIGEST_LEN; i++) {
+		if (sscanf(digest + 2 * i, "%2x", &byte) != 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		journal->digest[i] = byte;
+	}
+
+	return 0;
+}
+
+int load_journal_write(const struct load_journal *journal) {
+	char path[JOURNAL_PATH_LEN];
+	char tmp_path[JOURNAL_PATH_LEN + 4];
+	unsigned int i;
+	FILE *fp;
+
+	if (journal_path(journal->serial, path, sizeof(path)) == -1)
+		return -1;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+
+	if ((fp = fopen(tmp_path, "w")) == NULL)
+		return -1;
+
+	fprintf(fp, "%s\nimage_size %" PRIu64 "\nblocks_done %" PRIu32
+		"\ndigest ", JOURNAL_MAGIC, journal->image_size,
+		journal->blocks_done);
+	for (i = 0; i < LOAD_JOURNAL_DIGEST_LEN; i++)
+		fprintf(fp, "%.2x", journal->digest[i]);
+	fprintf(fp, "\nclean_from %" PRIu32 "\n", journal->clean_from);
+
+	if (fclose(fp) != 0) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	// replace old record in one step
+	if (rename(tmp_path, path) == -1) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int load_journal_remove(const char *serial) {
+	char path[JOURNAL_PATH_LEN];
+
+	if (journal_path(serial, path, sizeof(path)) == -1)
+		return -1;
+
+	if (remove(path) == -1 && errno != ENOENT)
+		return -1;
+
+	return 0;
+}
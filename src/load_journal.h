@@ -0,0 +1,90 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __LOAD_JOURNAL_H__
+#define __LOAD_JOURNAL_H__
+/**
+ * @file	load_journal.h
+ *
+ *		Checkpoint journal of CD image loads. For every device serial
+ *		the journal records how many blocks of which image are known
+ *		to be written, so an interrupted load can be resumed.
+ *
+ *		The image is identified by its size and the MD5 digest of the
+ *		blocks written so far. A resumed load hashes the same number
+ *		of blocks of the new image; if the digest matches, the device
+ *		already holds these blocks.
+ *
+ *		The journal also tracks which part of the CD partition has not
+ *		been written since the device was partitioned. Every record of
+ *		a load raises 'clean_from' beyond the blocks that may be written
+ *		before the next record.
+ */
+
+#include <stdint.h>
+
+#include "u3_commands.h"
+
+#define LOAD_JOURNAL_DIGEST_LEN		16
+#define LOAD_JOURNAL_NOT_CLEAN		UINT32_MAX
+
+/**
+ * Journal record of one device
+ */
+struct load_journal {
+	char	 serial[U3_MAX_SERIAL_LEN+1];	// device serial, key of record
+	uint64_t image_size;		// size of image in bytes
+	uint32_t blocks_done;		// blocks written and acknowledged
+	uint8_t  digest[LOAD_JOURNAL_DIGEST_LEN]; // MD5 of written blocks
+	uint32_t clean_from;		// first of the blocks not written since
+					// partitioning, or
+					// LOAD_JOURNAL_NOT_CLEAN if unknown
+};
+
+/**
+ * Read journal record
+ *
+ * @param serial	Serial number of device
+ * @param journal	Used to return the record
+ *
+ * @returns		0 if a record was read, else -1 and errno is set
+ */
+int load_journal_read(const char *serial, struct load_journal *journal);
+
+/**
+ * Write journal record
+ *
+ * The record replaces the existing record of 'journal->serial' atomically.
+ *
+ * @param journal	Record to write
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int load_journal_write(const struct load_journal *journal);
+
+/**
+ * Remove journal record
+ *
+ * @param serial	Serial number of device
+ *
+ * @returns		0 if successful or there was no record, else -1 and
+ * 			errno is set
+ */
+int load_journal_remove(const char *serial);
+
+#endif // __LOAD_JOURNAL_H__
@@ -0,0 +1,429 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "load_pipeline.h"
+#include "u3_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define CHUNK_SIZE	(LOAD_CHUNK_BLOCKS * U3_BLOCK_SIZE)
+#define STALL_CHECK_SECONDS 1	// interval of stall checks of the reader
+
+/**
+ * Check if a buffer is part of the ring memory
+ */
+static int ring_buffer(struct load_pipeline *pl, const uint8_t *buffer) {
+	return buffer >= pl->memory &&
+		buffer < pl->memory + (size_t) pl->depth * CHUNK_SIZE;
+}
+
+/**
+ * Detach consumer, the lock must be held
+ *
+ * References to chunks the consumer hasn't taken are dropped. For every
+ * chunk it holds, the ring slot gets a new buffer and the consumer keeps the
+ * old one till it releases the chunk, so the slot can be reused right away.
+ * Chunks that can't get a new buffer keep the reference of the consumer.
+ */
+static void detach(struct load_pipeline *pl, unsigned int consumer) {
+	struct load_consumer *c = &pl->consumer[consumer];
+	struct load_chunk *chunk;
+	uint8_t *buffer;
+	unsigned long i;
+
+	if (!c->attached)
+		return;
+	c->attached = 0;
+	pl->attached--;
+
+	for (i = c->taken; i < pl->produced; i++)
+		pl->chunks[i % pl->depth].refs--;
+
+	if (c->taken > c->released)
+		c->orphans = (uint8_t **) calloc(pl->depth, sizeof(uint8_t *));
+
+	for (i = c->released; i < c->taken && c->orphans != NULL; i++) {
+		chunk = &pl->chunks[i % pl->depth];
+		if (load_buffer_alloc(&buffer, CHUNK_SIZE) != 0)
+			break;
+
+		// the hash job may still read the old buffer
+		if (chunk->hashing) {
+			load_verify_wait(pl->verify, &chunk->verify_job);
+			chunk->hashing = 0;
+		}
+		c->orphans[i % pl->depth] = chunk->buffer;
+		chunk->buffer = buffer;
+		chunk->refs--;
+	}
+
+	pthread_cond_broadcast(&pl->cond);
+}
+
+/**
+ * Wait for the oldest chunk to be released, the lock must be held
+ *
+ * Consumers that hold the chunk and made no progress for LOAD_STALL_SECONDS
+ * are detached, if there are other consumers they hold up.
+ */
+static void wait_for_chunk(struct load_pipeline *pl) {
+	struct load_consumer *c;
+	struct timespec until;
+	struct timeval tv;
+	unsigned long oldest = pl->produced - pl->depth;
+	uint64_t now = u3_stats_now();
+	unsigned int i;
+
+	for (i = 0; i < pl->consumers && pl->attached > 1; i++) {
+		c = &pl->consumer[i];
+		if (c->attached && c->released <= oldest &&
+		    now - c->active > LOAD_STALL_SECONDS * 1000000ULL)
+		{
+			c->stalled = 1;
+			detach(pl, i);
+		}
+	}
+	if (pl->chunks[oldest % pl->depth].refs == 0)
+		return;
+
+	gettimeofday(&tv, NULL);
+	until.tv_sec = tv.tv_sec + STALL_CHECK_SECONDS;
+	until.tv_nsec = tv.tv_usec * 1000;
+	pthread_cond_timedwait(&pl->cond, &pl->lock, &until);
+}
+
+/**
+ * Wait for the block digests of all chunks to be computed
+ */
+static void wait_for_hashing(struct load_pipeline *pl) {
+	unsigned int i;
+
+	if (pl->verify == NULL)
+		return;
+
+	for (i = 0; i < pl->depth; i++) {
+		pthread_mutex_lock(&pl->lock);
+		if (pl->chunks[i].hashing) {
+			pl->chunks[i].hashing = 0;
+			pthread_mutex_unlock(&pl->lock);
+			load_verify_wait(pl->verify, &pl->chunks[i].verify_job);
+		} else {
+			pthread_mutex_unlock(&pl->lock);
+		}
+	}
+}
+
+/**
+ * Reader thread, fills free chunks with image data
+ */
+static void *reader_main(void *arg) {
+	struct load_pipeline *pl = (struct load_pipeline *) arg;
+	struct load_chunk *chunk;
+	uint32_t block_num = pl->src->offset / U3_BLOCK_SIZE;
+	uint64_t now;
+	unsigned int i;
+	int hashing;
+	int blocks;
+	int eof = 0;
+
+	pthread_mutex_lock(&pl->lock);
+	while (!pl->stop && pl->attached > 0) {
+		chunk = &pl->chunks[pl->produced % pl->depth];
+
+		// wait till all consumers released the chunk
+		if (chunk->refs > 0) {
+			wait_for_chunk(pl);
+			continue;
+		}
+		hashing = chunk->hashing;
+		chunk->hashing = 0;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (hashing)
+			load_verify_wait(pl->verify, &chunk->verify_job);
+
+		blocks = image_source_read(pl->src, chunk->buffer,
+				LOAD_CHUNK_BLOCKS, &chunk->data);
+		if (blocks > 0) {
+			md5_update(&pl->digest, chunk->data,
+				blocks * U3_BLOCK_SIZE);
+			memcpy(&chunk->digest, &pl->digest,
+				sizeof(md5_context));
+			if (pl->verify != NULL) {
+				load_verify_image(pl->verify,
+					&chunk->verify_job, block_num, blocks,
+					chunk->data);
+			}
+		}
+
+		pthread_mutex_lock(&pl->lock);
+		if (blocks < 0) {
+			snprintf(pl->err_msg, U3_MAX_ERROR_LEN, "%s",
+				image_source_error(pl->src));
+			pl->error = 1;
+			break;
+		}
+		if (blocks == 0) {
+			eof = 1;
+			break;
+		}
+
+		chunk->block_num = block_num;
+		chunk->block_cnt = blocks;
+		chunk->refs = pl->attached;
+		chunk->hashing = pl->verify != NULL;
+		block_num += chunk->block_cnt;
+
+		// consumers waiting for the chunk hold chunks too, they made
+		// no progress because of the reader
+		now = u3_stats_now();
+		for (i = 0; i < pl->consumers; i++) {
+			if (pl->consumer[i].taken == pl->produced)
+				pl->consumer[i].active = now;
+		}
+
+		pl->produced++;
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	// consumers verify after the end of the image, digests must be done
+	wait_for_hashing(pl);
+
+	pthread_mutex_lock(&pl->lock);
+	pl->eof = eof;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+int load_buffer_alloc(uint8_t **buffer, size_t size) {
+#ifdef WIN32
+	// MinGW has no posix_memalign(), the alignment is only needed for
+	// direct IO on Linux
+	*buffer = (uint8_t *) malloc(size);
+	return *buffer == NULL ? ENOMEM : 0;
+#else
+	return posix_memalign((void **) buffer, LOAD_BUFFER_ALIGN, size);
+#endif
+}
+
+int load_pipeline_start(struct load_pipeline *pl, struct image_source *src,
+		unsigned int depth, unsigned int consumers,
+		const md5_context *digest, struct load_verify *verify)
+{
+	uint64_t now = u3_stats_now();
+	unsigned int i;
+	int err;
+
+	memset(pl, 0, sizeof(struct load_pipeline));
+	pl->src = src;
+	pl->verify = verify;
+	pl->depth = depth;
+
+	if (depth == 0 || depth > LOAD_MAX_DEPTH) {
+		snprintf(pl->err_msg, U3_MAX_ERROR_LEN,
+			"Invalid pipeline depth %u", depth);
+		return U3_FAILURE;
+	}
+	if (consumers == 0 || consumers > LOAD_MAX_CONSUMERS) {
+		snprintf(pl->err_msg, U3_MAX_ERROR_LEN,
+			"Invalid number of devices %u", consumers);
+		return U3_FAILURE;
+	}
+
+	pl->consumers = pl->attached = consumers;
+	for (i = 0; i < consumers; i++) {
+		pl->consumer[i].attached = 1;
+		pl->consumer[i].active = now;
+	}
+
+	if (digest != NULL)
+		memcpy(&pl->digest, digest, sizeof(md5_context));
+	else
+		md5_starts(&pl->digest);
+
+	pl->chunks = (struct load_chunk *) calloc(depth,
+					sizeof(struct load_chunk));
+	if (pl->chunks == NULL) {
+		snprintf(pl->err_msg, U3_MAX_ERROR_LEN,
+			"Failed allocating memory for pipeline");
+		return U3_FAILURE;
+	}
+
+	err = load_buffer_alloc(&pl->memory, (size_t) depth * CHUNK_SIZE);
+	if (err != 0) {
+		free(pl->chunks);
+		snprintf(pl->err_msg, U3_MAX_ERROR_LEN, "Failed allocating "
+			"memory for pipeline buffers: %s", strerror(err));
+		return U3_FAILURE;
+	}
+	for (i = 0; i < depth; i++)
+		pl->chunks[i].buffer = pl->memory + (size_t) i * CHUNK_SIZE;
+
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+
+	err = pthread_create(&pl->reader, NULL, reader_main, pl);
+	if (err != 0) {
+		pthread_cond_destroy(&pl->cond);
+		pthread_mutex_destroy(&pl->lock);
+		free(pl->memory);
+		free(pl->chunks);
+		snprintf(pl->err_msg, U3_MAX_ERROR_LEN, "Failed starting "
+			"reader thread: %s", strerror(err));
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+int load_pipeline_take(struct load_pipeline *pl, unsigned int consumer,
+		struct load_chunk *chunk)
+{
+	struct load_consumer *c = &pl->consumer[consumer];
+	struct load_chunk *slot;
+	int retval = U3_FAILURE;
+
+	pthread_mutex_lock(&pl->lock);
+	while (c->attached && c->taken == pl->produced && !pl->eof &&
+	       !pl->error)
+	{
+		pthread_cond_wait(&pl->cond, &pl->lock);
+	}
+
+	if (c->attached && c->taken != pl->produced) {
+		slot = &pl->chunks[c->taken % pl->depth];
+		chunk->block_num = slot->block_num;
+		chunk->block_cnt = slot->block_cnt;
+		chunk->data = slot->data;
+		chunk->buffer = slot->buffer;
+		memcpy(&chunk->digest, &slot->digest, sizeof(md5_context));
+		c->taken++;
+		c->active = u3_stats_now();
+		retval = U3_SUCCESS;
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return retval;
+}
+
+/**
+ * Release the oldest chunk held by a consumer, the lock must be held
+ */
+static void release(struct load_pipeline *pl, struct load_consumer *c) {
+	unsigned int slot = c->released % pl->depth;
+
+	if (c->orphans != NULL && c->orphans[slot] != NULL) {
+		if (!ring_buffer(pl, c->orphans[slot]))
+			free(c->orphans[slot]);
+		c->orphans[slot] = NULL;
+	} else {
+		pl->chunks[slot].refs--;
+	}
+	c->released++;
+}
+
+void load_pipeline_release(struct load_pipeline *pl, unsigned int consumer) {
+	struct load_consumer *c = &pl->consumer[consumer];
+
+	pthread_mutex_lock(&pl->lock);
+	if (c->taken > c->released) {
+		release(pl, c);
+		c->active = u3_stats_now();
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+}
+
+void load_pipeline_release_all(struct load_pipeline *pl,
+		unsigned int consumer)
+{
+	struct load_consumer *c = &pl->consumer[consumer];
+
+	pthread_mutex_lock(&pl->lock);
+	if (c->taken > c->released) {
+		while (c->taken > c->released)
+			release(pl, c);
+		c->active = u3_stats_now();
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+}
+
+void load_pipeline_detach(struct load_pipeline *pl, unsigned int consumer) {
+	pthread_mutex_lock(&pl->lock);
+	detach(pl, consumer);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+int load_pipeline_stalled(struct load_pipeline *pl, unsigned int consumer) {
+	int stalled;
+
+	pthread_mutex_lock(&pl->lock);
+	stalled = pl->consumer[consumer].stalled;
+	pthread_mutex_unlock(&pl->lock);
+
+	return stalled;
+}
+
+void load_pipeline_stop(struct load_pipeline *pl) {
+	unsigned int i, j;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	pthread_join(pl->reader, NULL);
+
+	for (i = 0; i < pl->depth; i++) {
+		if (!ring_buffer(pl, pl->chunks[i].buffer))
+			free(pl->chunks[i].buffer);
+	}
+	for (i = 0; i < pl->consumers; i++) {
+		if (pl->consumer[i].orphans == NULL)
+			continue;
+		for (j = 0; j < pl->depth; j++) {
+			if (!ring_buffer(pl, pl->consumer[i].orphans[j]))
+				free(pl->consumer[i].orphans[j]);
+		}
+		free(pl->consumer[i].orphans);
+	}
+
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+	free(pl->memory);
+	free(pl->chunks);
+	pl->memory = NULL;
+	pl->chunks = NULL;
+}
+
+const char *load_pipeline_error(struct load_pipeline *pl) {
+	return pl->error ? pl->err_msg : NULL;
+}
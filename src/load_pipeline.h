@@ -0,0 +1,239 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __LOAD_PIPELINE_H__
+#define __LOAD_PIPELINE_H__
+/**
+ * @file	load_pipeline.h
+ *
+ *		A reader thread that reads a CD image into a bounded ring of
+ *		buffers, so reading the image overlaps with writing it to the
+ *		devices.
+ *
+ *		The ring is shared by one or more consumers, one per device
+ *		being loaded. Every chunk counts the consumers that still have
+ *		to release it, its buffer is reused once the count drops to
+ *		zero. Consumers take chunks at their own pace, as far as the
+ *		ring depth allows. A consumer that stalls the others for
+ *		LOAD_STALL_SECONDS without releasing a chunk is detached, so
+ *		one hanging device doesn't stop the load of the others.
+ *
+ *		The image is read and hashed once for all consumers: the
+ *		reader computes the running digest of the image for load
+ *		journals and, optionally, the block digests for verification.
+ */
+
+#include <pthread.h>
+
+#include "u3.h"
+#include "u3_commands.h"
+#include "image_source.h"
+#include "load_verify.h"
+#include "md5.h"
+
+#define LOAD_CHUNK_BLOCKS	U3_MAX_CD_WRITE_BLOCKS	// blocks per chunk
+#define LOAD_DEFAULT_DEPTH	8	// default number of chunks in ring
+#define LOAD_MAX_DEPTH		1024	// maximum number of chunks in ring
+#define LOAD_BUFFER_ALIGN	4096	// alignment of chunk buffers
+#define LOAD_MAX_CONSUMERS	64	// maximum number of consumers
+#define LOAD_STALL_SECONDS	30	// time a consumer may hold up the others
+
+/**
+ * A chunk of image data
+ */
+struct load_chunk {
+	uint32_t block_num;	// number of first block in chunk
+	uint32_t block_cnt;	// number of blocks in chunk
+	uint8_t	 *data;		// block data, points into 'buffer' or into
+				// the memory of the image source
+	uint8_t	 *buffer;	// chunk buffer, LOAD_CHUNK_BLOCKS blocks big
+	md5_context digest;	// digest state of the image up to the end of
+				// this chunk
+	unsigned int refs;	// consumers that still have to release it
+	struct load_verify_job verify_job; // hash job of the block digests
+	int	 hashing;	// 'verify_job' is queued
+};
+
+/**
+ * A consumer of the pipeline
+ */
+struct load_consumer {
+	unsigned long	 taken;		// chunks taken
+	unsigned long	 released;	// chunks released
+	int		 attached;	// consumer takes part in the load
+	int		 stalled;	// detached for holding up the others
+	uint8_t		 **orphans;	// buffers of the chunks held when the
+					// consumer was detached, by ring
+					// slot, or NULL
+	uint64_t	 active;	// time of last take or release
+};
+
+/**
+ * Load pipeline state
+ *
+ * Chunks are produced and taken in ring order. The counters are free
+ * running, the ring slot of a counter is 'counter % depth'.
+ */
+struct load_pipeline {
+	struct image_source *src;	// image to read
+	struct load_verify *verify;	// block digests to compute, or NULL
+	unsigned int	 depth;		// number of chunks in the ring
+	struct load_chunk *chunks;	// the ring
+	uint8_t		 *memory;	// buffer memory of all chunks
+
+	unsigned int	 consumers;	// number of consumers
+	unsigned int	 attached;	// number of consumers attached
+	struct load_consumer consumer[LOAD_MAX_CONSUMERS];
+
+	unsigned long	 produced;	// chunks filled by the reader
+	md5_context	 digest;	// digest state of the image read so far
+
+	int		 eof;		// reader reached end of image
+	int		 error;		// reader failed, see err_msg
+	int		 stop;		// reader should stop
+
+	pthread_t	 reader;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Allocate a buffer aligned to LOAD_BUFFER_ALIGN
+ *
+ * @param buffer	Used to return the buffer, to be freed using free()
+ * @param size		Size of the buffer in bytes
+ *
+ * @returns		0 if successful, else an errno value
+ */
+int load_buffer_alloc(uint8_t **buffer, size_t size);
+
+/**
+ * Start load pipeline
+ *
+ * This allocates 'depth' chunk buffers and starts a reader thread that
+ * fills them with the contents of 'src', starting at the current position
+ * of the source. This position must be at a block boundary. The memory used
+ * by the pipeline is fixed at depth * LOAD_CHUNK_BLOCKS * U3_BLOCK_SIZE
+ * bytes, plus one chunk for every chunk held by a consumer when it is
+ * detached.
+ * Memory mapped sources don't copy into the chunk buffers, there the reader
+ * thread only takes the page faults.
+ *
+ * @param pl		Pipeline to initialize
+ * @param src		Image source to read
+ * @param depth		Number of chunks in the ring, 1 to LOAD_MAX_DEPTH
+ * @param consumers	Number of consumers, 1 to LOAD_MAX_CONSUMERS
+ * @param digest	Digest state of the image before the current position
+ * 			of 'src', or NULL if it is at the start
+ * @param verify	Verification state to compute the block digests of,
+ * 			or NULL
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			load_pipeline_error()
+ */
+int load_pipeline_start(struct load_pipeline *pl, struct image_source *src,
+		unsigned int depth, unsigned int consumers,
+		const md5_context *digest, struct load_verify *verify);
+
+/**
+ * Take next chunk from pipeline
+ *
+ * This blocks till the reader has filled the next chunk. A consumer may
+ * hold several chunks, but must hold less than 'depth' chunks when taking
+ * the next, or the reader can't refill the ring. The position, data and
+ * digest of the chunk are copied to 'chunk'; the data stays valid till the
+ * chunk is released.
+ * The final chunk of the image is zero padded to a whole block.
+ *
+ * @param pl		Load pipeline
+ * @param consumer	Number of the consumer
+ * @param chunk		Used to return the chunk
+ *
+ * @returns		U3_SUCCESS if a chunk is returned, else U3_FAILURE at
+ * 			the end of the image, if the reader failed or if the
+ * 			consumer was detached. load_pipeline_error() and
+ * 			load_pipeline_stalled() tell which.
+ */
+int load_pipeline_take(struct load_pipeline *pl, unsigned int consumer,
+		struct load_chunk *chunk);
+
+/**
+ * Release chunk to pipeline
+ *
+ * This hands the oldest chunk held by the consumer back to the reader.
+ * Chunks are released in the order they were taken.
+ *
+ * @param pl		Load pipeline
+ * @param consumer	Number of the consumer
+ */
+void load_pipeline_release(struct load_pipeline *pl, unsigned int consumer);
+
+/**
+ * Release all chunks held by a consumer
+ *
+ * @param pl		Load pipeline
+ * @param consumer	Number of the consumer
+ */
+void load_pipeline_release_all(struct load_pipeline *pl,
+		unsigned int consumer);
+
+/**
+ * Detach consumer from pipeline
+ *
+ * The consumer doesn't take chunks anymore and no longer holds up the ring.
+ * Chunks it holds must still be released.
+ *
+ * @param pl		Load pipeline
+ * @param consumer	Number of the consumer
+ */
+void load_pipeline_detach(struct load_pipeline *pl, unsigned int consumer);
+
+/**
+ * Check if consumer was detached for stalling the others
+ *
+ * @param pl		Load pipeline
+ * @param consumer	Number of the consumer
+ *
+ * @returns		non zero if the consumer was detached by the reader
+ */
+int load_pipeline_stalled(struct load_pipeline *pl, unsigned int consumer);
+
+/**
+ * Stop load pipeline
+ *
+ * This stops the reader thread and frees the chunk buffers. The image source
+ * is not closed.
+ *
+ * @param pl		Load pipeline
+ */
+void load_pipeline_stop(struct load_pipeline *pl);
+
+/**
+ * Get pipeline error
+ *
+ * @param pl		Load pipeline
+ *
+ * @returns		error string of the reader, or NULL if the reader did
+ * 			not fail
+ */
+const char *load_pipeline_error(struct load_pipeline *pl);
+
+#endif // __LOAD_PIPELINE_H__
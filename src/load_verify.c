@@ -0,0 +1,202 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "load_verify.h"
+#include "u3_commands.h"
+#include "u3_error.h"
+#include "md5.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define READ_BLOCKS		U3_MAX_CD_READ_BLOCKS	// blocks per read
+#define BUFFERS_PER_THREAD	2	// read buffers per hash worker
+
+/**
+ * Job function, computes digests of image blocks
+ */
+static void hash_image_job(void *arg) {
+	struct load_verify_job *job = (struct load_verify_job *) arg;
+	uint8_t *digest;
+	uint32_t i;
+
+	for (i = 0; i < job->block_cnt; i++) {
+		digest = job->verify->digests +
+			(job->block_num + i) * LOAD_VERIFY_DIGEST_LEN;
+		md5((unsigned char *) job->data + i * U3_BLOCK_SIZE,
+			U3_BLOCK_SIZE, digest);
+	}
+}
+
+/**
+ * Job function, compares digests of blocks read back with the image
+ */
+static void compare_job(void *arg) {
+	struct load_verify_job *job = (struct load_verify_job *) arg;
+	uint8_t digest[LOAD_VERIFY_DIGEST_LEN];
+	uint32_t i;
+
+	job->bad_block = LOAD_VERIFY_OK;
+	for (i = 0; i < job->block_cnt; i++) {
+		md5((unsigned char *) job->data + i * U3_BLOCK_SIZE,
+			U3_BLOCK_SIZE, digest);
+		if (memcmp(digest, job->verify->digests +
+				(job->block_num + i) * LOAD_VERIFY_DIGEST_LEN,
+				LOAD_VERIFY_DIGEST_LEN) != 0)
+		{
+			job->bad_block = job->block_num + i;
+			break;
+		}
+	}
+}
+
+int load_verify_init(struct load_verify *verify, uint32_t block_cnt) {
+	memset(verify, 0, sizeof(struct load_verify));
+	verify->block_cnt = block_cnt;
+
+	verify->digests = (uint8_t *) malloc((size_t) block_cnt *
+			LOAD_VERIFY_DIGEST_LEN);
+	if (verify->digests == NULL) {
+		snprintf(verify->err_msg, U3_MAX_ERROR_LEN, "Failed "
+			"allocating memory for block digests");
+		return U3_FAILURE;
+	}
+
+	if (thread_pool_start(&verify->pool, thread_pool_default_threads())
+		!= U3_SUCCESS)
+	{
+		snprintf(verify->err_msg, U3_MAX_ERROR_LEN, "%s",
+			verify->pool.err_msg);
+		free(verify->digests);
+		verify->digests = NULL;
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+void load_verify_image(struct load_verify *verify, struct load_verify_job *job,
+		uint32_t block_num, uint32_t block_cnt, const uint8_t *data)
+{
+	job->verify = verify;
+	job->block_num = block_num;
+	job->block_cnt = block_cnt;
+	job->data = data;
+	thread_pool_submit(&verify->pool, &job->job, hash_image_job, job);
+}
+
+void load_verify_wait(struct load_verify *verify, struct load_verify_job *job)
+{
+	thread_pool_wait(&verify->pool, &job->job);
+}
+
+int load_verify_device(struct load_verify *verify, u3_handle_t *device,
+		volatile int *stop, volatile uint32_t *verified,
+		uint32_t *bad_block)
+{
+	struct load_verify_job *jobs;
+	struct load_verify_job *job;
+	uint8_t *buffers;
+	unsigned int nbuffers;
+	unsigned long submitted = 0;
+	unsigned long collected = 0;
+	uint32_t block_num = 0;
+	uint32_t cnt;
+	int retval = U3_SUCCESS;
+
+	*bad_block = LOAD_VERIFY_OK;
+
+	// enough buffers to keep every worker busy while the next one is read
+	nbuffers = verify->pool.threads * BUFFERS_PER_THREAD;
+	jobs = (struct load_verify_job *) calloc(nbuffers,
+			sizeof(struct load_verify_job));
+	buffers = (uint8_t *) malloc((size_t) nbuffers * READ_BLOCKS *
+			U3_BLOCK_SIZE);
+	if (jobs == NULL || buffers == NULL) {
+		u3_set_error(device, "Failed allocating memory for read "
+			"buffers");
+		free(jobs);
+		free(buffers);
+		return U3_FAILURE;
+	}
+
+	*verified = 0;
+	for (;;) {
+		// read next range if a buffer is free
+		if (block_num < verify->block_cnt && retval == U3_SUCCESS &&
+		    *bad_block == LOAD_VERIFY_OK && !*stop &&
+		    submitted - collected < nbuffers)
+		{
+			job = &jobs[submitted % nbuffers];
+			job->verify = verify;
+			job->block_num = block_num;
+			job->data = buffers + (submitted % nbuffers) *
+					READ_BLOCKS * U3_BLOCK_SIZE;
+
+			cnt = verify->block_cnt - block_num;
+			if (cnt > READ_BLOCKS)
+				cnt = READ_BLOCKS;
+			job->block_cnt = cnt;
+
+			if (u3_cd_read(device, block_num, cnt,
+				(uint8_t *) job->data) != U3_SUCCESS)
+			{
+				u3_prepend_error(device, "u3_cd_read() failed");
+				retval = U3_FAILURE;
+				continue;
+			}
+
+			thread_pool_submit(&verify->pool, &job->job,
+				compare_job, job);
+			submitted++;
+			block_num += cnt;
+			continue;
+		}
+
+		if (collected == submitted)
+			break;
+
+		// Collect in read order, so the first failing job has the
+		// first differing block.
+		job = &jobs[collected % nbuffers];
+		thread_pool_wait(&verify->pool, &job->job);
+		if (*bad_block == LOAD_VERIFY_OK)
+			*bad_block = job->bad_block;
+		collected++;
+
+		*verified = job->block_num + job->block_cnt;
+	}
+
+	free(jobs);
+	free(buffers);
+	return retval;
+}
+
+void load_verify_free(struct load_verify *verify) {
+	if (verify->digests == NULL)
+		return;
+
+	thread_pool_stop(&verify->pool);
+	free(verify->digests);
+	verify->digests = NULL;
+}
@@ -0,0 +1,132 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __LOAD_VERIFY_H__
+#define __LOAD_VERIFY_H__
+/**
+ * @file	load_verify.h
+ *
+ *		Verification of a loaded CD image. While loading, the MD5
+ *		digest of every image block is computed on a thread pool.
+ *		Afterwards the CD partition is read back and the digests of the
+ *		blocks read are compared on the same pool, overlapping with the
+ *		next reads. The image isn't read twice, so streams and
+ *		compressed images can be verified too.
+ */
+
+#include <stdint.h>
+
+#include "u3.h"
+#include "thread_pool.h"
+
+#define LOAD_VERIFY_DIGEST_LEN	16
+#define LOAD_VERIFY_OK		UINT32_MAX	// no block differs
+
+struct load_verify;
+
+/**
+ * A hash job of a range of blocks
+ */
+struct load_verify_job {
+	struct thread_pool_job job;
+	struct load_verify *verify;
+	uint32_t	block_num;	// number of first block
+	uint32_t	block_cnt;	// number of blocks
+	const uint8_t	*data;		// block data
+	uint32_t	bad_block;	// first block that differs from the image
+					// or LOAD_VERIFY_OK
+};
+
+/**
+ * Verification state
+ */
+struct load_verify {
+	uint32_t	block_cnt;	// number of blocks in image
+	uint8_t		*digests;	// digest of every image block
+	struct thread_pool pool;	// hash workers
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Initialize verification
+ *
+ * This allocates LOAD_VERIFY_DIGEST_LEN bytes per block and starts the
+ * hash workers.
+ *
+ * @param verify	Verification state to initialize
+ * @param block_cnt	Number of blocks in image
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be found in verify->err_msg
+ */
+int load_verify_init(struct load_verify *verify, uint32_t block_cnt);
+
+/**
+ * Hash image blocks
+ *
+ * This queues a job that computes the digests of image blocks. 'data' must
+ * stay valid till the job is finished, see load_verify_wait().
+ *
+ * @param verify	Verification state
+ * @param job		Job to use
+ * @param block_num	Number of first block
+ * @param block_cnt	Number of blocks
+ * @param data		Block data
+ */
+void load_verify_image(struct load_verify *verify, struct load_verify_job *job,
+		uint32_t block_num, uint32_t block_cnt, const uint8_t *data);
+
+/**
+ * Wait for job to finish
+ *
+ * @param verify	Verification state
+ * @param job		Job queued using load_verify_image()
+ */
+void load_verify_wait(struct load_verify *verify, struct load_verify_job *job);
+
+/**
+ * Verify CD partition against the image
+ *
+ * This reads back the CD partition and compares it with the digests of the
+ * image blocks. All image blocks must have been hashed. The device must be
+ * the CD drive of the U3 device. Several devices can be verified at the same
+ * time from different threads.
+ *
+ * @param verify	Verification state
+ * @param device	U3 device handle
+ * @param stop		Reading stops when this becomes non zero
+ * @param verified	Updated with the number of blocks compared so far
+ * @param bad_block	Used to return the first block that differs from the
+ * 			image, or LOAD_VERIFY_OK
+ *
+ * @returns		U3_SUCCESS if the partition was compared, else
+ * 			U3_FAILURE and an error string can be obtained using
+ * 			u3_error()
+ */
+int load_verify_device(struct load_verify *verify, u3_handle_t *device,
+		volatile int *stop, volatile uint32_t *verified,
+		uint32_t *bad_block);
+
+/**
+ * Free verification state
+ *
+ * @param verify	Verification state
+ */
+void load_verify_free(struct load_verify *verify);
+
+#endif // __LOAD_VERIFY_H__
@@ -0,0 +1,719 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "load_writer.h"
+#include "u3_commands.h"
+#include "u3_scsi.h"
+#include "u3_error.h"
+#include "zero_block.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * A CD write in flight
+ */
+struct load_slot {
+	struct u3_cmd	cmd;		// the command, first so a completed
+					// command leads back to its slot
+	uint8_t		*data;		// blocks written, in the chunk data
+	uint32_t	block_num;	// first block written
+	uint32_t	block_cnt;	// number of blocks written
+	int		done;		// command completed
+};
+
+/**
+ * CD writes in flight
+ *
+ * Commands are submitted in slot order and retired in the same order, so
+ * blocks are only counted as done once every write before them completed.
+ * The commands write straight from the chunk data, so the writer holds the
+ * chunks of the pipeline till their writes are retired. The counters are
+ * free running, the slot of a counter is 'counter % depth'.
+ */
+struct load_queue {
+	unsigned int	 depth;		// number of slots
+	unsigned int	 chunks_max;	// chunks held are kept below this
+					// after queueing a chunk
+	struct load_slot slots[U3_MAX_QUEUE_DEPTH];
+	unsigned long	 submitted;	// commands submitted
+	unsigned long	 retired;	// commands retired
+
+	// chunks all commands of which have been submitted
+	struct load_chunk chunks[U3_MAX_QUEUE_DEPTH];
+	unsigned long	 need[U3_MAX_QUEUE_DEPTH]; // 'submitted' when the
+					// chunk was done
+	unsigned long	 chunks_in;	// chunks added
+	unsigned long	 chunks_out;	// chunks retired
+};
+
+int load_write_blocks(u3_handle_t *device, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *buffer,
+		struct load_write_setting *write)
+{
+	uint32_t i, cnt, to_boundary;
+
+	for (i = 0; i < block_cnt; i += cnt) {
+		to_boundary = write->blocks - (block_num + i + write->blocks -
+				write->offset) % write->blocks;
+		cnt = block_cnt - i;
+		if (cnt > to_boundary)
+			cnt = to_boundary;
+
+		if (cnt == 1) {
+			if (u3_cd_write(device, block_num + i,
+					buffer + i * U3_BLOCK_SIZE) != U3_SUCCESS)
+				return U3_FAILURE;
+		} else if (u3_cd_write_multi(device, block_num + i, cnt,
+				buffer + i * U3_BLOCK_SIZE) != U3_SUCCESS)
+		{
+			if (debug) {
+				fprintf(stderr, "\nu3_cd_write_multi() failed: "
+					"%s, falling back to single block "
+					"writes\n", u3_error_msg(device));
+			}
+			write->blocks = 1;
+			write->offset = 0;
+			cnt = 0;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Record written blocks in the checkpoint state
+ *
+ * Blocks must be recorded in order. A journal record is written every
+ * LOAD_CHECKPOINT_INTERVAL blocks.
+ *
+ * @param cp		Checkpoint state
+ * @param chunk		Chunk that has been written
+ */
+static void checkpoint_update(struct load_checkpoint *cp,
+	struct load_chunk *chunk)
+{
+	if (!cp->enabled)
+		return;
+
+	memcpy(&cp->ctx, &chunk->digest, sizeof(md5_context));
+	cp->journal.blocks_done += chunk->block_cnt;
+
+	if (cp->journal.blocks_done - cp->written >= LOAD_CHECKPOINT_INTERVAL)
+		load_checkpoint_write(cp);
+}
+
+/**
+ * Set up the queue of CD writes
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an error
+ * 			string can be found in w->err_msg
+ */
+static int queue_init(struct load_writer *w, unsigned int depth) {
+	struct load_queue *q;
+
+	q = (struct load_queue *) calloc(1, sizeof(struct load_queue));
+	if (q == NULL) {
+		snprintf(w->err_msg, U3_MAX_ERROR_LEN, "Failed allocating "
+			"memory for write queue");
+		return U3_FAILURE;
+	}
+
+	// the reader can't refill the ring while the writer holds all of it
+	q->depth = depth;
+	q->chunks_max = depth;
+	if (q->chunks_max > w->pipeline->depth)
+		q->chunks_max = w->pipeline->depth;
+
+	w->queue = q;
+	return U3_SUCCESS;
+}
+
+/**
+ * Free the queue of CD writes, no commands may be in flight
+ */
+static void queue_free(struct load_writer *w) {
+	if (w->queue == NULL)
+		return;
+
+	free(w->queue);
+	w->queue = NULL;
+}
+
+/**
+ * Wait for a CD write to complete
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int queue_reap(struct load_writer *w) {
+	struct u3_cmd *cmd;
+
+	cmd = u3_reap_cmd(w->device);
+	if (cmd == NULL)
+		return U3_FAILURE;
+
+	((struct load_slot *) cmd)->done = 1;
+	return U3_SUCCESS;
+}
+
+/**
+ * Wait till all CD writes in flight completed, whatever their result
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int queue_drain(struct load_writer *w) {
+	struct load_queue *q = w->queue;
+	unsigned long n;
+
+	for (n = q->retired; n < q->submitted; n++) {
+		while (!q->slots[n % q->depth].done) {
+			if (queue_reap(w) != U3_SUCCESS)
+				return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Retire the completed CD writes at the head of the queue
+ *
+ * A multi block write the device rejected is written again one block at a
+ * time, like load_write_blocks() does, after the other writes in flight
+ * completed. Chunks of which all writes are retired are recorded in the
+ * checkpoint state and released to the pipeline.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int queue_retire(struct load_writer *w) {
+	struct load_queue *q = w->queue;
+	struct load_slot *slot;
+	struct load_chunk *chunk;
+
+	while (q->retired < q->submitted) {
+		slot = &q->slots[q->retired % q->depth];
+		if (!slot->done)
+			break;
+
+		if (u3_cd_write_result(w->device, &slot->cmd) != U3_SUCCESS) {
+			u3_prepend_error(w->device, "blocks %u-%u",
+				slot->block_num,
+				slot->block_num + slot->block_cnt - 1);
+			if (slot->block_cnt == 1 || queue_drain(w) != U3_SUCCESS)
+				return U3_FAILURE;
+
+			if (debug) {
+				fprintf(stderr, "\nqueued CD write failed: %s, "
+					"falling back to single block "
+					"writes\n", u3_error_msg(w->device));
+			}
+			w->write.blocks = 1;
+			w->write.offset = 0;
+			if (load_write_blocks(w->device, slot->block_num,
+				slot->block_cnt, slot->data, &w->write)
+				!= U3_SUCCESS)
+			{
+				return U3_FAILURE;
+			}
+		}
+
+		slot->done = 0;
+		q->retired++;
+	}
+
+	while (q->chunks_out < q->chunks_in &&
+	       q->need[q->chunks_out % q->depth] <= q->retired)
+	{
+		chunk = &q->chunks[q->chunks_out % q->depth];
+		checkpoint_update(&w->checkpoint, chunk);
+		w->written = chunk->block_num + chunk->block_cnt;
+		q->chunks_out++;
+		load_pipeline_release(w->pipeline, w->consumer);
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Queue CD writes of a range of blocks
+ *
+ * The range is split into commands like load_write_blocks() does. The
+ * blocks are written from 'buffer', which must stay valid till the writes
+ * are retired.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int queue_blocks(struct load_writer *w, uint32_t block_num,
+	uint32_t block_cnt, uint8_t *buffer)
+{
+	struct load_queue *q = w->queue;
+	struct load_slot *slot;
+	uint32_t i, cnt, to_boundary;
+
+	for (i = 0; i < block_cnt; i += cnt) {
+		to_boundary = w->write.blocks - (block_num + i +
+			w->write.blocks - w->write.offset) % w->write.blocks;
+		cnt = block_cnt - i;
+		if (cnt > to_boundary)
+			cnt = to_boundary;
+
+		// wait for the slot to become free
+		while (q->submitted - q->retired == q->depth) {
+			if (queue_reap(w) != U3_SUCCESS ||
+			    queue_retire(w) != U3_SUCCESS)
+				return U3_FAILURE;
+		}
+
+		slot = &q->slots[q->submitted % q->depth];
+		slot->block_num = block_num + i;
+		slot->block_cnt = cnt;
+		slot->data = buffer + i * U3_BLOCK_SIZE;
+		slot->done = 0;
+
+		if (u3_cd_write_submit(w->device, &slot->cmd, slot->block_num,
+			cnt, slot->data) != U3_SUCCESS)
+		{
+			return U3_FAILURE;
+		}
+		q->submitted++;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Record that all writes of a chunk are queued
+ *
+ * The chunk is recorded in the checkpoint state and released once its
+ * writes are retired. Before returning, writes are retired till less than
+ * q->chunks_max chunks are held, so the next chunk can be taken.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int queue_chunk(struct load_writer *w, struct load_chunk *chunk) {
+	struct load_queue *q = w->queue;
+
+	memcpy(&q->chunks[q->chunks_in % q->depth], chunk,
+		sizeof(struct load_chunk));
+	q->need[q->chunks_in % q->depth] = q->submitted;
+	q->chunks_in++;
+
+	// chunks without writes are done right away
+	if (queue_retire(w) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	while (q->chunks_in - q->chunks_out >= q->chunks_max) {
+		if (queue_reap(w) != U3_SUCCESS ||
+		    queue_retire(w) != U3_SUCCESS)
+			return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Write a range of blocks, queued if the writer has a queue
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int write_run(struct load_writer *w, uint32_t block_num,
+	uint32_t block_cnt, uint8_t *buffer)
+{
+	if (w->queue != NULL)
+		return queue_blocks(w, block_num, block_cnt, buffer);
+
+	return load_write_blocks(w->device, block_num, block_cnt, buffer,
+			&w->write);
+}
+
+/**
+ * Write the blocks of a chunk that differ from the CD partition
+ *
+ * The blocks of the chunk are read back from the device and only runs of
+ * blocks that differ are written. If the blocks can't be read back, the
+ * whole chunk is written.
+ *
+ * Unchanged blocks are counted in w->skipped.
+ *
+ * @param w		Writer
+ * @param chunk		Image chunk to write
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+static int diff_cd_blocks(struct load_writer *w, struct load_chunk *chunk) {
+	uint8_t *readback = w->readback;
+	uint32_t i, start;
+
+	if (u3_cd_read(w->device, chunk->block_num, chunk->block_cnt,
+			readback) != U3_SUCCESS)
+	{
+		if (debug) {
+			fprintf(stderr, "\nu3_cd_read() failed: %s, writing "
+				"blocks %u-%u\n", u3_error_msg(w->device),
+				chunk->block_num,
+				chunk->block_num + chunk->block_cnt - 1);
+		}
+		return write_run(w, chunk->block_num, chunk->block_cnt,
+				chunk->data);
+	}
+
+	i = 0;
+	while (i < chunk->block_cnt) {
+		// skip unchanged blocks
+		if (memcmp(chunk->data + i * U3_BLOCK_SIZE,
+			   readback + i * U3_BLOCK_SIZE, U3_BLOCK_SIZE) == 0)
+		{
+			w->skipped++;
+			i++;
+			continue;
+		}
+
+		// write run of changed blocks
+		start = i;
+		while (i < chunk->block_cnt &&
+		       memcmp(chunk->data + i * U3_BLOCK_SIZE,
+			      readback + i * U3_BLOCK_SIZE, U3_BLOCK_SIZE) != 0)
+		{
+			i++;
+		}
+		if (write_run(w, chunk->block_num + start, i - start,
+				chunk->data + start * U3_BLOCK_SIZE)
+			!= U3_SUCCESS)
+		{
+			return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Write the blocks of a chunk that are marked as changed
+ *
+ * The changed blocks are marked in w->changed, unchanged blocks are counted
+ * in w->skipped.
+ *
+ * @param w		Writer
+ * @param chunk		Image chunk to write
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+static int changed_cd_blocks(struct load_writer *w, struct load_chunk *chunk) {
+	const uint8_t *changed = w->changed;
+	uint32_t i, start, n;
+
+	i = 0;
+	while (i < chunk->block_cnt) {
+		// skip unchanged blocks
+		n = chunk->block_num + i;
+		if (!(changed[n / 8] & (1 << (n % 8)))) {
+			w->skipped++;
+			i++;
+			continue;
+		}
+
+		// write run of changed blocks
+		start = i;
+		while (i < chunk->block_cnt) {
+			n = chunk->block_num + i;
+			if (!(changed[n / 8] & (1 << (n % 8))))
+				break;
+			i++;
+		}
+		if (write_run(w, chunk->block_num + start, i - start,
+				chunk->data + start * U3_BLOCK_SIZE)
+			!= U3_SUCCESS)
+		{
+			return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Write the blocks of a chunk that are not zero or not in the clean part of
+ * the CD partition
+ *
+ * The clean part of the CD partition, known to be zero, starts at the
+ * clean_from of the checkpoint state. Skipped blocks are counted in
+ * w->skipped.
+ *
+ * @param w		Writer
+ * @param chunk		Image chunk to write
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+static int sparse_cd_blocks(struct load_writer *w, struct load_chunk *chunk) {
+	uint32_t clean_from = w->checkpoint.clean_from;
+	uint32_t i, start;
+
+	// blocks before 'clean_from' may hold data of an earlier load
+	i = 0;
+	if (chunk->block_num < clean_from) {
+		i = clean_from - chunk->block_num;
+		if (i > chunk->block_cnt)
+			i = chunk->block_cnt;
+		if (write_run(w, chunk->block_num, i, chunk->data)
+			!= U3_SUCCESS)
+			return U3_FAILURE;
+	}
+
+	while (i < chunk->block_cnt) {
+		// skip zero blocks
+		if (zero_block(chunk->data + i * U3_BLOCK_SIZE)) {
+			w->skipped++;
+			i++;
+			continue;
+		}
+
+		// write run of non-zero blocks
+		start = i;
+		while (i < chunk->block_cnt &&
+		       !zero_block(chunk->data + i * U3_BLOCK_SIZE))
+		{
+			i++;
+		}
+		if (write_run(w, chunk->block_num + start, i - start,
+				chunk->data + start * U3_BLOCK_SIZE)
+			!= U3_SUCCESS)
+		{
+			return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+
+void load_checkpoint_write(struct load_checkpoint *cp) {
+	md5_context ctx;
+	uint32_t written_end;
+
+	if (!cp->enabled)
+		return;
+
+	// finish a copy, the digest state is updated by later chunks
+	memcpy(&ctx, &cp->ctx, sizeof(ctx));
+	md5_finish(&ctx, cp->journal.digest);
+
+	written_end = cp->journal.blocks_done + LOAD_CHECKPOINT_INTERVAL +
+			LOAD_CHUNK_BLOCKS + cp->ahead;
+	if (cp->journal.clean_from < written_end)
+		cp->journal.clean_from = written_end;
+
+	if (load_journal_write(&cp->journal) == -1) {
+		if (debug) {
+			fprintf(stderr, "\nFailed writing load journal, "
+				"disabling checkpoints: %s\n",
+				strerror(errno));
+		}
+		// don't leave a record that claims unwritten blocks
+		load_journal_remove(cp->journal.serial);
+		cp->enabled = 0;
+		return;
+	}
+	cp->written = cp->journal.blocks_done;
+}
+
+/**
+ * Start queueing CD writes, if the writer and the subsystem support it
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an error
+ * 			string can be found in w->err_msg
+ */
+static int writer_queue_start(struct load_writer *w) {
+	unsigned int depth;
+
+	if (w->queue_depth <= 1)
+		return U3_SUCCESS;
+
+	depth = u3_set_queue_depth(w->device, w->queue_depth);
+	if (depth <= 1) {
+		if (debug) {
+			fprintf(stderr, "Subsystem %s doesn't queue commands, "
+				"waiting for every CD write\n",
+				u3_subsystem_name);
+		}
+		return U3_SUCCESS;
+	}
+
+	return queue_init(w, depth);
+}
+
+/**
+ * Writer thread, writes chunks till the end of the image and verifies
+ */
+static void *writer_main(void *arg) {
+	struct load_writer *w = (struct load_writer *) arg;
+	struct load_checkpoint *cp = &w->checkpoint;
+	struct load_chunk chunk;
+	int res;
+
+	if (writer_queue_start(w) != U3_SUCCESS)
+		w->result = U3_FAILURE;
+
+	while (w->result == U3_SUCCESS && !*w->stop &&
+	       load_pipeline_take(w->pipeline, w->consumer, &chunk) == U3_SUCCESS)
+	{
+		if (w->mode == LOAD_WRITE_DIFF) {
+			res = diff_cd_blocks(w, &chunk);
+		} else if (w->mode == LOAD_WRITE_SPARSE) {
+			res = sparse_cd_blocks(w, &chunk);
+		} else if (w->mode == LOAD_WRITE_CHANGED) {
+			res = changed_cd_blocks(w, &chunk);
+		} else {
+			res = write_run(w, chunk.block_num, chunk.block_cnt,
+					chunk.data);
+		}
+		if (res == U3_SUCCESS && w->queue != NULL)
+			res = queue_chunk(w, &chunk);
+		if (res != U3_SUCCESS) {
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "u3_cd_write() "
+				"failed: %s", u3_error_msg(w->device));
+			w->result = U3_FAILURE;
+			break;
+		}
+
+		if (w->queue == NULL) {
+			checkpoint_update(cp, &chunk);
+			w->written = chunk.block_num + chunk.block_cnt;
+			load_pipeline_release(w->pipeline, w->consumer);
+		}
+	}
+
+	// finish the writes in flight, the blocks of failed ones aren't done
+	if (w->queue != NULL) {
+		res = queue_drain(w);
+		if (res == U3_SUCCESS && w->result == U3_SUCCESS)
+			res = queue_retire(w);
+		if (res != U3_SUCCESS && w->result == U3_SUCCESS) {
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "u3_cd_write() "
+				"failed: %s", u3_error_msg(w->device));
+			w->result = U3_FAILURE;
+		}
+		queue_free(w);
+	}
+
+	if (w->result == U3_SUCCESS && !*w->stop) {
+		if (load_pipeline_stalled(w->pipeline, w->consumer)) {
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "Dropped, no "
+				"progress for more than %u seconds",
+				LOAD_STALL_SECONDS);
+			w->result = U3_FAILURE;
+		} else if (load_pipeline_error(w->pipeline) != NULL) {
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "%s",
+				load_pipeline_error(w->pipeline));
+			w->result = U3_FAILURE;
+		}
+	}
+
+	// don't hold up the devices that are still loading
+	load_pipeline_release_all(w->pipeline, w->consumer);
+	load_pipeline_detach(w->pipeline, w->consumer);
+
+	if (cp->journal.blocks_done != cp->written)
+		load_checkpoint_write(cp);
+
+	if (w->verify != NULL && w->result == U3_SUCCESS && !*w->stop) {
+		w->verifying = 1;
+		if (load_verify_device(w->verify, w->device, w->stop,
+			&w->verified, &w->bad_block) != U3_SUCCESS)
+		{
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "%s",
+				u3_error_msg(w->device));
+			w->result = U3_FAILURE;
+		} else if (w->bad_block != LOAD_VERIFY_OK) {
+			snprintf(w->err_msg, U3_MAX_ERROR_LEN, "Verify failed, "
+				"block %u of the CD partition differs from the "
+				"image", w->bad_block);
+			w->result = U3_FAILURE;
+		}
+	}
+
+	w->finished = 1;
+	return NULL;
+}
+
+uint32_t load_writer_ahead(unsigned int queue_depth) {
+	if (queue_depth <= 1)
+		return 0;
+	if (queue_depth > U3_MAX_QUEUE_DEPTH)
+		queue_depth = U3_MAX_QUEUE_DEPTH;
+	return queue_depth * LOAD_CHUNK_BLOCKS;
+}
+
+int load_writer_start(struct load_writer *writer) {
+	int err;
+
+	writer->written = 0;
+	writer->verified = 0;
+	writer->verifying = 0;
+	writer->finished = 0;
+	writer->skipped = 0;
+	writer->bad_block = LOAD_VERIFY_OK;
+	writer->result = U3_SUCCESS;
+	writer->readback = NULL;
+	writer->queue = NULL;
+	writer->err_msg[0] = '\0';
+
+	if (writer->mode == LOAD_WRITE_DIFF) {
+		writer->readback = (uint8_t *) malloc(LOAD_CHUNK_BLOCKS *
+				U3_BLOCK_SIZE);
+		if (writer->readback == NULL) {
+			snprintf(writer->err_msg, U3_MAX_ERROR_LEN, "Failed "
+				"allocating memory for read buffer");
+			return U3_FAILURE;
+		}
+	}
+
+	err = pthread_create(&writer->thread, NULL, writer_main, writer);
+	if (err != 0) {
+		snprintf(writer->err_msg, U3_MAX_ERROR_LEN, "Failed starting "
+			"writer thread: %s", strerror(err));
+		free(writer->readback);
+		writer->readback = NULL;
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+int load_writer_join(struct load_writer *writer) {
+	pthread_join(writer->thread, NULL);
+
+	free(writer->readback);
+	writer->readback = NULL;
+
+	return writer->result;
+}
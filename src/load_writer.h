@@ -0,0 +1,186 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __LOAD_WRITER_H__
+#define __LOAD_WRITER_H__
+/**
+ * @file	load_writer.h
+ *
+ *		Writing a CD image to one device. A writer takes the chunks of
+ *		a load pipeline as one of its consumers, writes them to the CD
+ *		partition, keeps the load journal of the device and optionally
+ *		verifies the device afterwards. Every writer runs in a thread of
+ *		its own, so several devices are loaded from one pipeline at
+ *		the same time.
+ */
+
+#include <pthread.h>
+
+#include "u3.h"
+#include "load_journal.h"
+#include "load_pipeline.h"
+#include "load_verify.h"
+#include "md5.h"
+
+#define LOAD_CHECKPOINT_INTERVAL 2048	// blocks between journal checkpoints
+#define LOAD_DEFAULT_QUEUE	4	// default number of CD writes in flight
+
+struct load_queue;
+
+/**
+ * How the blocks of the image are written
+ */
+enum load_write_mode {
+	LOAD_WRITE_ALL = 0,	// write every block
+	LOAD_WRITE_DIFF = 1,	// only write blocks that differ from the device
+	LOAD_WRITE_SPARSE = 2,	// skip zero blocks in the clean part of the CD
+	LOAD_WRITE_CHANGED = 3,	// only write blocks marked in 'changed'
+};
+
+/**
+ * Settings of CD write commands
+ */
+struct load_write_setting {
+	unsigned int blocks;	// maximum blocks per command
+	unsigned int offset;	// commands don't cross block numbers equal to
+				// this modulo 'blocks'
+};
+
+/**
+ * Checkpoint state of a load
+ */
+struct load_checkpoint {
+	int		    enabled;	// journal is written
+	struct load_journal journal;	// current record
+	md5_context	    ctx;	// digest of blocks written so far
+	uint32_t	    written;	// blocks_done of last written record
+	uint32_t	    clean_from;	// clean_from at the start of the load
+	uint32_t	    ahead;	// blocks that may be in flight beyond
+					// blocks_done
+};
+
+/**
+ * Writer state
+ *
+ * The fields up to 'checkpoint' are set up by the caller before starting
+ * the writer, the others are maintained by the writer.
+ */
+struct load_writer {
+	u3_handle_t	 *device;	// device to write to
+	struct load_pipeline *pipeline;	// pipeline to take chunks from
+	unsigned int	 consumer;	// consumer number in 'pipeline'
+	struct load_verify *verify;	// verification state or NULL
+	enum load_write_mode mode;	// how blocks are written
+	uint8_t		 *changed;	// bitmap of blocks to write for
+					// LOAD_WRITE_CHANGED, see manifest_diff()
+	struct load_write_setting write; // write setting, updated on fallback
+	unsigned int	 queue_depth;	// CD writes kept in flight, 1 waits
+					// for every write
+	struct load_checkpoint checkpoint; // journal of the device
+	volatile int	 *stop;		// writing stops when this becomes
+					// non zero
+
+	volatile uint32_t written;	// blocks of the image done
+	volatile uint32_t verified;	// blocks compared by verification
+	volatile int	 verifying;	// writing is done, verifying
+	volatile int	 finished;	// writer is done
+	unsigned int	 skipped;	// blocks not written
+	uint32_t	 bad_block;	// first block that differs from the
+					// image, or LOAD_VERIFY_OK
+	int		 result;	// U3_SUCCESS if the load succeeded
+	uint8_t		 *readback;	// buffer of LOAD_WRITE_DIFF
+	struct load_queue *queue;	// CD writes in flight, or NULL
+	pthread_t	 thread;
+
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Write a range of blocks to the CD partition
+ *
+ * Blocks are written using multi block commands of at most 'write->blocks'
+ * blocks, split at block numbers equal to 'write->offset' modulo
+ * 'write->blocks'. If the device rejects a multi block command, the setting
+ * is lowered to single blocks and the range is written one block at a time.
+ *
+ * @param device	U3 device handle
+ * @param block_num	First block to write
+ * @param block_cnt	Number of blocks in 'buffer'
+ * @param buffer	Block data
+ * @param write		Write setting, updated on fallback
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+int load_write_blocks(u3_handle_t *device, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *buffer,
+		struct load_write_setting *write);
+
+/**
+ * Write the journal record of a load
+ *
+ * The clean part of the CD partition is moved beyond the blocks that may be
+ * written before the next record, including 'ahead' blocks in flight. If the
+ * record can't be written, the journal is removed and checkpoints are
+ * disabled.
+ *
+ * @param cp		Checkpoint state
+ */
+void load_checkpoint_write(struct load_checkpoint *cp);
+
+/**
+ * Get blocks a writer may have in flight beyond the blocks done
+ *
+ * @param queue_depth	Number of CD writes kept in flight
+ *
+ * @returns		Value for load_checkpoint.ahead
+ */
+uint32_t load_writer_ahead(unsigned int queue_depth);
+
+/**
+ * Start writer
+ *
+ * This starts a thread that writes the chunks taken from the pipeline till
+ * the end of the image, then verifies the device if 'verify' is set. If the
+ * subsystem can queue commands, up to 'queue_depth' CD writes are kept in
+ * flight. They write straight from the chunk data, so chunks are only
+ * released once their writes completed, and the writer holds less than
+ * the pipeline depth. Blocks count as done, and are journaled, once all
+ * writes up to them completed. The checkpoint state must allow for
+ * 'queue_depth' chunks ahead, see load_writer_ahead().
+ * 'finished' is set when the thread is done.
+ *
+ * @param writer	Writer, set up by the caller
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be found in writer->err_msg
+ */
+int load_writer_start(struct load_writer *writer);
+
+/**
+ * Wait for writer to finish
+ *
+ * @param writer	Writer started using load_writer_start()
+ *
+ * @returns		U3_SUCCESS if the image was written, and verified if
+ * 			requested, else U3_FAILURE and an error string can be
+ * 			found in writer->err_msg
+ */
+int load_writer_join(struct load_writer *writer);
+
+#endif // __LOAD_WRITER_H__
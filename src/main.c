@@ -25,7 +25,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <assert.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -33,9 +37,19 @@
 #include "u3_commands.h"
 #include "u3_scsi.h"
 #include "u3_error.h"
+#include "u3_stats.h"
 
 #include "secure_input.h"
 #include "display_progress.h"
+#include "image_source.h"
+#include "load_pipeline.h"
+#include "load_journal.h"
+#include "load_verify.h"
+#include "load_writer.h"
+#include "chip_profile.h"
+#include "manifest.h"
+#include "zero_block.h"
+#include "md5.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -44,6 +58,26 @@
 #define MAX_FILENAME_STRING_LENGTH 1024
 #define MAX_PASSWORD_LENGTH 1024
 
+#define LOAD_POLL_US 100000		// interval of load progress updates
+
+#define REOPEN_TIMEOUT 30		// seconds a reset device may take to
+					// come back
+#define DISCONNECT_TIMEOUT 5		// seconds a reset device may take to
+					// disconnect
+#define REOPEN_POLL_US 250000		// interval of reopen attempts
+
+#define WATCH_POLL_MS 1000		// longest wait for a device event, so
+					// an interrupt is noticed
+#define WATCH_MAX_NAMES 64		// device names present at once
+
+#define PROBE_RUNS 32			// runs of blocks read by zero probe
+
+#define TUNE_BLOCKS 1024		// blocks written per tuning candidate
+#define TUNE_MIN_BLOCKS 256		// smallest region worth tuning on
+#define TUNE_ROUNDS 2			// times every candidate is timed
+#define TUNE_MARGIN 32			// a setting must be 1/32 faster to
+					// replace one tried before
+
 static char *version = VERSION;
 
 int debug = 0;
@@ -51,7 +85,61 @@ static int batch_mode = 0;
 static int quit = 0;
 
 enum action_t { unknown, load, partition, dump, info, unlock, change_password,
-		enable_security, disable_security, reset_security };
+		enable_security, disable_security, reset_security,
+		make_manifest, fit_load };
+
+/**
+ * Options of the load action
+ */
+struct load_options {
+	unsigned int depth;	// number of image chunks buffered ahead
+	int diff;		// only write blocks that differ from the device
+	int direct;		// read image bypassing the page cache
+	unsigned int queue;	// CD writes kept in flight
+	int resume;		// continue at the last journal checkpoint
+	int sparse;		// skip zero blocks of a freshly partitioned CD
+	int tune;		// benchmark CD write settings before loading
+	int verify;		// read back CD partition after loading
+	uint64_t size;		// size of image read from standard input
+	int concurrent;		// other devices are loaded at the same time,
+				// by do_watch()
+};
+
+/**
+ * Values of long only options
+ */
+enum {
+	OPT_DEPTH = 256,
+	OPT_DIFF,
+	OPT_DIRECT,
+	OPT_FIT_LOAD,
+	OPT_MANIFEST,
+	OPT_QUEUE,
+	OPT_RESUME,
+	OPT_SIZE,
+	OPT_SPARSE,
+	OPT_STATS,
+	OPT_TUNE,
+	OPT_VERIFY,
+	OPT_WATCH,
+};
+
+static struct option long_options[] = {
+	{ "depth",	required_argument,	NULL,	OPT_DEPTH },
+	{ "diff",	no_argument,		NULL,	OPT_DIFF },
+	{ "direct",	no_argument,		NULL,	OPT_DIRECT },
+	{ "fit-load",	required_argument,	NULL,	OPT_FIT_LOAD },
+	{ "manifest",	required_argument,	NULL,	OPT_MANIFEST },
+	{ "queue",	required_argument,	NULL,	OPT_QUEUE },
+	{ "resume",	no_argument,		NULL,	OPT_RESUME },
+	{ "size",	required_argument,	NULL,	OPT_SIZE },
+	{ "sparse",	no_argument,		NULL,	OPT_SPARSE },
+	{ "stats",	optional_argument,	NULL,	OPT_STATS },
+	{ "tune",	no_argument,		NULL,	OPT_TUNE },
+	{ "verify",	no_argument,		NULL,	OPT_VERIFY },
+	{ "watch",	no_argument,		NULL,	OPT_WATCH },
+	{ NULL,		0,			NULL,	0 }
+};
 
 /********************************** Helpers ***********************************/
 
@@ -154,91 +242,1092 @@ static int get_tries_left(u3_handle_t *device, int *tries) {
 
 /********************************** Actions ***********************************/
 
-static int do_load(u3_handle_t *device, char *iso_filename) {
-	struct stat file_stat;
-	struct part_info pinfo;
-	off_t cd_size;
-	FILE *fp;
-	uint8_t	buffer[U3_BLOCK_SIZE];
-	unsigned int bytes_read=0;
-	unsigned int block_num=0;
-	unsigned int block_cnt=0;
+/**
+ * Get serial number of device
+ *
+ * @param device	U3 device handle
+ * @param serial	Buffer of U3_MAX_SERIAL_LEN+1 bytes to return the
+ * 			serial number in as a \0 terminated string.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+static int get_serial(u3_handle_t *device, char *serial) {
+	struct property_03 device_properties;
 
-	// determine file size
-	if (stat(iso_filename, &file_stat) == -1) {
-		perror("Failed stating iso file");
-		return EXIT_FAILURE;
+	if (u3_read_device_property(device, 0x03,
+				(uint8_t *) &device_properties,
+				sizeof(device_properties)
+				) != U3_SUCCESS)
+	{
+		return U3_FAILURE;
 	}
-	if (file_stat.st_size == 0) {
-		fprintf(stderr, "ISO file is empty\n");
-		return EXIT_FAILURE;
+
+	memcpy(serial, device_properties.serial, U3_MAX_SERIAL_LEN);
+	serial[U3_MAX_SERIAL_LEN] = '\0';
+	return U3_SUCCESS;
+}
+
+/**
+ * Hash the first blocks of an image
+ *
+ * This reads the first 'block_cnt' blocks of the image and updates 'ctx'
+ * with them. Afterwards the image source is positioned at block 'block_cnt'.
+ * If 'verify' is not NULL, the block digests for verification are computed
+ * too.
+ *
+ * @param src		Image source, positioned at block 0
+ * @param block_cnt	Number of blocks to hash
+ * @param ctx		MD5 context to update
+ * @param verify	Verification state or NULL
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using
+ * 			image_source_error()
+ */
+static int hash_image_blocks(struct image_source *src, uint32_t block_cnt,
+	md5_context *ctx, struct load_verify *verify)
+{
+	struct load_verify_job job;
+	uint8_t *buffer, *data;
+	uint32_t block_num = 0;
+	uint32_t cnt;
+	int res;
+
+	// aligned, so direct image reads don't need a bounce buffer
+	if (load_buffer_alloc(&buffer, LOAD_CHUNK_BLOCKS * U3_BLOCK_SIZE) != 0)
+	{
+		snprintf(src->err_msg, U3_MAX_ERROR_LEN, "Failed allocating "
+			"memory for hash buffer");
+		return U3_FAILURE;
 	}
 
-	cd_size = ((uintmax_t) file_stat.st_size) / U3_SECTOR_SIZE;
-	if (file_stat.st_size % U3_SECTOR_SIZE)
-		cd_size++;
-	block_cnt = ((uintmax_t) file_stat.st_size) / U3_BLOCK_SIZE;
-	if (file_stat.st_size % U3_BLOCK_SIZE)
-		block_cnt++;
+	while (block_cnt > 0) {
+		cnt = block_cnt;
+		if (cnt > LOAD_CHUNK_BLOCKS)
+			cnt = LOAD_CHUNK_BLOCKS;
+
+		res = image_source_read(src, buffer, cnt, &data);
+		if (res <= 0) {
+			if (res == 0) {
+				snprintf(src->err_msg, U3_MAX_ERROR_LEN,
+					"Unexpected end of iso file");
+			}
+			free(buffer);
+			return U3_FAILURE;
+		}
+
+		if (verify != NULL)
+			load_verify_image(verify, &job, block_num, res, data);
+		md5_update(ctx, data, res * U3_BLOCK_SIZE);
+		if (verify != NULL)
+			load_verify_wait(verify, &job);
+
+		block_num += res;
+		block_cnt -= res;
+	}
+
+	free(buffer);
+	return U3_SUCCESS;
+}
+
+/**
+ * Prepare checkpointing of a load
+ *
+ * This looks up the journal record of the device. If 'resume' is set and the
+ * record matches the image, the image source is positioned after the
+ * recorded blocks, else at block 0. A new record is written before any block
+ * is written, so a stale record can't be resumed. The clean part of the CD
+ * partition is taken over from the old record.
+ *
+ * @param device	U3 device handle
+ * @param src		Image source, positioned at block 0
+ * @param resume	TRUE to continue a previous load
+ * @param verify	Verification state or NULL, the digests of skipped
+ * 			blocks are computed when resuming
+ * @param ahead		Blocks the writer may have in flight, see
+ * 			load_writer_ahead()
+ * @param cp		Checkpoint state to initialize
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE
+ */
+static int checkpoint_start(u3_handle_t *device, struct image_source *src,
+	int resume, struct load_verify *verify, uint32_t ahead,
+	struct load_checkpoint *cp)
+{
+	struct load_journal old;
+	char serial[U3_MAX_SERIAL_LEN+1];
+	int have_old;
+
+	memset(cp, 0, sizeof(struct load_checkpoint));
+	cp->ahead = ahead;
+	md5_starts(&cp->ctx);
+	cp->clean_from = LOAD_JOURNAL_NOT_CLEAN;
+
+	if (get_serial(device, serial) != U3_SUCCESS) {
+		if (resume) {
+			fprintf(stderr, "Failed reading device serial: %s\n",
+				u3_error_msg(device));
+			return U3_FAILURE;
+		}
+		if (debug) {
+			fprintf(stderr, "Failed reading device serial, "
+				"disabling checkpoints: %s\n",
+				u3_error_msg(device));
+		}
+		return U3_SUCCESS;
+	}
+
+	have_old = load_journal_read(serial, &old) != -1;
+	if (have_old)
+		cp->clean_from = old.clean_from;
+
+	cp->enabled = TRUE;
+	strcpy(cp->journal.serial, serial);
+	cp->journal.image_size = src->size;
+	cp->journal.clean_from = cp->clean_from;
+
+	if (resume) {
+		if (!have_old) {
+			printf("No load journal found for device %s, "
+				"starting at block 0\n", serial);
+		} else if (old.image_size != src->size) {
+			printf("Load journal of device %s is for another "
+				"image, starting at block 0\n", serial);
+		} else if (old.blocks_done > 0) {
+			uint8_t digest[LOAD_JOURNAL_DIGEST_LEN];
+			md5_context ctx;
+
+			if (hash_image_blocks(src, old.blocks_done, &cp->ctx,
+				verify) != U3_SUCCESS)
+			{
+				fprintf(stderr, "%s\n",
+					image_source_error(src));
+				return U3_FAILURE;
+			}
+			memcpy(&ctx, &cp->ctx, sizeof(ctx));
+			md5_finish(&ctx, digest);
+
+			if (memcmp(digest, old.digest, sizeof(digest)) == 0) {
+				printf("Resuming at block %u\n",
+					old.blocks_done);
+				cp->journal.blocks_done = old.blocks_done;
+			} else {
+				printf("Load journal of device %s is for "
+					"another image, starting at block "
+					"0\n", serial);
+				md5_starts(&cp->ctx);
+				if (image_source_seek(src, 0) != U3_SUCCESS) {
+					fprintf(stderr, "%s\n",
+						image_source_error(src));
+					return U3_FAILURE;
+				}
+			}
+		}
+	}
+
+	load_checkpoint_write(cp);
+	return U3_SUCCESS;
+}
+
+/**
+ * Check that the device name refers to the CD drive of the U3 device
+ *
+ * READ(10) goes to the addressed logical unit, so reading back the CD
+ * partition only works on the CD drive.
+ *
+ * @param device	U3 device handle
+ * @param cd_blocks	Used to return the number of blocks of the CD drive
+ *
+ * @returns		U3_SUCCESS if the device is the CD drive, else
+ * 			U3_FAILURE and an error message is printed
+ */
+static int check_cd_drive(u3_handle_t *device, uint32_t *cd_blocks) {
+	uint32_t lu_block_size;
+
+	if (u3_cd_capacity(device, cd_blocks, &lu_block_size) != U3_SUCCESS) {
+		fprintf(stderr, "u3_cd_capacity() failed: %s\n",
+			u3_error_msg(device));
+		return U3_FAILURE;
+	}
+	if (lu_block_size != U3_BLOCK_SIZE) {
+		fprintf(stderr, "Device is not the CD drive of the U3 device "
+			"(block size %u), can't read CD contents\n",
+			lu_block_size);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Probe if the chip reads back unwritten CD blocks as zero
+ *
+ * This reads PROBE_RUNS runs of blocks spread over the part of the CD
+ * partition that hasn't been written since partitioning.
+ *
+ * @param device	U3 device handle
+ * @param clean_from	First block not written since partitioning
+ * @param result	Used to return the probe result
+ *
+ * @returns		U3_SUCCESS if probing finished, else U3_FAILURE and an
+ * 			error message is printed
+ */
+static int probe_zero_after_partition(u3_handle_t *device, uint32_t clean_from,
+	enum chip_probe *result)
+{
+	uint8_t *buffer;
+	uint32_t cd_blocks, clean_blocks, block_num, cnt, i, j;
+
+	if (check_cd_drive(device, &cd_blocks) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	*result = CHIP_PROBE_PASSED;
+	if (clean_from >= cd_blocks)
+		return U3_SUCCESS;
+	clean_blocks = cd_blocks - clean_from;
+
+	buffer = (uint8_t *) malloc(LOAD_CHUNK_BLOCKS * U3_BLOCK_SIZE);
+	if (buffer == NULL) {
+		fprintf(stderr, "Failed allocating memory for read buffer\n");
+		return U3_FAILURE;
+	}
+
+	for (i = 0; i < PROBE_RUNS; i++) {
+		block_num = clean_from +
+			(uint64_t) clean_blocks * i / PROBE_RUNS;
+		cnt = cd_blocks - block_num;
+		if (cnt > LOAD_CHUNK_BLOCKS)
+			cnt = LOAD_CHUNK_BLOCKS;
+
+		if (u3_cd_read(device, block_num, cnt, buffer) != U3_SUCCESS) {
+			fprintf(stderr, "u3_cd_read() failed: %s\n",
+				u3_error_msg(device));
+			free(buffer);
+			return U3_FAILURE;
+		}
+
+		for (j = 0; j < cnt; j++) {
+			if (!zero_block(buffer + j * U3_BLOCK_SIZE)) {
+				if (debug) {
+					fprintf(stderr, "Unwritten CD block "
+						"%u is not zero\n",
+						block_num + j);
+				}
+				*result = CHIP_PROBE_FAILED;
+				free(buffer);
+				return U3_SUCCESS;
+			}
+		}
+	}
+
+	free(buffer);
+	return U3_SUCCESS;
+}
+
+/**
+ * Read the profile of the chip of a device
+ *
+ * @param device	U3 device handle
+ * @param profile	Used to return the profile
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error message is printed
+ */
+static int read_chip_profile(u3_handle_t *device,
+	struct chip_profile *profile)
+{
+	struct chip_info chip_info;
+
+	if (u3_chip_info(device, &chip_info) != U3_SUCCESS) {
+		fprintf(stderr, "u3_chip_info() failed: %s\n",
+			u3_error_msg(device));
+		return U3_FAILURE;
+	}
+	if (chip_profile_read(&chip_info, profile) == -1) {
+		fprintf(stderr, "Failed reading chip profile: %s\n",
+			strerror(errno));
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Check that zero blocks can be skipped
+ *
+ * Zero blocks are only skipped in the part of the CD partition that hasn't
+ * been written since partitioning, and only if the chip is known to read
+ * back such blocks as zero. The chip is probed the first time.
+ *
+ * @param device	U3 device handle
+ *
+ * @returns		U3_SUCCESS if zero blocks can be skipped, else
+ * 			U3_FAILURE and an error message is printed
+ */
+static int sparse_check(u3_handle_t *device) {
+	char serial[U3_MAX_SERIAL_LEN+1];
+	struct load_journal journal;
+	struct chip_profile profile;
+
+	if (get_serial(device, serial) != U3_SUCCESS) {
+		fprintf(stderr, "Failed reading device serial: %s\n",
+			u3_error_msg(device));
+		return U3_FAILURE;
+	}
+
+	if (load_journal_read(serial, &journal) == -1 ||
+	    journal.clean_from == LOAD_JOURNAL_NOT_CLEAN)
+	{
+		fprintf(stderr, "CD partition of device %s may have been "
+			"written since it was partitioned. Repartition the "
+			"device using '-p' before loading with --sparse\n",
+			serial);
+		return U3_FAILURE;
+	}
+
+	if (read_chip_profile(device, &profile) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	if (profile.zero_after_partition == CHIP_PROBE_UNKNOWN) {
+		printf("Probing if chip %s reads back unwritten CD blocks as "
+			"zero\n", profile.name);
+		if (probe_zero_after_partition(device, journal.clean_from,
+				&profile.zero_after_partition) != U3_SUCCESS)
+			return U3_FAILURE;
+		if (chip_profile_write(&profile) == -1 && debug) {
+			fprintf(stderr, "Failed writing chip profile: %s\n",
+				strerror(errno));
+		}
+	}
+
+	if (profile.zero_after_partition != CHIP_PROBE_PASSED) {
+		fprintf(stderr, "Chip %s doesn't read back unwritten CD blocks "
+			"as zero, zero blocks can't be skipped\n",
+			profile.name);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Benchmark CD write settings
+ *
+ * Every multi block size from U3_MAX_CD_WRITE_BLOCKS down to a single block
+ * is tried, at offsets 0 and every power of two below the size. Each setting
+ * writes the same range of blocks TUNE_ROUNDS times and the fastest round
+ * counts. Settings are tried from large to small, so a smaller size or other
+ * offset is only picked if it is clearly faster. The blocks are overwritten
+ * with a pattern. The caller must make sure they are written again
+ * afterwards.
+ *
+ * @param device	U3 device handle
+ * @param block_num	First block of the scratch range
+ * @param block_cnt	Number of blocks in the scratch range
+ * @param best		Used to return the fastest setting
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error message is printed
+ */
+static int tune_cd_writes(u3_handle_t *device, uint32_t block_num,
+	uint32_t block_cnt, struct load_write_setting *best)
+{
+	struct load_write_setting setting, used;
+	uint64_t start, elapsed, best_time = UINT64_MAX;
+	uint64_t times[U3_MAX_CD_WRITE_BLOCKS + 1][U3_MAX_CD_WRITE_BLOCKS];
+	uint8_t *buffer;
+	uint32_t seed = 0x55335533;
+	unsigned int round, i;
+
+	if ((buffer = (uint8_t *) malloc(block_cnt * U3_BLOCK_SIZE)) == NULL) {
+		fprintf(stderr, "Failed allocating memory for tuning "
+			"buffer\n");
+		return U3_FAILURE;
+	}
+
+	// not zero, not compressible
+	for (i = 0; i < block_cnt * U3_BLOCK_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 24;
+	}
+
+	memset(times, 0, sizeof(times));
+	best->blocks = 1;
+	best->offset = 0;
+
+	// Interleave the rounds so a slow phase of the device doesn't hit
+	// all runs of one setting.
+	for (round = 0; round < TUNE_ROUNDS && !quit; round++) {
+		for (setting.blocks = U3_MAX_CD_WRITE_BLOCKS;
+		     setting.blocks >= 1 && !quit; setting.blocks /= 2)
+		{
+			for (setting.offset = 0;
+			     setting.offset < setting.blocks && !quit;
+			     setting.offset = setting.offset ? setting.offset * 2 : 1)
+			{
+				used = setting;
+				start = u3_stats_now();
+				if (load_write_blocks(device, block_num,
+					block_cnt, buffer, &used) != U3_SUCCESS)
+				{
+					fprintf(stderr, "u3_cd_write() failed: "
+						"%s\n", u3_error_msg(device));
+					free(buffer);
+					return U3_FAILURE;
+				}
+				elapsed = u3_stats_now() - start;
+
+				// device doesn't take this size
+				if (used.blocks != setting.blocks)
+					elapsed = UINT64_MAX;
+
+				if (round == 0 ||
+				    elapsed < times[setting.blocks][setting.offset])
+					times[setting.blocks][setting.offset] = elapsed;
+
+				if (round < TUNE_ROUNDS - 1)
+					continue;
+
+				elapsed = times[setting.blocks][setting.offset];
+				if (debug && elapsed != UINT64_MAX) {
+					fprintf(stderr, "%2u blocks at offset "
+						"%2u: %.2f MB/s\n",
+						setting.blocks, setting.offset,
+						(double) block_cnt *
+						U3_BLOCK_SIZE / (elapsed + 1));
+				}
+				if (elapsed < best_time -
+				    best_time / TUNE_MARGIN)
+				{
+					best_time = elapsed;
+					*best = setting;
+				}
+			}
+		}
+	}
+
+	free(buffer);
+	return U3_SUCCESS;
+}
+
+/**
+ * Read the manifest of an image file
+ *
+ * The manifest is only used if it was built from the image as it is now,
+ * going by size and the status of the file, see manifest_current(). Images
+ * generated from a directory have no manifest.
+ *
+ * @param filename	Image file name
+ * @param src		Image source
+ * @param m		Manifest to initialize
+ *
+ * @returns		TRUE if a manifest was read, else FALSE
+ */
+static int read_image_manifest(const char *filename, struct image_source *src,
+	struct manifest *m)
+{
+	char path[MAX_FILENAME_STRING_LENGTH + sizeof(MANIFEST_SUFFIX)];
+	struct stat st;
+
+	if (strcmp(filename, "-") == 0 || src->type == IMAGE_SOURCE_TREE ||
+	    stat(filename, &st) == -1)
+	{
+		return FALSE;
+	}
+
+	snprintf(path, sizeof(path), "%s%s", filename, MANIFEST_SUFFIX);
+	if (manifest_read(m, path) == -1) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Ignoring manifest %s: %s\n", path,
+				errno == EINVAL ? "Invalid manifest file" :
+				strerror(errno));
+		}
+		return FALSE;
+	}
+
+	if (m->image_size != src->size || !manifest_current(m, &st)) {
+		printf("Manifest %s is out of date, ignoring it\n", path);
+		manifest_free(m);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Find the blocks of an image that differ from the CD partition
+ *
+ * This compares the manifest of the image with the manifest stored for the
+ * device. If there is none, 'changed' is left NULL.
+ *
+ * @param device	U3 device handle
+ * @param manifest	Manifest of the image
+ * @param writer	Writer to set 'changed' and 'mode' of
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error message is printed
+ */
+static int diff_device_manifest(u3_handle_t *device, struct manifest *manifest,
+	struct load_writer *writer)
+{
+	char serial[U3_MAX_SERIAL_LEN+1];
+	char path[MAX_FILENAME_STRING_LENGTH];
+	struct manifest old;
+	uint32_t cnt;
+
+	if (get_serial(device, serial) != U3_SUCCESS ||
+	    manifest_device_path(serial, path, sizeof(path)) == -1 ||
+	    manifest_read(&old, path) == -1)
+	{
+		if (debug) {
+			fprintf(stderr, "No manifest of the CD partition, "
+				"reading it back\n");
+		}
+		return U3_SUCCESS;
+	}
+
+	writer->changed = (uint8_t *) malloc((manifest->block_cnt + 7) / 8);
+	if (writer->changed == NULL) {
+		fprintf(stderr, "Failed allocating memory for changed "
+			"blocks\n");
+		manifest_free(&old);
+		return U3_FAILURE;
+	}
+
+	cnt = manifest_diff(&old, manifest, writer->changed);
+	writer->mode = LOAD_WRITE_CHANGED;
+	manifest_free(&old);
+
+	if (debug) {
+		fprintf(stderr, "%u blocks changed since the last load of the "
+			"device\n", cnt);
+	}
+	return U3_SUCCESS;
+}
+
+/**
+ * Prepare the load of one device
+ *
+ * This checks that the image fits, looks up the write setting of the chip,
+ * starts checkpointing and tunes CD writes if requested. Error messages are
+ * printed.
+ *
+ * With a manifest of the image, --diff compares it with the manifest stored
+ * for the device by its last complete load, instead of reading back the CD
+ * partition. The stored manifest is removed before anything is written.
+ *
+ * @param device	U3 device handle
+ * @param src		Image source, positioned at block 0
+ * @param block_cnt	Number of blocks of the image
+ * @param options	Load options
+ * @param manifest	Manifest of the image or NULL
+ * @param verify	Verification state or NULL
+ * @param writer	Writer to set up, 'changed' must be freed by the
+ * 			caller
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE
+ */
+static int prepare_load(u3_handle_t *device, struct image_source *src,
+	uint32_t block_cnt, struct load_options *options,
+	struct manifest *manifest, struct load_verify *verify,
+	struct load_writer *writer)
+{
+	struct part_info pinfo;
+	struct chip_profile profile;
+	uint64_t cd_size;
+	uint32_t lu_blocks;
+	int have_profile;
+
+	memset(writer, 0, sizeof(struct load_writer));
+	writer->device = device;
+	writer->verify = verify;
+	writer->stop = &quit;
+	writer->write.blocks = U3_MAX_CD_WRITE_BLOCKS;
+	writer->write.offset = 0;
+	writer->queue_depth = options->queue;
+	if (options->diff)
+		writer->mode = LOAD_WRITE_DIFF;
+	else if (options->sparse)
+		writer->mode = LOAD_WRITE_SPARSE;
+	else
+		writer->mode = LOAD_WRITE_ALL;
 
 	// check partition size
+	cd_size = src->size / U3_SECTOR_SIZE;
+	if (src->size % U3_SECTOR_SIZE)
+		cd_size++;
+
 	if (u3_partition_info(device, &pinfo) != U3_SUCCESS) {
 		fprintf(stderr, "u3_partition_info() failed: %s\n",
 			u3_error_msg(device));
-		return EXIT_FAILURE;
+		return U3_FAILURE;
 	}
 
 	if (cd_size > pinfo.cd_size) {
 		fprintf(stderr, "CD image (%ju bytes) is to big for current CD "
 			"partition (%llu bytes)\n",
-			(uintmax_t) file_stat.st_size,
+			(uintmax_t) src->size,
 			1ll * U3_SECTOR_SIZE * pinfo.cd_size);
+		return U3_FAILURE;
+	}
+
+	if (options->diff && manifest != NULL &&
+	    diff_device_manifest(device, manifest, writer) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	if (((options->diff && writer->changed == NULL) || options->verify) &&
+	    check_cd_drive(device, &lu_blocks) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	if (options->sparse && sparse_check(device) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	// use the write setting found by an earlier --tune
+	have_profile = read_chip_profile(device, &profile) == U3_SUCCESS;
+	if (options->tune && !have_profile)
+		return U3_FAILURE;
+	if (have_profile && profile.write_blocks != 0) {
+		writer->write.blocks = profile.write_blocks;
+		writer->write.offset = profile.write_offset;
+		if (debug) {
+			fprintf(stderr, "Writing %u blocks per command at "
+				"offset %u, as tuned for chip %s\n",
+				writer->write.blocks, writer->write.offset,
+				profile.name);
+		}
+	}
+
+	if (checkpoint_start(device, src, options->resume, verify,
+			load_writer_ahead(writer->queue_depth),
+			&writer->checkpoint) != U3_SUCCESS)
+		return U3_FAILURE;
+
+	// the stored manifest is only valid as long as the load is complete
+	if (writer->checkpoint.journal.serial[0] != '\0' &&
+	    manifest_device_remove(writer->checkpoint.journal.serial) == -1)
+	{
+		fprintf(stderr, "Failed removing manifest of device: %s\n",
+			strerror(errno));
+		return U3_FAILURE;
+	}
+
+	// Tune on blocks the load is about to write. The journal record of
+	// checkpoint_start() doesn't count them as clean anymore, nor may
+	// --sparse skip them.
+	if (options->tune) {
+		uint32_t tune_num = src->offset / U3_BLOCK_SIZE;
+		uint32_t tune_cnt = block_cnt - tune_num;
+
+		if (tune_cnt > TUNE_BLOCKS)
+			tune_cnt = TUNE_BLOCKS;
+
+		if (tune_cnt < TUNE_MIN_BLOCKS) {
+			printf("Image too small to tune CD writes on, "
+				"using %u blocks per command\n",
+				writer->write.blocks);
+		} else {
+			printf("Tuning CD writes on blocks %u-%u\n", tune_num,
+				tune_num + tune_cnt - 1);
+			if (tune_cd_writes(device, tune_num, tune_cnt,
+				&writer->write) != U3_SUCCESS)
+			{
+				return U3_FAILURE;
+			}
+			if (writer->checkpoint.clean_from < tune_num + tune_cnt)
+				writer->checkpoint.clean_from = tune_num +
+						tune_cnt;
+
+			if (!quit) {
+				printf("Using %u blocks per command at offset "
+					"%u for chip %s\n",
+					writer->write.blocks,
+					writer->write.offset, profile.name);
+				profile.write_blocks = writer->write.blocks;
+				profile.write_offset = writer->write.offset;
+				if (chip_profile_write(&profile) == -1) {
+					fprintf(stderr, "Failed writing chip "
+						"profile: %s\n",
+						strerror(errno));
+				}
+			}
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Show progress of the writers till they are all finished
+ *
+ * Progress is the sum over all devices. Once every writer that is still
+ * running verifies, the verification progress is shown.
+ *
+ * @param writers	Writers that were started
+ * @param nwriters	Number of writers
+ * @param block_cnt	Number of blocks of the image
+ * @param show		Draw the progress, FALSE only waits
+ */
+static void watch_writers(struct load_writer *writers, unsigned int nwriters,
+	uint32_t block_cnt, int show)
+{
+	unsigned int i, running, verifying;
+	uint32_t total = nwriters * block_cnt;
+	uint32_t cur;
+	int verify_phase = FALSE;
+	int verify_mask[LOAD_MAX_CONSUMERS];
+
+	if (show)
+		display_progress_start("Loading", "blocks", U3_BLOCK_SIZE);
+	for (;;) {
+		running = verifying = 0;
+		for (i = 0; i < nwriters; i++) {
+			if (writers[i].finished)
+				continue;
+			running++;
+			if (writers[i].verifying)
+				verifying++;
+		}
+
+		if (!verify_phase && running > 0 && verifying == running) {
+			if (show) {
+				display_progress_end();
+				display_progress_start("Verifying", "blocks",
+					U3_BLOCK_SIZE);
+			}
+			verify_phase = TRUE;
+			total = verifying * block_cnt;
+			for (i = 0; i < nwriters; i++)
+				verify_mask[i] = !writers[i].finished;
+		}
+
+		cur = 0;
+		for (i = 0; i < nwriters; i++) {
+			if (verify_phase) {
+				if (!verify_mask[i])
+					continue;
+				cur += writers[i].finished ? block_cnt :
+					writers[i].verified;
+			} else {
+				cur += writers[i].finished ||
+					writers[i].verifying ? block_cnt :
+					writers[i].written;
+			}
+		}
+		if (show)
+			display_progress(cur, total);
+
+		if (running == 0)
+			break;
+		usleep(LOAD_POLL_US);
+	}
+	if (show)
+		display_progress_end();
+}
+
+/**
+ * Open the image to load
+ *
+ * @param src		Image source to initialize
+ * @param iso_filename	Name of the image, '-' for standard input
+ * @param options	Load options
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error message is printed
+ */
+static int open_image(struct image_source *src, const char *iso_filename,
+	struct load_options *options)
+{
+	int res;
+
+	if (strcmp(iso_filename, "-") == 0) {
+		res = image_source_open_stream(src, STDIN_FILENO,
+				options->size);
+	} else if (options->direct) {
+		res = image_source_open_direct(src, iso_filename);
+	} else {
+		res = image_source_open(src, iso_filename);
+	}
+	if (res != U3_SUCCESS) {
+		fprintf(stderr, "%s\n", image_source_error(src));
+		return U3_FAILURE;
+	}
+	if (src->size == 0) {
+		fprintf(stderr, "ISO file is empty\n");
+		image_source_close(src);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Load an image into devices
+ *
+ * @param devices	U3 device handles
+ * @param device_names	Names of the devices
+ * @param ndevices	Number of devices
+ * @param iso_filename	Name of the image
+ * @param src		Image opened using open_image(), closed on return
+ * @param options	Load options
+ *
+ * @returns		EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int do_load(u3_handle_t *devices, char **device_names,
+	unsigned int ndevices, char *iso_filename, struct image_source *src,
+	struct load_options *options)
+{
+	struct load_pipeline pipeline;
+	struct load_verify verify;
+	struct manifest manifest;
+	struct load_writer writers[LOAD_MAX_CONSUMERS];
+	const char *names[LOAD_MAX_CONSUMERS];
+	int started[LOAD_MAX_CONSUMERS];
+	char prefix[MAX_FILENAME_STRING_LENGTH+3];
+	char path[MAX_FILENAME_STRING_LENGTH];
+	int have_manifest;
+	unsigned int nwriters = 0;
+	unsigned int i;
+	unsigned int block_cnt=0;
+	int retval = EXIT_SUCCESS;
+
+	block_cnt = src->size / U3_BLOCK_SIZE;
+	if (src->size % U3_BLOCK_SIZE)
+		block_cnt++;
+
+	have_manifest = read_image_manifest(iso_filename, src, &manifest);
+
+	if (options->verify) {
+		if (load_verify_init(&verify, block_cnt) != U3_SUCCESS) {
+			fprintf(stderr, "%s\n", verify.err_msg);
+			if (have_manifest)
+				manifest_free(&manifest);
+			image_source_close(src);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// A device that can't be loaded doesn't keep the others from loading.
+	for (i = 0; i < ndevices && !quit; i++) {
+		if (ndevices > 1)
+			printf("Preparing %s\n", device_names[i]);
+		if (prepare_load(&devices[i], src, block_cnt, options,
+			have_manifest ? &manifest : NULL,
+			options->verify ? &verify : NULL, &writers[nwriters])
+			!= U3_SUCCESS)
+		{
+			free(writers[nwriters].changed);
+			if (ndevices > 1) {
+				fprintf(stderr, "%s: skipped\n",
+					device_names[i]);
+			}
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		writers[nwriters].consumer = nwriters;
+		names[nwriters] = device_names[i];
+		nwriters++;
+	}
+
+	if (nwriters == 0 || quit) {
+		for (i = 0; i < nwriters; i++)
+			free(writers[i].changed);
+		if (options->verify)
+			load_verify_free(&verify);
+		if (have_manifest)
+			manifest_free(&manifest);
+		image_source_close(src);
+		if (quit)
+			fprintf(stderr, "Aborted\n");
+		return EXIT_FAILURE;
+	}
+
+	// the image is read and hashed once for all devices
+	if (load_pipeline_start(&pipeline, src, options->depth, nwriters,
+			options->resume ? &writers[0].checkpoint.ctx : NULL,
+			options->verify ? &verify : NULL)
+		!= U3_SUCCESS)
+	{
+		fprintf(stderr, "%s\n", load_pipeline_error(&pipeline));
+		for (i = 0; i < nwriters; i++)
+			free(writers[i].changed);
+		if (options->verify)
+			load_verify_free(&verify);
+		if (have_manifest)
+			manifest_free(&manifest);
+		image_source_close(src);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nwriters; i++) {
+		writers[i].pipeline = &pipeline;
+		started[i] = load_writer_start(&writers[i]) == U3_SUCCESS;
+		if (!started[i]) {
+			load_pipeline_detach(&pipeline, i);
+			writers[i].result = U3_FAILURE;
+			writers[i].finished = TRUE;
+		}
+	}
+
+	watch_writers(writers, nwriters, block_cnt, !options->concurrent);
+
+	for (i = 0; i < nwriters; i++) {
+		struct load_writer *w = &writers[i];
+
+		if (started[i])
+			load_writer_join(w);
+		free(w->changed);
+
+		prefix[0] = '\0';
+		if (ndevices > 1 || options->concurrent)
+			snprintf(prefix, sizeof(prefix), "%s: ", names[i]);
+
+		if (w->result != U3_SUCCESS) {
+			fprintf(stderr, "%s%s\n", prefix, w->err_msg);
+			retval = EXIT_FAILURE;
+		}
+		if (w->checkpoint.enabled && (w->result != U3_SUCCESS || quit) &&
+		    w->checkpoint.journal.blocks_done < block_cnt)
+		{
+			printf("%s%u blocks written, use --resume to "
+				"continue\n", prefix,
+				w->checkpoint.journal.blocks_done);
+		}
+
+		// the CD partition now holds the image
+		if (have_manifest && w->result == U3_SUCCESS && !quit &&
+		    w->checkpoint.journal.serial[0] != '\0')
+		{
+			if (manifest_device_path(w->checkpoint.journal.serial,
+				path, sizeof(path)) == -1 ||
+			    manifest_write(&manifest, path) == -1)
+			{
+				fprintf(stderr, "%sFailed writing manifest of "
+					"device: %s\n", prefix,
+					strerror(errno));
+			}
+		}
+
+		if (w->mode == LOAD_WRITE_DIFF ||
+		    w->mode == LOAD_WRITE_CHANGED)
+		{
+			printf("%sSkipped %u of %u blocks (%llu bytes) that "
+				"were unchanged\n", prefix, w->skipped,
+				block_cnt, 1ll * U3_BLOCK_SIZE * w->skipped);
+		} else if (w->mode == LOAD_WRITE_SPARSE) {
+			printf("%sSkipped %u of %u blocks (%llu bytes) that "
+				"were zero\n", prefix, w->skipped, block_cnt,
+				1ll * U3_BLOCK_SIZE * w->skipped);
+		}
+	}
+
+	load_pipeline_stop(&pipeline);
+	image_source_close(src);
+	if (options->verify)
+		load_verify_free(&verify);
+	if (have_manifest)
+		manifest_free(&manifest);
+
+	if (retval == EXIT_SUCCESS && quit) {
+		fprintf(stderr, "Aborted\n");
+		retval = EXIT_FAILURE;
+	}
+
+	// do_watch() reports the device done
+	if (retval == EXIT_SUCCESS && !options->concurrent)
+		printf("OK\n");
+	return retval;
+}
+
+static int do_manifest(char *iso_filename) {
+	char path[MAX_FILENAME_STRING_LENGTH + sizeof(MANIFEST_SUFFIX)];
+	char root[2 * MANIFEST_DIGEST_LEN + 1];
+	struct image_source src;
+	struct manifest manifest;
+	struct stat st;
+
+	if (strcmp(iso_filename, "-") == 0) {
+		fprintf(stderr, "A manifest can't be made of standard "
+			"input\n");
+		return EXIT_FAILURE;
+	}
+
+	if (stat(iso_filename, &st) == -1) {
+		fprintf(stderr, "Failed opening iso file: %s\n",
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "A manifest can't be made of a directory\n");
+		return EXIT_FAILURE;
+	}
+	if (image_source_open(&src, iso_filename) != U3_SUCCESS) {
+		fprintf(stderr, "%s\n", image_source_error(&src));
+		return EXIT_FAILURE;
+	}
+	if (src.size == 0) {
+		fprintf(stderr, "ISO file is empty\n");
+		image_source_close(&src);
+		return EXIT_FAILURE;
+	}
+
+	if (manifest_build(&manifest, &src, &st, &quit)
+		!= U3_SUCCESS)
+	{
+		fprintf(stderr, "%s\n", manifest.err_msg);
+		image_source_close(&src);
 		return EXIT_FAILURE;
 	}
+	image_source_close(&src);
 
-	// open file
-	if ((fp = fopen(iso_filename, "rb")) == NULL) {
-		perror("Failed opening iso file");
+	snprintf(path, sizeof(path), "%s%s", iso_filename, MANIFEST_SUFFIX);
+	if (manifest_write(&manifest, path) == -1) {
+		fprintf(stderr, "Failed writing manifest %s: %s\n", path,
+			strerror(errno));
+		manifest_free(&manifest);
 		return EXIT_FAILURE;
 	}
 
-	// write file to device
-	block_num = 0;
-	do {
-		display_progress(block_num, block_cnt);
-
-		bytes_read = fread(buffer, sizeof(uint8_t), U3_BLOCK_SIZE, fp);
-		if (bytes_read != U3_BLOCK_SIZE) {
-			if (ferror(fp)) {
-				fclose(fp);
-				perror("\nFailed reading iso file");
-				return EXIT_FAILURE;
-			} else if (bytes_read == 0) {
-				continue;
-			} else if (bytes_read > U3_BLOCK_SIZE) {
-				fprintf(stderr, "\nRead more bytes then requested, impossible");
-				return EXIT_FAILURE;
-			} else {
-				// zeroize rest of buffer to prevent writing garbage
-				memset(buffer+bytes_read, 0, U3_BLOCK_SIZE-bytes_read);
-			}
-		} 
-		
-		if (u3_cd_write(device, block_num, buffer) != U3_SUCCESS) {
-			fclose(fp);
-			fprintf(stderr, "\nu3_cd_write() failed: %s\n", u3_error_msg(device));
-			return EXIT_FAILURE;
+	manifest_root_hex(&manifest, root);
+	printf("Wrote manifest of %u blocks to %s, root %s\n",
+		manifest.block_cnt, path, root);
+	manifest_free(&manifest);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Record in the load journal that the whole CD partition is unwritten and
+ * remove the manifest stored for the device
+ *
+ * @param device	U3 device handle
+ */
+static void journal_partitioned(u3_handle_t *device) {
+	struct load_journal journal;
+	md5_context ctx;
+
+	memset(&journal, 0, sizeof(journal));
+	if (get_serial(device, journal.serial) != U3_SUCCESS) {
+		if (debug) {
+			fprintf(stderr, "Failed reading device serial: %s\n",
+				u3_error_msg(device));
 		}
+		return;
+	}
 
-		block_num++;
-	} while (!feof(fp) && !quit);
-	display_progress(block_num, block_cnt);
-	putchar('\n');
+	md5_starts(&ctx);
+	md5_finish(&ctx, journal.digest);
+	journal.clean_from = 0;
 
-	fclose(fp);
+	if (load_journal_write(&journal) == -1 && debug) {
+		fprintf(stderr, "Failed writing load journal: %s\n",
+			strerror(errno));
+	}
 
-	printf("OK\n");
-	return EXIT_SUCCESS;
+	// the stored manifest doesn't describe the CD partition anymore
+	if (manifest_device_remove(journal.serial) == -1 && debug) {
+		fprintf(stderr, "Failed removing manifest of device: %s\n",
+			strerror(errno));
+	}
 }
 
 static int do_partition(u3_handle_t *device, char *size_string) {
@@ -256,16 +1345,257 @@ static int do_partition(u3_handle_t *device, char *size_string) {
 		fprintf(stderr, "u3_partition() failed: %s\n", u3_error_msg(device));
 		return EXIT_FAILURE;
 	}
+	journal_partitioned(device);
 
 	// reset device to make partitioning active
 	if (u3_reset(device) != U3_SUCCESS) {
 		fprintf(stderr, "u3_reset() failed: %s\n", u3_error_msg(device));
 		return EXIT_FAILURE;
 	}
+	sleep(2); // wait for device to reset
 
 	return EXIT_SUCCESS;
 }
 
+/**
+ * Reopen a device and check if it is the device that was reset
+ *
+ * @param device	U3 device handle
+ * @param which		Name of the device to open
+ * @param serial	Serial of the device
+ * @param cd_sectors	Expected size of the CD partition in sectors
+ * @param cd_drive	The device was opened as its CD drive
+ *
+ * @returns		TRUE if it is the device, else FALSE
+ */
+static int reopen_device(u3_handle_t *device, const char *which,
+	const char *serial, uint32_t cd_sectors, int cd_drive)
+{
+	char found[U3_MAX_SERIAL_LEN+1];
+	struct part_info pinfo;
+	uint32_t lu_blocks, lu_block_size;
+
+	if (u3_reopen(device, which) != U3_SUCCESS ||
+	    get_serial(device, found) != U3_SUCCESS ||
+	    strcmp(found, serial) != 0 ||
+	    u3_partition_info(device, &pinfo) != U3_SUCCESS ||
+	    pinfo.cd_size != cd_sectors)
+	{
+		return FALSE;
+	}
+
+	// the other logical unit of the device has the same serial
+	if (cd_drive && (u3_cd_capacity(device, &lu_blocks, &lu_block_size)
+			!= U3_SUCCESS || lu_block_size != U3_BLOCK_SIZE))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Wait for a reset device to come back with a new CD partition
+ *
+ * This first waits for the old handle to stop answering, as opening the
+ * device before it disconnected would still give the old device. Devices that
+ * reset without disconnecting are given DISCONNECT_TIMEOUT seconds. Then the
+ * device is reopened until it reports the serial it had before the reset and
+ * a CD partition of 'cd_sectors' sectors.
+ *
+ * The device may be renumbered when it comes back, e.g. get another sg
+ * node. If the subsystem can watch for devices, every device that arrives
+ * is checked for the serial as well, and 'which' is set to the new name.
+ *
+ * @param device	U3 device handle
+ * @param which		Name of the device, updated if it changed
+ * @param which_len	Size of 'which'
+ * @param serial	Serial of the device
+ * @param cd_sectors	Expected size of the CD partition in sectors
+ * @param cd_drive	The device was opened as its CD drive
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error message is printed. The device may be closed
+ * 			then, see u3_reopen().
+ */
+static int wait_reconnect(u3_handle_t *device, char *which, size_t which_len,
+	const char *serial, uint32_t cd_sectors, int cd_drive)
+{
+	char name[MAX_FILENAME_STRING_LENGTH];
+	struct part_info pinfo;
+	u3_handle_t watch;
+	int watching;
+	int event;
+	time_t deadline = time(NULL) + DISCONNECT_TIMEOUT;
+
+	while (!quit && time(NULL) < deadline &&
+	       u3_partition_info(device, &pinfo) == U3_SUCCESS)
+	{
+		usleep(REOPEN_POLL_US);
+	}
+
+	// devices present now are reported first, the device may be back
+	// already
+	watching = u3_watch_open(&watch) == U3_SUCCESS;
+	if (!watching && debug) {
+		fprintf(stderr, "Not watching for a renumbered device: %s\n",
+			u3_error_msg(&watch));
+	}
+
+	deadline = time(NULL) + REOPEN_TIMEOUT;
+	for (;;) {
+		if (reopen_device(device, which, serial, cd_sectors, cd_drive))
+		{
+			if (watching)
+				u3_watch_close(&watch);
+			return U3_SUCCESS;
+		}
+
+		while (watching) {
+			event = u3_watch_next(&watch, name, sizeof(name), 0);
+			if (event == U3_WATCH_TIMEOUT)
+				break;
+			if (event == U3_FAILURE) {
+				if (debug) {
+					fprintf(stderr, "%s\n",
+						u3_error_msg(&watch));
+				}
+				u3_watch_close(&watch);
+				watching = FALSE;
+				break;
+			}
+			if (event != U3_WATCH_ARRIVED ||
+			    strcmp(name, which) == 0 ||
+			    !reopen_device(device, name, serial, cd_sectors,
+				cd_drive))
+			{
+				continue;
+			}
+
+			printf("Device %s came back as %s\n", which, name);
+			snprintf(which, which_len, "%s", name);
+			u3_watch_close(&watch);
+			return U3_SUCCESS;
+		}
+
+		if (quit || time(NULL) >= deadline)
+			break;
+		usleep(REOPEN_POLL_US);
+	}
+
+	if (watching)
+		u3_watch_close(&watch);
+	if (quit) {
+		fprintf(stderr, "Aborted\n");
+	} else {
+		fprintf(stderr, "Device %s didn't come back with the new "
+			"partitioning within %u seconds\n", which,
+			REOPEN_TIMEOUT);
+	}
+	return U3_FAILURE;
+}
+
+/**
+ * Repartition the device to fit an image, if needed, and load it
+ *
+ * @param device	U3 device handle
+ * @param which		Name of the device
+ * @param iso_filename	Name of the image
+ * @param options	Load options
+ *
+ * @returns		EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int do_fit_load(u3_handle_t *device, char *which, char *iso_filename,
+	struct load_options *options)
+{
+	char serial[U3_MAX_SERIAL_LEN+1];
+	char name[MAX_FILENAME_STRING_LENGTH];
+	char *names[1];
+	struct image_source src;
+	struct part_info pinfo;
+	uint32_t cd_sectors;
+	uint32_t lu_blocks, lu_block_size;
+	int cd_drive;
+
+	snprintf(name, sizeof(name), "%s", which);
+	names[0] = name;
+
+	if (open_image(&src, iso_filename, options) != U3_SUCCESS)
+		return EXIT_FAILURE;
+
+	// smallest CD partition the chip can make for the image
+	cd_sectors = src.size / U3_SECTOR_SIZE;
+	if (src.size % U3_SECTOR_SIZE)
+		cd_sectors++;
+	if (u3_partition_sector_round(device, round_up, &cd_sectors)
+		!= U3_SUCCESS)
+	{
+		fprintf(stderr, "u3_partition_sector_round() failed: %s\n",
+			u3_error_msg(device));
+		image_source_close(&src);
+		return EXIT_FAILURE;
+	}
+
+	if (u3_partition_info(device, &pinfo) != U3_SUCCESS) {
+		fprintf(stderr, "u3_partition_info() failed: %s\n",
+			u3_error_msg(device));
+		image_source_close(&src);
+		return EXIT_FAILURE;
+	}
+
+	if (pinfo.cd_size != cd_sectors) {
+		// confirm() reads standard input
+		if (strcmp(iso_filename, "-") == 0) {
+			fprintf(stderr, "The CD partition must be resized, "
+				"which can't be confirmed while the image is "
+				"read from standard input\n");
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+
+		printf("The CD partition is resized from %u to %u sectors.\n",
+			pinfo.cd_size, cd_sectors);
+		printf("WARNING: This wipes the whole device, INCLUDING the "
+			"data partition.\n");
+		if (!confirm()) {
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+
+		if (get_serial(device, serial) != U3_SUCCESS) {
+			fprintf(stderr, "Failed reading device serial: %s\n",
+				u3_error_msg(device));
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+		cd_drive = u3_cd_capacity(device, &lu_blocks, &lu_block_size)
+			== U3_SUCCESS && lu_block_size == U3_BLOCK_SIZE;
+
+		if (u3_partition(device, cd_sectors) != U3_SUCCESS) {
+			fprintf(stderr, "u3_partition() failed: %s\n",
+				u3_error_msg(device));
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+		journal_partitioned(device);
+
+		if (u3_reset(device) != U3_SUCCESS) {
+			fprintf(stderr, "u3_reset() failed: %s\n",
+				u3_error_msg(device));
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+		if (wait_reconnect(device, name, sizeof(name), serial,
+			cd_sectors, cd_drive) != U3_SUCCESS)
+		{
+			image_source_close(&src);
+			return EXIT_FAILURE;
+		}
+	} else if (debug) {
+		fprintf(stderr, "CD partition already fits the image\n");
+	}
+
+	return do_load(device, names, 1, iso_filename, &src, options);
+}
+
 static int do_unlock(u3_handle_t *device, char *password) {
 	int result=0;
 	int tries_left=0;
@@ -601,26 +1931,355 @@ static int do_dump(u3_handle_t *device) {
 	return retval;
 }
 
+/**
+ * Name of a device seen by do_watch()
+ */
+struct watch_name {
+	char	name[MAX_FILENAME_STRING_LENGTH];
+	char	serial[U3_MAX_SERIAL_LEN+1];	// serial of the U3 device
+	int	handled;			// the action ran on the device
+};
+
+/**
+ * Thread running the action of do_watch() on a device
+ */
+struct watch_worker {
+	pthread_t	 thread;
+	int		 running;	// started and not joined yet
+	volatile int	 finished;	// the action returned
+
+	enum action_t	 action;	// info, load or unlock
+	char		 *iso_filename;	// image to load
+	struct load_options *options;	// load options
+	char		 *password;	// password to unlock with
+	u3_handle_t	 device;	// device, closed by the thread
+	char		 name[MAX_FILENAME_STRING_LENGTH];
+	char		 serial[U3_MAX_SERIAL_LEN+1];
+	int		 result;	// EXIT_SUCCESS or EXIT_FAILURE
+};
+
+// keeps the lines printed by do_info() and do_unlock() of a device together
+static pthread_mutex_t watch_output = PTHREAD_MUTEX_INITIALIZER;
+
+static void *watch_worker_main(void *arg) {
+	struct watch_worker *worker = (struct watch_worker *) arg;
+	struct image_source src;
+	char *names[1];
+
+	switch (worker->action) {
+		case load:
+			names[0] = worker->name;
+			worker->result = EXIT_FAILURE;
+			if (open_image(&src, worker->iso_filename,
+				worker->options) == U3_SUCCESS)
+			{
+				worker->result = do_load(&worker->device,
+					names, 1, worker->iso_filename, &src,
+					worker->options);
+			}
+			break;
+		case unlock:
+			pthread_mutex_lock(&watch_output);
+			printf("%s:\n", worker->name);
+			worker->result = do_unlock(&worker->device,
+				worker->password);
+			fflush(stdout);
+			pthread_mutex_unlock(&watch_output);
+			break;
+		default:
+			pthread_mutex_lock(&watch_output);
+			printf("%s:\n", worker->name);
+			worker->result = do_info(&worker->device);
+			fflush(stdout);
+			pthread_mutex_unlock(&watch_output);
+			break;
+	}
+	// a device that didn't come back after a reset is closed
+	if (worker->device.dev != NULL)
+		u3_close(&worker->device);
+
+	worker->finished = TRUE;
+	return NULL;
+}
+
+/**
+ * Join the workers that finished and count their results
+ *
+ * @param workers	Workers of do_watch()
+ * @param all		Wait for the workers still running too
+ * @param handled	Number of devices handled, updated
+ * @param failed	Number of devices the action failed on, updated
+ */
+static void join_watch_workers(struct watch_worker *workers, int all,
+	unsigned int *handled, unsigned int *failed)
+{
+	unsigned int i;
+
+	for (i = 0; i < WATCH_MAX_NAMES; i++) {
+		if (!workers[i].running || (!workers[i].finished && !all))
+			continue;
+
+		pthread_join(workers[i].thread, NULL);
+		workers[i].running = FALSE;
+
+		(*handled)++;
+		if (workers[i].result != EXIT_SUCCESS) {
+			(*failed)++;
+			fprintf(stderr, "%s: failed\n", workers[i].name);
+		} else {
+			printf("%s: done\n", workers[i].name);
+		}
+		fflush(stdout);
+	}
+}
+
+/**
+ * Run an action on every U3 device that arrives, till interrupted
+ *
+ * A device can arrive under several names, e.g. a sg device per LUN. The
+ * action runs once on the name of the CD drive, till all names of the
+ * device have left. Every device is handled by a thread of its own, this
+ * only waits for devices.
+ *
+ * @param action	Action to run, info, load or unlock
+ * @param iso_filename	Name of the image to load
+ * @param options	Load options
+ * @param password	Password to unlock with
+ *
+ * @returns		EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int do_watch(enum action_t action, char *iso_filename,
+	struct load_options *options, char *password)
+{
+	struct watch_name seen[WATCH_MAX_NAMES];
+	struct watch_worker workers[WATCH_MAX_NAMES];
+	struct watch_worker *worker;
+	unsigned int nseen = 0;
+	unsigned int handled = 0;
+	unsigned int failed = 0;
+	u3_handle_t watch;
+	u3_handle_t device;
+	char name[MAX_FILENAME_STRING_LENGTH];
+	char serial[U3_MAX_SERIAL_LEN+1];
+	uint32_t lu_blocks;
+	uint32_t lu_block_size;
+	int event = U3_WATCH_TIMEOUT;
+	int present;
+	int err;
+	unsigned int i;
+
+	if (u3_watch_open(&watch) != U3_SUCCESS) {
+		fprintf(stderr, "%s\n", u3_error_msg(&watch));
+		return EXIT_FAILURE;
+	}
+	memset(workers, 0, sizeof(workers));
+	// loads of several devices can't share the progress bar
+	options->concurrent = TRUE;
+	printf("Waiting for U3 devices, press Ctrl-C to stop\n");
+	fflush(stdout);
+
+	while (!quit) {
+		join_watch_workers(workers, FALSE, &handled, &failed);
+
+		event = u3_watch_next(&watch, name, sizeof(name),
+				WATCH_POLL_MS);
+		if (event == U3_FAILURE) {
+			fprintf(stderr, "%s\n", u3_error_msg(&watch));
+			break;
+		}
+
+		if (event == U3_WATCH_LEFT) {
+			for (i = 0; i < nseen; i++) {
+				if (strcmp(seen[i].name, name) == 0) {
+					seen[i] = seen[--nseen];
+					break;
+				}
+			}
+			continue;
+		}
+		if (event != U3_WATCH_ARRIVED)
+			continue;
+
+		// A device present at start can also be reported by an event,
+		// and devices are reported again after events were lost.
+		for (i = 0; i < nseen; i++) {
+			if (strcmp(seen[i].name, name) == 0)
+				break;
+		}
+		if (i == nseen && nseen == WATCH_MAX_NAMES)
+			continue;
+
+		if (u3_open(&device, name) != U3_SUCCESS) {
+			if (debug) {
+				fprintf(stderr, "Error opening device %s: %s\n",
+					name, u3_error_msg(&device));
+			}
+			continue;
+		}
+		// other devices don't know U3 commands
+		if (get_serial(&device, serial) != U3_SUCCESS) {
+			if (debug) {
+				fprintf(stderr, "%s is not a U3 device: %s\n",
+					name, u3_error_msg(&device));
+			}
+			u3_close(&device);
+			if (i < nseen)
+				seen[i] = seen[--nseen];
+			continue;
+		}
+
+		if (i < nseen) {
+			if (strcmp(seen[i].serial, serial) == 0) {
+				u3_close(&device);
+				continue;
+			}
+			// the device seen under this name left unnoticed
+			seen[i] = seen[--nseen];
+		}
+
+		// A device being handled may come back under another name,
+		// e.g. after a reset.
+		present = FALSE;
+		for (i = 0; i < nseen; i++) {
+			if (strcmp(seen[i].serial, serial) == 0 &&
+			    seen[i].handled)
+				present = TRUE;
+		}
+		worker = NULL;
+		for (i = 0; i < WATCH_MAX_NAMES; i++) {
+			if (workers[i].running &&
+			    strcmp(workers[i].serial, serial) == 0)
+				present = TRUE;
+			if (!workers[i].running && worker == NULL)
+				worker = &workers[i];
+		}
+		snprintf(seen[nseen].name, sizeof(seen[nseen].name), "%s",
+			name);
+		strcpy(seen[nseen].serial, serial);
+		seen[nseen].handled = present;
+		nseen++;
+		if (present) {
+			u3_close(&device);
+			continue;
+		}
+
+		// The data LUN usually arrives before the CD drive. Loads need
+		// the CD drive to read it back, so wait for it.
+		if (u3_cd_capacity(&device, &lu_blocks, &lu_block_size)
+			!= U3_SUCCESS || lu_block_size != U3_BLOCK_SIZE)
+		{
+			if (debug) {
+				fprintf(stderr, "%s is not the CD drive of "
+					"U3 device %s\n", name, serial);
+			}
+			u3_close(&device);
+			continue;
+		}
+		seen[nseen-1].handled = TRUE;
+
+		pthread_mutex_lock(&watch_output);
+		printf("%s: U3 device %s arrived\n", name, serial);
+		fflush(stdout);
+		pthread_mutex_unlock(&watch_output);
+
+		// devices pulled while their action hangs keep their worker
+		if (worker == NULL) {
+			fprintf(stderr, "%s: failed, %u devices are handled "
+				"already\n", name, WATCH_MAX_NAMES);
+			u3_close(&device);
+			handled++;
+			failed++;
+			continue;
+		}
+		worker->action = action;
+		worker->iso_filename = iso_filename;
+		worker->options = options;
+		worker->password = password;
+		worker->device = device;
+		snprintf(worker->name, sizeof(worker->name), "%s", name);
+		strcpy(worker->serial, serial);
+		worker->finished = FALSE;
+		err = pthread_create(&worker->thread, NULL, watch_worker_main,
+			worker);
+		if (err != 0) {
+			fprintf(stderr, "%s: failed starting thread: %s\n",
+				name, strerror(err));
+			u3_close(&worker->device);
+			handled++;
+			failed++;
+			continue;
+		}
+		worker->running = TRUE;
+	}
+
+	// an interrupt also stops the loads
+	join_watch_workers(workers, TRUE, &handled, &failed);
+	u3_watch_close(&watch);
+	printf("Handled %u devices, %u failed\n", handled, failed);
+	if (event == U3_FAILURE || failed > 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
 /************************************ Main ************************************/
 
 static void usage(const char *name) {
 	printf("u3-tool %s - U3 USB stick manager\n", version);
 	printf("\n");
 	printf("Usage: %s [options] <device name>\n", name);
+	printf("       %s --manifest <cd image>\n", name);
+	printf("       %s [load options] -l <cd image> <device name>...\n",
+		name);
+	printf("       %s --watch [load options] -i|-l <cd image>|-u\n",
+		name);
 	printf("\n");
 	printf("Options:\n");
 	printf("\t-c                Change password\n");
 	printf("\t-d                Disable device security\n");
 	printf("\t-D                Dump all raw info(for debug)\n");
 	printf("\t-e                Enable device security\n");
+	printf("\t--fit-load <img>  Resize CD partition to fit CD image if "
+		"needed, then load it\n");
 	printf("\t-h                Print this help message\n");
 	printf("\t-i                Display device info\n");
-	printf("\t-l <cd image>     Load CD image into device\n");
+	printf("\t-l <cd image>     Load CD image into device, '-' reads "
+		"standard input, a\n"
+	       "\t                  directory is loaded as ISO9660 image\n");
+	printf("\t--manifest <img>  Write block manifest of CD image, used "
+		"by --diff\n");
 	printf("\t-p <cd size>      Repartition device\n");
 	printf("\t-R                Reset device security, destroying private data\n");
 	printf("\t-u                Unlock device\n");
-	printf("\t-v                Use verbose output\n");
+	printf("\t-v                Use verbose output, prints command "
+		"statistics at exit\n");
+	printf("\t--stats[=json]    Print command statistics at exit\n");
 	printf("\t-V                Print version information\n");
+	printf("\t--watch           Run -i, -l or -u on every U3 device "
+		"plugged in, till\n"
+	       "\t                  interrupted\n");
+	printf("\n");
+	printf("Load options:\n");
+	printf("\t--depth <n>       Number of %u KiB image chunks to read "
+		"ahead (default %u)\n",
+		LOAD_CHUNK_BLOCKS * U3_BLOCK_SIZE / 1024, LOAD_DEFAULT_DEPTH);
+	printf("\t--diff            Only write blocks that differ from the "
+		"current CD image\n");
+	printf("\t--direct          Read the image with direct I/O, bypassing "
+		"the page cache\n");
+	printf("\t--queue <n>       Number of CD writes kept in flight, if the "
+		"subsystem\n"
+	       "\t                  can queue commands (default %u)\n",
+		LOAD_DEFAULT_QUEUE);
+	printf("\t--resume          Continue an interrupted load of the same "
+		"image\n");
+	printf("\t--size <size>     Size of image read from standard input "
+		"('-l -')\n");
+	printf("\t--sparse          Skip zero blocks if the device was just "
+		"repartitioned\n");
+	printf("\t--tune            Find the fastest CD write size of the "
+		"chip before loading\n");
+	printf("\t--verify          Read back the CD partition after loading "
+		"and compare it\n");
 	printf("\n");
 	printf("For the device name use:\n  %s\n", u3_subsystem_help);
 }
@@ -640,11 +2299,15 @@ static void set_quit(int sig) {
 }
 
 int main(int argc, char *argv[]) {
-	u3_handle_t device;
+	u3_handle_t devices[LOAD_MAX_CONSUMERS];
+	u3_handle_t *device = devices;
 
 	int c;
 	enum action_t action = unknown;
-	char *device_name;
+	char **device_names;
+	unsigned int ndevices;
+	unsigned int i;
+	char *end;
 
 	char	filename_string[MAX_FILENAME_STRING_LENGTH+1];
 	char	size_string[MAX_SIZE_STRING_LENGTH+1];
@@ -653,14 +2316,28 @@ int main(int argc, char *argv[]) {
 	char	password[MAX_PASSWORD_LENGTH+1];
 
 	int	ask_new_password = TRUE;
+
+	int	watch = FALSE;
 	char	new_password[MAX_PASSWORD_LENGTH+1];
 
+	struct load_options load_options;
+	struct image_source src;
+	struct stat st;
+
+	enum u3_stats_format stats_format = U3_STATS_NONE;
+
 	int retval = EXIT_SUCCESS;
 
+	memset(&load_options, 0, sizeof(load_options));
+	load_options.depth = LOAD_DEFAULT_DEPTH;
+	load_options.queue = LOAD_DEFAULT_QUEUE;
+
 	//
 	// parse options
 	//
-	while ((c = getopt(argc, argv, "cdDehil:p:RuvVz")) != -1) {
+	while ((c = getopt_long(argc, argv, "cdDehil:p:RuvVz", long_options,
+			NULL)) != -1)
+	{
 		switch (c) {
 			case 'c':
 				action = change_password;
@@ -700,6 +2377,80 @@ int main(int argc, char *argv[]) {
 			case 'D':
 				action = dump;
 				break;
+			case OPT_DIFF:
+				load_options.diff = TRUE;
+				break;
+			case OPT_DIRECT:
+				load_options.direct = TRUE;
+				break;
+			case OPT_FIT_LOAD:
+				action = fit_load;
+				strncpy(filename_string, optarg, MAX_FILENAME_STRING_LENGTH);
+				filename_string[MAX_FILENAME_STRING_LENGTH] = '\0';
+				break;
+			case OPT_MANIFEST:
+				action = make_manifest;
+				strncpy(filename_string, optarg, MAX_FILENAME_STRING_LENGTH);
+				filename_string[MAX_FILENAME_STRING_LENGTH] = '\0';
+				break;
+			case OPT_QUEUE:
+				load_options.queue = strtoul(optarg, NULL, 0);
+				if (load_options.queue == 0 ||
+				    load_options.queue > U3_MAX_QUEUE_DEPTH)
+				{
+					fprintf(stderr, "Queue depth should be "
+						"between 1 and %u\n",
+						U3_MAX_QUEUE_DEPTH);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_RESUME:
+				load_options.resume = TRUE;
+				break;
+			case OPT_SIZE:
+				// in bytes, size suffixes aren't understood
+				load_options.size = strtoull(optarg, &end, 0);
+				if (*end != '\0' || load_options.size == 0 ||
+				    strchr(optarg, '-') != NULL)
+				{
+					fprintf(stderr, "Size should be a number "
+						"of bytes larger than 0\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_SPARSE:
+				load_options.sparse = TRUE;
+				break;
+			case OPT_VERIFY:
+				load_options.verify = TRUE;
+				break;
+			case OPT_TUNE:
+				load_options.tune = TRUE;
+				break;
+			case OPT_WATCH:
+				watch = TRUE;
+				break;
+			case OPT_STATS:
+				if (optarg == NULL || strcmp(optarg, "text") == 0) {
+					stats_format = U3_STATS_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					stats_format = U3_STATS_JSON;
+				} else {
+					fprintf(stderr, "Unknown statistics "
+						"format '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_DEPTH:
+				load_options.depth = strtoul(optarg, NULL, 0);
+				if (load_options.depth == 0 ||
+				    load_options.depth > LOAD_MAX_DEPTH)
+				{
+					fprintf(stderr, "Depth should be between "
+						"1 and %u\n", LOAD_MAX_DEPTH);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'h':
 			default:
 				usage(argv[0]);
@@ -711,22 +2462,81 @@ int main(int argc, char *argv[]) {
 	//
 	// parse arguments
 	//
-	if (argc-optind < 1) {
+	if (action == make_manifest) {
+		if (argc-optind > 0) {
+			fprintf(stderr, "--manifest doesn't take a device\n");
+			exit(EXIT_FAILURE);
+		}
+		assert(signal(SIGINT, set_quit) != SIG_ERR);
+		assert(signal(SIGTERM, set_quit) != SIG_ERR);
+		return do_manifest(filename_string);
+	}
+	if (watch) {
+		if (action != info && action != load && action != unlock) {
+			fprintf(stderr, "--watch works with -i, -l and -u\n");
+			exit(EXIT_FAILURE);
+		}
+		if (argc-optind > 0) {
+			fprintf(stderr, "--watch doesn't take a device\n");
+			exit(EXIT_FAILURE);
+		}
+		if (action == load && strcmp(filename_string, "-") == 0) {
+			fprintf(stderr, "--watch can't load standard input\n");
+			exit(EXIT_FAILURE);
+		}
+	} else if (argc-optind < 1) {
 		fprintf(stderr, "Not enough arguments\n");
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	device_name = argv[optind];
+	device_names = argv + optind;
+	ndevices = argc - optind;
+	if (ndevices > 1 && action != load) {
+		fprintf(stderr, "Only a CD image can be loaded into more than "
+			"one device\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ndevices > LOAD_MAX_CONSUMERS) {
+		fprintf(stderr, "Can't load more than %u devices at once\n",
+			LOAD_MAX_CONSUMERS);
+		exit(EXIT_FAILURE);
+	}
+
+	if (load_options.diff && load_options.sparse) {
+		fprintf(stderr, "--diff and --sparse can't be combined\n");
+		exit(EXIT_FAILURE);
+	}
+	if (load_options.direct && (action == load || action == fit_load) &&
+	    strcmp(filename_string, "-") == 0)
+	{
+		fprintf(stderr, "--direct can't be used with standard input\n");
+		exit(EXIT_FAILURE);
+	}
+	if (load_options.direct && (action == load || action == fit_load) &&
+	    stat(filename_string, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "--direct can't be used with a directory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ndevices > 1 && (load_options.resume || load_options.tune)) {
+		fprintf(stderr, "--resume and --tune take a single device\n");
+		exit(EXIT_FAILURE);
+	}
 
 	assert(signal(SIGINT, set_quit) != SIG_ERR);
 	assert(signal(SIGTERM, set_quit) != SIG_ERR);
 
 	//
-	// open the device
+	// open the devices
 	// 
-	if (u3_open(&device, device_name)) {
-		fprintf(stderr, "Error opening device: %s\n", u3_error_msg(&device));
-		exit(EXIT_FAILURE);
+	for (i = 0; i < ndevices; i++) {
+		if (u3_open(&devices[i], device_names[i])) {
+			fprintf(stderr, "Error opening device %s: %s\n",
+				device_names[i], u3_error_msg(&devices[i]));
+			while (i-- > 0)
+				u3_close(&devices[i]);
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	//
@@ -775,49 +2585,65 @@ int main(int argc, char *argv[]) {
 	//
 	// preform action
 	//
-	switch (action) {
-		case load:
-			retval = do_load(&device, filename_string);
-			break;
-		case partition:
-			printf("\n");
-			printf("WARNING: Loading a new cd image causes the ");
-			printf("whole device to be wiped. This INCLUDES\n ");
-			printf("the data partition.\n");
-			printf("I repeat: ANY EXISTING DATA WILL BE LOST!\n");
-			if (confirm())
-				retval = do_partition(&device, size_string);
-			break;
-		case dump:
-			retval = do_dump(&device);
-			break;
-		case info:
-			retval = do_info(&device);
-			break;
-		case unlock:
-			retval = do_unlock(&device, password);
-			break;
-		case change_password:
-			retval = do_change_password(&device, password, new_password);
-			break;
-		case enable_security:
-			printf("WARNING: This will delete all data on the data ");
-			printf("partition\n");
-			if (confirm())
-				retval = do_enable_security(&device, new_password);
-			break;
-		case disable_security:
-			retval = do_disable_security(&device, password);
-			break;
-		case reset_security:
-			printf("WARNING: This will delete all data on the data ");
-			printf("partition\n");
-			if (confirm())
-				retval = do_reset_security(&device);
-			break;
-		default:
-			fprintf(stderr, "No action specified, use '-h' option for help.\n");
-			break;
+	if (watch) {
+		retval = do_watch(action, filename_string, &load_options,
+				password);
+	} else {
+		switch (action) {
+			case load:
+				if (open_image(&src, filename_string, &load_options)
+					!= U3_SUCCESS)
+				{
+					retval = EXIT_FAILURE;
+					break;
+				}
+				retval = do_load(devices, device_names, ndevices,
+						filename_string, &src, &load_options);
+				break;
+			case fit_load:
+				retval = do_fit_load(device, device_names[0],
+						filename_string, &load_options);
+				break;
+			case partition:
+				printf("\n");
+				printf("WARNING: Loading a new cd image causes the ");
+				printf("whole device to be wiped. This INCLUDES\n ");
+				printf("the data partition.\n");
+				printf("I repeat: ANY EXISTING DATA WILL BE LOST!\n");
+				if (confirm())
+					retval = do_partition(device, size_string);
+				break;
+			case dump:
+				retval = do_dump(device);
+				break;
+			case info:
+				retval = do_info(device);
+				break;
+			case unlock:
+				retval = do_unlock(device, password);
+				break;
+			case change_password:
+				retval = do_change_password(device, password, new_password);
+				break;
+			case enable_security:
+				printf("WARNING: This will delete all data on the data ");
+				printf("partition\n");
+				if (confirm())
+					retval = do_enable_security(device, new_password);
+				break;
+			case disable_security:
+				retval = do_disable_security(device, password);
+				break;
+			case reset_security:
+				printf("WARNING: This will delete all data on the data ");
+				printf("partition\n");
+				if (confirm())
+					retval = do_reset_security(device);
+				break;
+			default:
+				fprintf(stderr, "No action specified, use '-h' option for help.\n");
+				break;
+		}
 	}
 
 	//
@@ -825,7 +2651,14 @@ int main(int argc, char *argv[]) {
 	//
 	memset(password, 0, sizeof(password));
 	memset(new_password, 0, sizeof(new_password));
-	u3_close(&device);
+	if (stats_format == U3_STATS_NONE && debug)
+		stats_format = U3_STATS_TEXT;
+	u3_stats_print(stderr, stats_format);
+	for (i = 0; i < ndevices; i++) {
+		// a device that didn't come back after a reset is closed
+		if (devices[i].dev != NULL)
+			u3_close(&devices[i]);
+	}
 
 	return retval;
 }
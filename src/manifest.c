@@ -0,0 +1,452 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "manifest.h"
+#include "state_dir.h"
+#include "thread_pool.h"
+#include "display_progress.h"
+#include "md5.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define MANIFEST_MAGIC		"u3-tool-manifest 2"
+#define MANIFEST_PATH_LEN	1024
+#define LINE_LEN		64
+#define READ_BLOCKS		U3_MAX_CD_READ_BLOCKS	// blocks per read
+#define BUFFERS_PER_THREAD	2	// read buffers per hash worker
+
+/**
+ * A hash job of a range of blocks
+ */
+struct hash_job {
+	struct thread_pool_job job;
+	struct manifest *m;
+	uint32_t	block_num;	// number of first block
+	uint32_t	block_cnt;	// number of blocks
+	const uint8_t	*data;		// block data
+};
+
+/**
+ * Job function, computes digests of image blocks
+ */
+static void hash_job(void *arg) {
+	struct hash_job *job = (struct hash_job *) arg;
+	uint32_t i;
+
+	for (i = 0; i < job->block_cnt; i++) {
+		md5((unsigned char *) job->data + i * U3_BLOCK_SIZE,
+			U3_BLOCK_SIZE, job->m->level[0] +
+			(job->block_num + i) * MANIFEST_DIGEST_LEN);
+	}
+}
+
+/**
+ * Get nanoseconds of the modification time of a file, 0 where the system
+ * doesn't record them
+ */
+static long mtime_nsec(const struct stat *st) {
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+	return st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+	return st->st_mtimespec.tv_nsec;
+#else
+	(void) st;
+	return 0;
+#endif
+}
+
+/**
+ * Set up the levels of a manifest and allocate its digests
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+static int alloc_levels(struct manifest *m, uint32_t block_cnt) {
+	size_t total = 0;
+	unsigned int i;
+
+	if (block_cnt == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	m->block_cnt = block_cnt;
+	m->levels = 0;
+	do {
+		m->nodes[m->levels] = block_cnt;
+		total += block_cnt;
+		m->levels++;
+		block_cnt = (block_cnt + MANIFEST_FANOUT - 1) / MANIFEST_FANOUT;
+	} while (m->nodes[m->levels - 1] > 1);
+
+	m->digests = (uint8_t *) malloc(total * MANIFEST_DIGEST_LEN);
+	if (m->digests == NULL)
+		return -1;
+
+	total = 0;
+	for (i = 0; i < m->levels; i++) {
+		m->level[i] = m->digests + total * MANIFEST_DIGEST_LEN;
+		total += m->nodes[i];
+	}
+
+	return 0;
+}
+
+/**
+ * Compute the inner levels of the tree from the block digests
+ */
+static void build_tree(struct manifest *m) {
+	uint32_t i, cnt;
+	unsigned int l;
+
+	for (l = 1; l < m->levels; l++) {
+		for (i = 0; i < m->nodes[l]; i++) {
+			cnt = m->nodes[l - 1] - i * MANIFEST_FANOUT;
+			if (cnt > MANIFEST_FANOUT)
+				cnt = MANIFEST_FANOUT;
+			md5(m->level[l - 1] + i * MANIFEST_FANOUT *
+				MANIFEST_DIGEST_LEN, cnt * MANIFEST_DIGEST_LEN,
+				m->level[l] + i * MANIFEST_DIGEST_LEN);
+		}
+	}
+}
+
+int manifest_build(struct manifest *m, struct image_source *src,
+		const struct stat *st, volatile int *stop)
+{
+	struct thread_pool pool;
+	struct hash_job *jobs;
+	struct hash_job *job;
+	uint8_t *buffers;
+	unsigned int nbuffers;
+	unsigned long submitted = 0;
+	unsigned long collected = 0;
+	uint32_t block_num = 0;
+	int res = 1;
+	int retval = U3_SUCCESS;
+
+	memset(m, 0, sizeof(struct manifest));
+	m->image_size = src->size;
+	m->image_mtime = st->st_mtime;
+	m->image_mtime_nsec = mtime_nsec(st);
+	m->image_ctime = st->st_ctime;
+	m->image_ino = st->st_ino;
+
+	if (alloc_levels(m, src->size / U3_BLOCK_SIZE +
+			(src->size % U3_BLOCK_SIZE != 0)) == -1)
+	{
+		snprintf(m->err_msg, U3_MAX_ERROR_LEN, "Failed allocating "
+			"memory for manifest: %s", strerror(errno));
+		return U3_FAILURE;
+	}
+
+	if (thread_pool_start(&pool, thread_pool_default_threads())
+		!= U3_SUCCESS)
+	{
+		snprintf(m->err_msg, U3_MAX_ERROR_LEN, "%s", pool.err_msg);
+		manifest_free(m);
+		return U3_FAILURE;
+	}
+
+	// enough buffers to keep every worker busy while the next one is read
+	nbuffers = pool.threads * BUFFERS_PER_THREAD;
+	jobs = (struct hash_job *) calloc(nbuffers, sizeof(struct hash_job));
+	buffers = (uint8_t *) malloc((size_t) nbuffers * READ_BLOCKS *
+			U3_BLOCK_SIZE);
+	if (jobs == NULL || buffers == NULL) {
+		snprintf(m->err_msg, U3_MAX_ERROR_LEN, "Failed allocating "
+			"memory for read buffers");
+		thread_pool_stop(&pool);
+		free(jobs);
+		free(buffers);
+		manifest_free(m);
+		return U3_FAILURE;
+	}
+
+	display_progress_start("Hashing", "blocks", U3_BLOCK_SIZE);
+	for (;;) {
+		// read next range if a buffer is free
+		if (res > 0 && !*stop && submitted - collected < nbuffers) {
+			job = &jobs[submitted % nbuffers];
+			job->m = m;
+			job->block_num = block_num;
+
+			res = image_source_read(src, buffers +
+				(submitted % nbuffers) * READ_BLOCKS *
+				U3_BLOCK_SIZE, READ_BLOCKS,
+				(uint8_t **) &job->data);
+			if (res < 0) {
+				snprintf(m->err_msg, U3_MAX_ERROR_LEN, "%s",
+					image_source_error(src));
+				retval = U3_FAILURE;
+				continue;
+			}
+			if (res == 0)
+				continue;
+
+			job->block_cnt = res;
+			thread_pool_submit(&pool, &job->job, hash_job, job);
+			submitted++;
+			block_num += res;
+			continue;
+		}
+
+		if (collected == submitted)
+			break;
+
+		job = &jobs[collected % nbuffers];
+		thread_pool_wait(&pool, &job->job);
+		collected++;
+
+		display_progress(job->block_num + job->block_cnt,
+			m->block_cnt);
+	}
+	display_progress_end();
+
+	thread_pool_stop(&pool);
+	free(jobs);
+	free(buffers);
+
+	if (retval == U3_SUCCESS && *stop) {
+		snprintf(m->err_msg, U3_MAX_ERROR_LEN, "Aborted");
+		retval = U3_FAILURE;
+	}
+	if (retval == U3_SUCCESS && block_num != m->block_cnt) {
+		snprintf(m->err_msg, U3_MAX_ERROR_LEN, "Unexpected end of "
+			"iso file");
+		retval = U3_FAILURE;
+	}
+	if (retval != U3_SUCCESS) {
+		manifest_free(m);
+		return U3_FAILURE;
+	}
+
+	build_tree(m);
+	return U3_SUCCESS;
+}
+
+int manifest_read(struct manifest *m, const char *path) {
+	char line[LINE_LEN];
+	uint8_t root[MANIFEST_DIGEST_LEN];
+	uint64_t image_size;
+	int64_t image_mtime;
+	long image_mtime_nsec;
+	int64_t image_ctime;
+	uint64_t image_ino;
+	uint32_t block_cnt;
+	unsigned int fanout;
+	size_t total;
+	unsigned int i;
+	FILE *fp;
+	int res = 0;
+
+	memset(m, 0, sizeof(struct manifest));
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return -1;
+
+	// header lines, the digests follow in binary
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    strcmp(line, MANIFEST_MAGIC "\n") == 0)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "image_size %" SCNu64, &image_size) == 1)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "image_mtime %" SCNd64 ".%ld", &image_mtime,
+		   &image_mtime_nsec) == 2)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "image_ctime %" SCNd64, &image_ctime) == 1)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "image_ino %" SCNu64, &image_ino) == 1)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "blocks %" SCNu32, &block_cnt) == 1)
+		res++;
+	if (fgets(line, sizeof(line), fp) != NULL &&
+	    sscanf(line, "fanout %u", &fanout) == 1)
+		res++;
+
+	if (res != 7 || fanout != MANIFEST_FANOUT ||
+	    block_cnt != image_size / U3_BLOCK_SIZE +
+			(image_size % U3_BLOCK_SIZE != 0))
+	{
+		fclose(fp);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (alloc_levels(m, block_cnt) == -1) {
+		fclose(fp);
+		return -1;
+	}
+	m->image_size = image_size;
+	m->image_mtime = image_mtime;
+	m->image_mtime_nsec = image_mtime_nsec;
+	m->image_ctime = image_ctime;
+	m->image_ino = image_ino;
+
+	total = 0;
+	for (i = 0; i < m->levels; i++)
+		total += m->nodes[i];
+	if (fread(m->digests, MANIFEST_DIGEST_LEN, total, fp) != total) {
+		fclose(fp);
+		manifest_free(m);
+		errno = EINVAL;
+		return -1;
+	}
+	fclose(fp);
+
+	// the root covers every block digest, a damaged file doesn't match
+	memcpy(root, m->level[m->levels - 1], MANIFEST_DIGEST_LEN);
+	build_tree(m);
+	if (memcmp(root, m->level[m->levels - 1], MANIFEST_DIGEST_LEN) != 0) {
+		manifest_free(m);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int manifest_current(const struct manifest *m, const struct stat *st) {
+	return m->image_mtime == (int64_t) st->st_mtime &&
+		m->image_mtime_nsec == mtime_nsec(st) &&
+		m->image_ctime == (int64_t) st->st_ctime &&
+		m->image_ino == (uint64_t) st->st_ino;
+}
+
+int manifest_write(const struct manifest *m, const char *path) {
+	char tmp_path[MANIFEST_PATH_LEN + 4];
+	size_t total = 0;
+	unsigned int i;
+	FILE *fp;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+
+	if ((fp = fopen(tmp_path, "wb")) == NULL)
+		return -1;
+
+	fprintf(fp, "%s\nimage_size %" PRIu64 "\nimage_mtime %" PRId64
+		".%09ld\nimage_ctime %" PRId64 "\nimage_ino %" PRIu64
+		"\nblocks %" PRIu32 "\nfanout %u\n", MANIFEST_MAGIC,
+		m->image_size, m->image_mtime, m->image_mtime_nsec,
+		m->image_ctime, m->image_ino, m->block_cnt, MANIFEST_FANOUT);
+	for (i = 0; i < m->levels; i++)
+		total += m->nodes[i];
+	fwrite(m->digests, MANIFEST_DIGEST_LEN, total, fp);
+
+	if (ferror(fp) || fclose(fp) != 0) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	// replace old manifest in one step
+	if (rename(tmp_path, path) == -1) {
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int manifest_device_path(const char *serial, char *path, size_t path_len) {
+	char name[U3_MAX_SERIAL_LEN + 16];
+
+	snprintf(name, sizeof(name), "%s%s", serial, MANIFEST_SUFFIX);
+	return state_dir_path(name, path, path_len);
+}
+
+int manifest_device_remove(const char *serial) {
+	char path[MANIFEST_PATH_LEN];
+
+	if (manifest_device_path(serial, path, sizeof(path)) == -1)
+		return -1;
+
+	if (remove(path) == -1 && errno != ENOENT)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Mark the changed blocks below a node of the tree
+ *
+ * @returns		Number of changed blocks below the node
+ */
+static uint32_t diff_node(const struct manifest *old,
+	const struct manifest *image, unsigned int l, uint32_t node,
+	uint8_t *changed)
+{
+	uint32_t first, cnt, i;
+	uint32_t n = 0;
+
+	// same digest, same blocks below
+	if (l < old->levels && node < old->nodes[l] &&
+	    memcmp(old->level[l] + node * MANIFEST_DIGEST_LEN,
+		   image->level[l] + node * MANIFEST_DIGEST_LEN,
+		   MANIFEST_DIGEST_LEN) == 0)
+	{
+		return 0;
+	}
+
+	if (l == 0) {
+		changed[node / 8] |= 1 << (node % 8);
+		return 1;
+	}
+
+	first = node * MANIFEST_FANOUT;
+	cnt = image->nodes[l - 1] - first;
+	if (cnt > MANIFEST_FANOUT)
+		cnt = MANIFEST_FANOUT;
+	for (i = 0; i < cnt; i++)
+		n += diff_node(old, image, l - 1, first + i, changed);
+
+	return n;
+}
+
+uint32_t manifest_diff(const struct manifest *old,
+		const struct manifest *image, uint8_t *changed)
+{
+	memset(changed, 0, (image->block_cnt + 7) / 8);
+	return diff_node(old, image, image->levels - 1, 0, changed);
+}
+
+void manifest_root_hex(const struct manifest *m, char *buf) {
+	unsigned int i;
+
+	for (i = 0; i < MANIFEST_DIGEST_LEN; i++) {
+		sprintf(buf + 2 * i, "%.2x",
+			m->level[m->levels - 1][i]);
+	}
+}
+
+void manifest_free(struct manifest *m) {
+	free(m->digests);
+	m->digests = NULL;
+	m->levels = 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+/**
+ * @file	manifest.h
+ *
+ *		Block manifests of CD images. A manifest holds the MD5 digest
+ *		of every block of an image, combined into a Merkle tree: every
+ *		node of a level is the digest of up to MANIFEST_FANOUT digests
+ *		of the level below, up to a single root. Two versions of an
+ *		image are compared by descending only into the subtrees whose
+ *		digests differ, so the work grows with the number of changed
+ *		blocks, not with the size of the image.
+ *
+ *		The manifest of an image is kept in a sidecar file next to it,
+ *		named after the image with MANIFEST_SUFFIX appended. After a
+ *		complete load, the manifest is also stored per device serial in
+ *		the state directory, describing what the CD partition holds.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "u3.h"
+#include "u3_commands.h"
+#include "image_source.h"
+
+#define MANIFEST_DIGEST_LEN	16	// MD5
+#define MANIFEST_FANOUT		16	// digests per tree node
+#define MANIFEST_MAX_LEVELS	9	// enough for 2^32 blocks
+#define MANIFEST_SUFFIX		".u3m"	// suffix of sidecar files
+
+/**
+ * Manifest of an image
+ *
+ * Level 0 holds the block digests, the last level holds the root.
+ */
+struct manifest {
+	uint64_t image_size;	// size of image in bytes, uncompressed
+	int64_t	 image_mtime;	// modification time of image file
+	long	 image_mtime_nsec; // nanoseconds of 'image_mtime', or 0
+	int64_t	 image_ctime;	// status change time of image file
+	uint64_t image_ino;	// inode number of image file
+	uint32_t block_cnt;	// number of blocks in image
+	unsigned int levels;	// number of levels in tree
+	uint32_t nodes[MANIFEST_MAX_LEVELS];	// digests per level
+	uint8_t	 *level[MANIFEST_MAX_LEVELS];	// digests of each level,
+						// point into 'digests'
+	uint8_t	 *digests;	// digests of all levels
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Build manifest of an image
+ *
+ * The image is read from the current position, which must be block 0. The
+ * block digests are computed on a thread pool, progress is displayed.
+ *
+ * @param m		Manifest to initialize
+ * @param src		Image source
+ * @param st		Status of the image file, see manifest_current()
+ * @param stop		Building stops when this becomes non zero
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be found in m->err_msg
+ */
+int manifest_build(struct manifest *m, struct image_source *src,
+		const struct stat *st, volatile int *stop);
+
+/**
+ * Check if a manifest was built from an image file as it is now
+ *
+ * The modification time, to the nanosecond where the system records it,
+ * the status change time and the inode number of the file must be the same
+ * as when the manifest was built. The status change time can't be set by
+ * the user, so a file rewritten with its old modification time restored
+ * doesn't pass.
+ *
+ * @param m		Manifest
+ * @param st		Status of the image file
+ *
+ * @returns		non zero if the manifest is current
+ */
+int manifest_current(const struct manifest *m, const struct stat *st);
+
+/**
+ * Read manifest file
+ *
+ * @param m		Manifest to initialize
+ * @param path		Path of manifest file
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int manifest_read(struct manifest *m, const char *path);
+
+/**
+ * Write manifest file
+ *
+ * An existing file is replaced atomically.
+ *
+ * @param m		Manifest to write
+ * @param path		Path of manifest file
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int manifest_write(const struct manifest *m, const char *path);
+
+/**
+ * Get path of the manifest stored for a device
+ *
+ * @param serial	Serial number of device
+ * @param path		Buffer to return path in
+ * @param path_len	Size of 'path' in bytes
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int manifest_device_path(const char *serial, char *path, size_t path_len);
+
+/**
+ * Remove manifest stored for a device
+ *
+ * @param serial	Serial number of device
+ *
+ * @returns		0 if successful or there was no manifest, else -1 and
+ * 			errno is set
+ */
+int manifest_device_remove(const char *serial);
+
+/**
+ * Find blocks that differ between two versions of an image
+ *
+ * Bit 'n % 8' of byte 'n / 8' of 'changed' is set for every block 'n' of
+ * 'image' whose digest differs from the same block of 'old', or that lies
+ * beyond the end of 'old'.
+ *
+ * @param old		Manifest of the old version
+ * @param image		Manifest of the new version
+ * @param changed	Bitmap of (image->block_cnt + 7) / 8 bytes, set by
+ * 			this function
+ *
+ * @returns		Number of changed blocks
+ */
+uint32_t manifest_diff(const struct manifest *old,
+		const struct manifest *image, uint8_t *changed);
+
+/**
+ * Format root digest as hex string
+ *
+ * @param m		Manifest
+ * @param buf		Buffer of at least 2 * MANIFEST_DIGEST_LEN + 1 bytes
+ */
+void manifest_root_hex(const struct manifest *m, char *buf);
+
+/**
+ * Free manifest
+ *
+ * @param m		Manifest
+ */
+void manifest_free(struct manifest *m);
+
+#endif // __MANIFEST_H__
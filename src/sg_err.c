@@ -0,0 +1,156 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if defined(SUBSYS_SG) || defined(SUBSYS_BSG)
+#include "u3.h"
+#include "u3_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <scsi/scsi.h>
+
+#include "sg_err.h"
+
+#define RETRY_DELAY_US	   10000	// delay before the first retry, doubled
+					// for every further retry
+#define RETRY_MAX_DELAY_US 500000	// longest delay between retries
+
+void sg_err_decode_sense(const unsigned char *sense_buffer, int sb_len,
+		struct sg_err_sense *sense)
+{
+	const unsigned char *sb = sense_buffer;
+
+	memset(sense, 0, sizeof(struct sg_err_sense));
+	if (sb == NULL || sb_len < 4)
+		return;
+
+	switch (sb[0] & 0x7f) {
+		case 0x70:	// fixed format
+		case 0x71:
+			sense->key = sb[2] & 0x0f;
+			if (sb_len >= 14) {
+				sense->asc = sb[12];
+				sense->ascq = sb[13];
+			}
+			break;
+		case 0x72:	// descriptor format
+		case 0x73:
+			sense->key = sb[1] & 0x0f;
+			sense->asc = sb[2];
+			sense->ascq = sb[3];
+			break;
+		default:
+			return;
+	}
+	sense->valid = 1;
+}
+
+int sg_err_category(int masked_status, int host_status, int driver_status,
+		const struct sg_err_sense *sense)
+{
+	if (masked_status == GOOD && host_status == SG_ERR_DID_OK &&
+	    (driver_status & SG_ERR_DRIVER_MASK) == SG_ERR_DRIVER_OK)
+		return SG_ERR_CAT_CLEAN;
+
+	if (sense->valid) {
+		switch (sense->key) {
+			case NO_SENSE:
+			case RECOVERED_ERROR:
+				return SG_ERR_CAT_RECOVERED;
+			case UNIT_ATTENTION:
+				if (sense->asc == 0x28)
+					return SG_ERR_CAT_MEDIA_CHANGED;
+				if (sense->asc == 0x29)
+					return SG_ERR_CAT_RESET;
+				break;
+		}
+		return SG_ERR_CAT_SENSE;
+	}
+
+	switch (host_status) {
+		case SG_ERR_DID_NO_CONNECT:
+		case SG_ERR_DID_TIME_OUT:
+			return SG_ERR_CAT_TIMEOUT;
+		case SG_ERR_DID_BUS_BUSY:
+			return SG_ERR_CAT_BUS_BUSY;
+	}
+	if ((driver_status & SG_ERR_DRIVER_MASK) == SG_ERR_DRIVER_TIMEOUT)
+		return SG_ERR_CAT_TIMEOUT;
+
+	return SG_ERR_CAT_OTHER;
+}
+
+int sg_err_retryable(int masked_status, int host_status, int driver_status,
+		const struct sg_err_sense *sense)
+{
+	// Retryable are a busy device, a unit attention, a device becoming
+	// ready, an aborted command and a driver asking for a retry.
+	// Timeouts aren't, the command may have been executed and some U3
+	// commands mustn't be executed twice.
+	if (masked_status == BUSY || masked_status == QUEUE_FULL)
+		return 1;
+
+	switch (sg_err_category(masked_status, host_status, driver_status,
+			sense))
+	{
+		case SG_ERR_CAT_CLEAN:
+		case SG_ERR_CAT_RECOVERED:
+		case SG_ERR_CAT_TIMEOUT:
+			return 0;
+		case SG_ERR_CAT_MEDIA_CHANGED:
+		case SG_ERR_CAT_RESET:
+		case SG_ERR_CAT_BUS_BUSY:
+			return 1;
+		case SG_ERR_CAT_SENSE:
+			if (sense->key == ABORTED_COMMAND)
+				return 1;
+			// logical unit is in process of becoming ready
+			return sense->key == NOT_READY && sense->asc == 0x04 &&
+				sense->ascq == 0x01;
+	}
+
+	if (host_status == SG_ERR_DID_SOFT_ERROR)
+		return 1;
+	if ((driver_status & SG_ERR_DRIVER_MASK) == SG_ERR_DRIVER_BUSY)
+		return 1;
+	return (driver_status & SG_ERR_SUGGEST_MASK) == SG_ERR_SUGGEST_RETRY;
+}
+
+void sg_err_backoff(const unsigned char *cmd, unsigned int retry) {
+	unsigned long delay = RETRY_DELAY_US;
+
+	while (retry-- > 0 && delay < RETRY_MAX_DELAY_US)
+		delay *= 2;
+	if (delay > RETRY_MAX_DELAY_US)
+		delay = RETRY_MAX_DELAY_US;
+
+	if (debug) {
+		fprintf(stderr, "Retrying scsi command 0x%02x 0x%02x in "
+			"%lu ms\n", cmd[0], cmd[1], delay / 1000);
+	}
+	u3_stats_retry(cmd);
+	usleep(delay);
+}
+
+#endif // SUBSYS_SG || SUBSYS_BSG
@@ -105,7 +105,61 @@
 #define SG_ERR_CAT_RESET 2      /* interpreted from sense buffer */
 #define SG_ERR_CAT_TIMEOUT 3
 #define SG_ERR_CAT_RECOVERED 4  /* Successful command after recovered err */
+#define SG_ERR_CAT_BUS_BUSY 5   /* Bus stayed busy, worth a retry */
 #define SG_ERR_CAT_SENSE 98     /* Something else is in the sense buffer */
 #define SG_ERR_CAT_OTHER 99     /* Some other error/warning has occurred */
 
+/* The following is shared by the sg and bsg subsystems of u3-tool, see
+   sg_err.c. Status values are masked, like sg_io_hdr.masked_status. */
+
+#define SG_ERR_SENSE_LEN 32     /* size of sense buffers */
+#define SG_ERR_RETRY_MAX 8      /* retries of a command */
+
+/**
+ * Decoded sense data of a command
+ */
+struct sg_err_sense {
+	int		valid;		// sense data was returned
+	unsigned char	key;		// sense key
+	unsigned char	asc;		// additional sense code
+	unsigned char	ascq;		// additional sense code qualifier
+};
+
+/**
+ * Decode fixed or descriptor format sense data
+ *
+ * @param sense_buffer	Sense data returned by the device
+ * @param sb_len	Number of bytes in 'sense_buffer'
+ * @param sense		Decoded sense data, 'valid' is 0 if there is none
+ */
+extern void sg_err_decode_sense(const unsigned char *sense_buffer,
+		int sb_len, struct sg_err_sense *sense);
+
+/**
+ * Get category of the outcome of a command, like sg_err_category3() of
+ * sg3_utils
+ *
+ * @returns		One of the SG_ERR_CAT_* values
+ */
+extern int sg_err_category(int masked_status, int host_status,
+		int driver_status, const struct sg_err_sense *sense);
+
+/**
+ * Check if a failed command can be resent
+ *
+ * Only errors which tell the command wasn't executed are retryable.
+ *
+ * @returns		Non zero if the command can be resent
+ */
+extern int sg_err_retryable(int masked_status, int host_status,
+		int driver_status, const struct sg_err_sense *sense);
+
+/**
+ * Wait before resending a command, and count the retry
+ *
+ * @param cmd		CDB of the command to resend
+ * @param retry		Number of retries before this one
+ */
+extern void sg_err_backoff(const unsigned char *cmd, unsigned int retry);
+
 #endif
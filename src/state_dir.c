@@ -0,0 +1,77 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "state_dir.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define STATE_DIR_NAME	".u3-tool"
+
+int state_dir_path(const char *name, char *path, size_t path_len) {
+	const char *dir;
+	size_t len;
+	int res;
+
+	if ((dir = getenv("U3_TOOL_STATE_DIR")) != NULL && dir[0] != '\0') {
+		res = snprintf(path, path_len, "%s", dir);
+	} else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+		res = snprintf(path, path_len, "%s/%s", dir, STATE_DIR_NAME);
+	} else {
+		errno = ENOENT;
+		return -1;
+	}
+	if (res < 0 || (size_t) res >= path_len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+#ifdef WIN32
+	if (mkdir(path) == -1 && errno != EEXIST)
+#else
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+#endif
+		return -1;
+
+	len = strlen(path);
+	if (len + 1 + strlen(name) + 1 > path_len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	path[len++] = '/';
+	for (; *name != '\0'; name++) {
+		if (isalnum((unsigned char) *name) || *name == '-' ||
+		    *name == '.')
+		{
+			path[len++] = *name;
+		} else {
+			path[len++] = '_';
+		}
+	}
+	path[len] = '\0';
+
+	return 0;
+}
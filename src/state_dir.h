@@ -0,0 +1,45 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __STATE_DIR_H__
+#define __STATE_DIR_H__
+/**
+ * @file	state_dir.h
+ *
+ *		Location of the files u3-tool keeps between runs. This is
+ *		$U3_TOOL_STATE_DIR if set, else ~/.u3-tool.
+ */
+
+#include <sys/types.h>
+
+/**
+ * Get path of a state file
+ *
+ * This returns the path of state file 'name' in 'path' and creates the
+ * state directory if it doesn't exist yet. Characters in 'name' that are
+ * not alphanumeric, '-' or '.' are replaced by '_'.
+ *
+ * @param name		Name of the state file
+ * @param path		Buffer to return path in
+ * @param path_len	Size of 'path' in bytes
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int state_dir_path(const char *name, char *path, size_t path_len);
+
+#endif // __STATE_DIR_H__
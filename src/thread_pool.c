@@ -0,0 +1,145 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Worker thread, runs queued jobs
+ */
+static void *worker_main(void *arg) {
+	struct thread_pool *pool = (struct thread_pool *) arg;
+	struct thread_pool_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		if (pool->head == NULL) {
+			if (pool->stop)
+				break;
+			pthread_cond_wait(&pool->queued, &pool->lock);
+			continue;
+		}
+
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+unsigned int thread_pool_default_threads(void) {
+	long cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > THREAD_POOL_MAX_THREADS)
+		cpus = THREAD_POOL_MAX_THREADS;
+
+	return cpus;
+}
+
+int thread_pool_start(struct thread_pool *pool, unsigned int threads) {
+	int res;
+
+	memset(pool, 0, sizeof(struct thread_pool));
+
+	if (threads < 1 || threads > THREAD_POOL_MAX_THREADS) {
+		snprintf(pool->err_msg, U3_MAX_ERROR_LEN, "Invalid number of "
+			"worker threads %u", threads);
+		return U3_FAILURE;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->finished, NULL);
+
+	for (; pool->threads < threads; pool->threads++) {
+		res = pthread_create(&pool->workers[pool->threads], NULL,
+				worker_main, pool);
+		if (res != 0) {
+			snprintf(pool->err_msg, U3_MAX_ERROR_LEN, "Failed "
+				"starting worker thread: %s", strerror(res));
+			thread_pool_stop(pool);
+			return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+void thread_pool_submit(struct thread_pool *pool, struct thread_pool_job *job,
+		void (*fn)(void *arg), void *arg)
+{
+	job->fn = fn;
+	job->arg = arg;
+	job->done = 0;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pthread_cond_signal(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_job *job) {
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_stop(struct thread_pool *pool) {
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->workers[i], NULL);
+	pool->threads = 0;
+
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->queued);
+	pthread_mutex_destroy(&pool->lock);
+}
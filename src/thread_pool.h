@@ -0,0 +1,112 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+/**
+ * @file	thread_pool.h
+ *
+ *		A fixed set of worker threads that run jobs from a FIFO queue.
+ *		Jobs are owned by the caller, the pool doesn't allocate memory
+ *		after it is started.
+ */
+
+#include <pthread.h>
+
+#include "u3.h"
+
+#define THREAD_POOL_MAX_THREADS	16	// maximum number of workers
+
+/**
+ * A job of the pool
+ */
+struct thread_pool_job {
+	void (*fn)(void *arg);		// function to run
+	void *arg;			// argument of 'fn'
+	int done;			// 'fn' has returned
+	struct thread_pool_job *next;	// next job in queue
+};
+
+/**
+ * Thread pool state
+ */
+struct thread_pool {
+	unsigned int	 threads;	// number of workers started
+	pthread_t	 workers[THREAD_POOL_MAX_THREADS];
+
+	struct thread_pool_job *head;	// first queued job
+	struct thread_pool_job *tail;	// last queued job
+	int		 stop;		// workers should exit
+
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 queued;	// signalled when a job is queued
+	pthread_cond_t	 finished;	// signalled when a job is done
+
+	char err_msg[U3_MAX_ERROR_LEN];
+};
+
+/**
+ * Get default number of workers
+ *
+ * @returns		Number of online processors, at most
+ * 			THREAD_POOL_MAX_THREADS
+ */
+unsigned int thread_pool_default_threads(void);
+
+/**
+ * Start thread pool
+ *
+ * @param pool		Pool to initialize
+ * @param threads	Number of workers, 1 to THREAD_POOL_MAX_THREADS
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be found in pool->err_msg
+ */
+int thread_pool_start(struct thread_pool *pool, unsigned int threads);
+
+/**
+ * Queue job
+ *
+ * The job must not be queued already and must stay valid till it is done.
+ *
+ * @param pool		Thread pool
+ * @param job		Job to queue
+ * @param fn		Function to run
+ * @param arg		Argument of 'fn'
+ */
+void thread_pool_submit(struct thread_pool *pool, struct thread_pool_job *job,
+		void (*fn)(void *arg), void *arg);
+
+/**
+ * Wait for job to finish
+ *
+ * @param pool		Thread pool
+ * @param job		Queued job
+ */
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_job *job);
+
+/**
+ * Stop thread pool
+ *
+ * This waits for queued jobs to finish and stops the workers.
+ *
+ * @param pool		Thread pool
+ */
+void thread_pool_stop(struct thread_pool *pool);
+
+#endif // __THREAD_POOL_H__
@@ -34,6 +34,9 @@
                    (((uint32_t)(A) & 0x00ff0000) >> 8)  | \
                    (((uint32_t)(A) & 0x0000ff00) << 8)  | \
                    (((uint32_t)(A) & 0x000000ff) << 24))
+# define ntohl(A)  htonl(A)
+# define htons(A)  ((((uint16_t)(A) & 0xff00) >> 8) | \
+                   (((uint16_t)(A) & 0x00ff) << 8))
 #else
 # include <arpa/inet.h> // for htonl()
 #endif
@@ -218,8 +221,16 @@ int u3_partition(u3_handle_t *device, uint32_t cd_size) {
 }
 
 int u3_cd_write(u3_handle_t *device, uint32_t block_num, uint8_t *block) {
-	uint8_t status;
-	uint8_t cmd[U3_CMD_LEN] = {
+	return u3_cd_write_multi(device, block_num, 1, block);
+}
+
+/**
+ * Fill CDB of a CD write command
+ */
+static void cd_write_cmd(uint8_t cmd[U3_CMD_LEN], uint32_t block_num,
+		uint32_t block_cnt)
+{
+	const uint8_t cd_write[U3_CMD_LEN] = {
 		0xff, 0x42, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x01
 	};
@@ -228,15 +239,33 @@ int u3_cd_write(u3_handle_t *device, uint32_t block_num, uint8_t *block) {
 		uint16_t command;
 		uint8_t  unknown1;
 		uint32_t block_num;
-		uint32_t unknown2;
+		uint32_t block_cnt;
 	} __attribute__ ((packed)) *write_command;
 
+	memcpy(cmd, cd_write, U3_CMD_LEN);
+
 	// fill command data
-	write_command = (struct _write_cmd_t *) &cmd;
+	write_command = (struct _write_cmd_t *) cmd;
 	write_command->block_num = htonl(block_num);
+	write_command->block_cnt = htonl(block_cnt);
+}
 
-	if (u3_send_cmd(device, cmd, U3_DATA_TO_DEV, 2048,
-		block, &status) != U3_SUCCESS)
+int u3_cd_write_multi(u3_handle_t *device, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *blocks)
+{
+	uint8_t status;
+	uint8_t cmd[U3_CMD_LEN];
+
+	if (block_cnt == 0 || block_cnt > U3_MAX_CD_WRITE_BLOCKS) {
+		u3_set_error(device, "Invalid CD write block count %u",
+			block_cnt);
+		return U3_FAILURE;
+	}
+
+	cd_write_cmd(cmd, block_num, block_cnt);
+
+	if (u3_send_cmd(device, cmd, U3_DATA_TO_DEV,
+		block_cnt * U3_BLOCK_SIZE, blocks, &status) != U3_SUCCESS)
 	{
 		return U3_FAILURE;
 	}
@@ -249,6 +278,109 @@ int u3_cd_write(u3_handle_t *device, uint32_t block_num, uint8_t *block) {
 	return U3_SUCCESS;
 }
 
+int u3_cd_write_submit(u3_handle_t *device, struct u3_cmd *cmd,
+		uint32_t block_num, uint32_t block_cnt, uint8_t *blocks)
+{
+	if (block_cnt == 0 || block_cnt > U3_MAX_CD_WRITE_BLOCKS) {
+		u3_set_error(device, "Invalid CD write block count %u",
+			block_cnt);
+		return U3_FAILURE;
+	}
+
+	cd_write_cmd(cmd->cmd, block_num, block_cnt);
+	cmd->dxfer_direction = U3_DATA_TO_DEV;
+	cmd->dxfer_length = block_cnt * U3_BLOCK_SIZE;
+	cmd->dxfer_data = blocks;
+
+	return u3_submit_cmd(device, cmd);
+}
+
+int u3_cd_write_result(u3_handle_t *device, struct u3_cmd *cmd) {
+	if (cmd->result != U3_SUCCESS) {
+		u3_set_error(device, "%s", cmd->err_msg);
+		return U3_FAILURE;
+	}
+
+	if (cmd->status != 0) {
+		u3_set_error(device, "Device reported command failed: status %d",
+			cmd->status);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+
+int u3_cd_read(u3_handle_t *device, uint32_t block_num, uint32_t block_cnt,
+		uint8_t *blocks)
+{
+	uint8_t status;
+	uint8_t cmd[U3_CMD_LEN] = {
+		0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00
+	};
+	struct _read10_cmd_t {
+		uint8_t	 scsi_opcode;
+		uint8_t  flags;
+		uint32_t block_num;
+		uint8_t  group;
+		uint16_t block_cnt;
+	} __attribute__ ((packed)) *read_command;
+
+	if (block_cnt == 0 || block_cnt > U3_MAX_CD_READ_BLOCKS) {
+		u3_set_error(device, "Invalid CD read block count %u",
+			block_cnt);
+		return U3_FAILURE;
+	}
+
+	// fill command data
+	read_command = (struct _read10_cmd_t *) &cmd;
+	read_command->block_num = htonl(block_num);
+	read_command->block_cnt = htons(block_cnt);
+
+	if (u3_send_cmd(device, cmd, U3_DATA_FROM_DEV,
+		block_cnt * U3_BLOCK_SIZE, blocks, &status) != U3_SUCCESS)
+	{
+		return U3_FAILURE;
+	}
+
+	if (status != 0) {
+		u3_set_error(device, "Device reported command failed: status %d", status);
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+int u3_cd_capacity(u3_handle_t *device, uint32_t *block_cnt,
+		uint32_t *block_size)
+{
+	uint8_t status;
+	uint8_t cmd[U3_CMD_LEN] = {
+		0x25, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00
+	};
+	uint32_t data[2];
+
+	memset(data, 0, sizeof(data));
+
+	if (u3_send_cmd(device, cmd, U3_DATA_FROM_DEV, sizeof(data),
+		(uint8_t *) data, &status) != U3_SUCCESS)
+	{
+		return U3_FAILURE;
+	}
+
+	if (status != 0) {
+		u3_set_error(device, "Device reported command failed: status %d", status);
+		return U3_FAILURE;
+	}
+
+	// READ CAPACITY returns the address of the last block
+	*block_cnt = ntohl(data[0]) + 1;
+	*block_size = ntohl(data[1]);
+
+	return U3_SUCCESS;
+}
 
 int u3_partition_sector_round(u3_handle_t *device,
 		enum round_dir direction, uint32_t *size)
@@ -413,10 +545,18 @@ int u3_reset(u3_handle_t *device) {
 		return U3_FAILURE;
 	}
 
-	
-	sleep(2); // wait for device to reset
+	return U3_SUCCESS;
+}
+
+int u3_reopen(u3_handle_t *device, const char *which) {
+	if (device->dev != NULL)
+		u3_close(device);
+	device->dev = NULL;
 
-//	u3_reopen(device);
+	if (u3_open(device, which) != U3_SUCCESS) {
+		device->dev = NULL;
+		return U3_FAILURE;
+	}
 
 	return U3_SUCCESS;
 }
@@ -26,6 +26,18 @@
  */
 
 #include "u3.h"
+#include "u3_scsi.h"
+
+/**
+ * Maximum number of blocks written by a single u3_cd_write_multi() call.
+ * 64 KiB stays below the default transfer limit of usb-storage(120 KiB).
+ */
+#define U3_MAX_CD_WRITE_BLOCKS	32
+
+/**
+ * Maximum number of blocks read by a single u3_cd_read() call.
+ */
+#define U3_MAX_CD_READ_BLOCKS	32
 
 /********************************* structures *********************************/
 
@@ -149,6 +161,98 @@ int u3_partition(u3_handle_t *device, uint32_t cd_size);
  */
 int u3_cd_write(u3_handle_t *device, uint32_t block_num, uint8_t *block);
 
+/**
+ * Write multiple CD blocks
+ *
+ * This function write's 'block_cnt' contiguous blocks to the CD partition
+ * using a single command. Not every device is known to accept counts larger
+ * then one, so callers should be prepared to fall back to u3_cd_write() if
+ * this fails.
+ *
+ * @param device	U3 device handle
+ * @param block_num	The number of the first block to write
+ * @param block_cnt	The number of blocks to write, at most
+ * 			U3_MAX_CD_WRITE_BLOCKS
+ * @param blocks	A pointer to buffer containing 'block_cnt' blocks
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+int u3_cd_write_multi(u3_handle_t *device, uint32_t block_num,
+		uint32_t block_cnt, uint8_t *blocks);
+
+/**
+ * Submit a CD write without waiting for it
+ *
+ * This fills in 'cmd' as the command of u3_cd_write_multi() and submits it,
+ * see u3_submit_cmd(). Once the command is returned by u3_reap_cmd(), its
+ * result is evaluated by u3_cd_write_result(). 'cmd' and 'blocks' must stay
+ * valid till then.
+ *
+ * @param device	U3 device handle
+ * @param cmd		Command to fill in and submit
+ * @param block_num	The number of the first block to write
+ * @param block_cnt	The number of blocks to write, at most
+ * 			U3_MAX_CD_WRITE_BLOCKS
+ * @param blocks	A pointer to buffer containing 'block_cnt' blocks
+ *
+ * @returns		U3_SUCCESS if the command was submitted, else
+ * 			U3_FAILURE and an error string can be obtained using
+ * 			u3_error()
+ */
+int u3_cd_write_submit(u3_handle_t *device, struct u3_cmd *cmd,
+		uint32_t block_num, uint32_t block_cnt, uint8_t *blocks);
+
+/**
+ * Evaluate result of a CD write submitted using u3_cd_write_submit()
+ *
+ * @param device	U3 device handle
+ * @param cmd		Completed command, as returned by u3_reap_cmd()
+ *
+ * @returns		U3_SUCCESS if the blocks were written, else U3_FAILURE
+ * 			and an error string can be obtained using u3_error()
+ */
+int u3_cd_write_result(u3_handle_t *device, struct u3_cmd *cmd);
+
+/**
+ * Read CD blocks
+ *
+ * This function reads 'block_cnt' contiguous blocks from the CD partition
+ * using a standard SCSI READ(10) command. Unlike the U3 specific commands,
+ * this command is handled by the logical unit it is send to, so the device
+ * must be the CD drive of the U3 device.
+ *
+ * @param device	U3 device handle
+ * @param block_num	The number of the first block to read
+ * @param block_cnt	The number of blocks to read, at most
+ * 			U3_MAX_CD_READ_BLOCKS
+ * @param blocks	Buffer to return 'block_cnt' blocks in
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ *
+ * @see 'u3_cd_capacity()'
+ */
+int u3_cd_read(u3_handle_t *device, uint32_t block_num, uint32_t block_cnt,
+		uint8_t *blocks);
+
+/**
+ * Request capacity of logical unit
+ *
+ * This sends a standard SCSI READ CAPACITY(10) command to the device. If the
+ * device is the CD drive of the U3 device, the block size will be
+ * U3_BLOCK_SIZE.
+ *
+ * @param device	U3 device handle
+ * @param block_cnt	Used to return the number of blocks
+ * @param block_size	Used to return the size of a block in bytes
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+int u3_cd_capacity(u3_handle_t *device, uint32_t *block_cnt,
+		uint32_t *block_size);
+
 /**
  * Direction to round sector count.
  * 
@@ -243,8 +347,9 @@ int u3_chip_info(u3_handle_t *device, struct chip_info *info);
 /**
  * Reset device
  *
- * This function tell's the device to reconnect. When the function returns
- * the device should have been reset and reconnected.
+ * This function tell's the device to reconnect. The device disconnects
+ * shortly after the function returns and comes back with a new handle, see
+ * u3_reopen().
  * The exact working of this action is still vague
  *
  * @param device	U3 device handle
@@ -254,6 +359,21 @@ int u3_chip_info(u3_handle_t *device, struct chip_info *info);
  */
 int u3_reset(u3_handle_t *device);
 
+/**
+ * Reopen device
+ *
+ * This closes the device, if it is open, and opens 'which' again. It is used
+ * to get hold of the device after u3_reset(), when the device reconnected.
+ * If opening fails, the device is left closed and device->dev is NULL.
+ *
+ * @param device	U3 device handle
+ * @param which		Name of the device, as passed to u3_open()
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+int u3_reopen(u3_handle_t *device, const char *which);
+
 /**
  * Enable device security
  *
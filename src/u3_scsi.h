@@ -25,6 +25,8 @@
  * 		independent way of sending SCSI commands to a U3 device.
  */
 
+#include <stddef.h>
+
 #include "u3.h"
 
 #define U3_CMD_LEN		12
@@ -54,6 +56,56 @@ int u3_open(u3_handle_t *device, const char *which);
  */
 void u3_close(u3_handle_t *device);
 
+/**
+ * Events returned by u3_watch_next()
+ */
+enum {
+	U3_WATCH_TIMEOUT = 0,		// no device arrived or left in time
+	U3_WATCH_ARRIVED = 1,		// a device arrived
+	U3_WATCH_LEFT = 2,		// a device left
+};
+
+/**
+ * Start watching for devices arriving and leaving
+ *
+ * The subsystem is notified by the operating system, it doesn't poll for
+ * devices. Devices present when the watch starts are reported as arrived
+ * first. Devices reported may not be U3 devices, this is only known after
+ * opening them.
+ *
+ * @param watch		pointer to U3 handle used for the watch, it can't
+ * 			be used to send commands
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and
+ * 			an error string can be obtained using u3_error()
+ */
+int u3_watch_open(u3_handle_t *watch);
+
+/**
+ * Wait for a device to arrive or leave
+ *
+ * A device may be reported as arrived more than once, e.g. when the
+ * subsystem lost events and reports the devices present again. A device
+ * that left unnoticed then isn't reported as left.
+ *
+ * @param watch		U3 handle opened using u3_watch_open()
+ * @param name		Buffer to return the device name in, as used by
+ * 			u3_open()
+ * @param len		Size of 'name'
+ * @param timeout	Longest time to wait in milliseconds
+ *
+ * @returns		One of the U3_WATCH_* enum values, else U3_FAILURE
+ * 			and an error string can be obtained using u3_error()
+ */
+int u3_watch_next(u3_handle_t *watch, char *name, size_t len, int timeout);
+
+/**
+ * Stop watching for devices
+ *
+ * @param watch		U3 handle opened using u3_watch_open()
+ */
+void u3_watch_close(u3_handle_t *watch);
+
 
 /**
  * dxfer_direction values as used by u3_send_cmd()
@@ -88,4 +140,97 @@ int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
 		uint8_t *status);
 
+/**
+ * Execute a scsi command at device, subsystem implementation
+ *
+ * This is implemented by every subsystem and does the work of
+ * u3_send_cmd(). u3_send_cmd() wraps it to keep command statistics, see
+ * u3_stats.h. Parameters and return value are the same as u3_send_cmd().
+ */
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		uint8_t *status);
+
+/**
+ * Maximum number of commands in flight, see u3_set_queue_depth()
+ */
+#define U3_MAX_QUEUE_DEPTH	16
+
+/**
+ * A command executed asynchronously
+ *
+ * The caller fills in the command and its data, the other fields are set
+ * by the subsystem. The command and its data must stay valid till the
+ * command is returned by u3_reap_cmd().
+ */
+struct u3_cmd {
+	uint8_t	 cmd[U3_CMD_LEN];	// SCSI CDB
+	int	 dxfer_direction;	// direction of extra data, U3_DATA_*
+	int	 dxfer_length;		// length of extra data
+	uint8_t	 *dxfer_data;		// buffer with extra data
+
+	int	 result;		// U3_SUCCESS or U3_FAILURE
+	uint8_t	 status;		// SCSI status returned by the device
+	char	 err_msg[U3_MAX_ERROR_LEN]; // error of a failed command
+	uint64_t start;			// submit time, see u3_stats_now()
+};
+
+/**
+ * Set number of commands in flight
+ *
+ * Subsystems that can queue commands keep up to 'depth' commands submitted
+ * by u3_submit_cmd() in flight. Others only execute commands using
+ * u3_send_cmd(). No commands may be in flight while the depth is changed.
+ *
+ * @param device	U3 handle
+ * @param depth		Requested number of commands, at most
+ * 			U3_MAX_QUEUE_DEPTH
+ *
+ * @returns		Number of commands that can be in flight, 0 if the
+ * 			subsystem doesn't queue commands
+ */
+unsigned int u3_set_queue_depth(u3_handle_t *device, unsigned int depth);
+
+/**
+ * Submit a scsi command without waiting for it
+ *
+ * At most the number of commands returned by u3_set_queue_depth() can be in
+ * flight at a time. Commands submitted to a device are executed in order,
+ * but their completions may be returned in any order. The result of a
+ * command that was submitted is returned by u3_reap_cmd(), even if it
+ * failed.
+ *
+ * @param device	U3 handle
+ * @param cmd		Command to submit
+ *
+ * @returns		U3_SUCCESS if the command was submitted, else
+ * 			U3_FAILURE and an error string can be obtained using
+ * 			u3_error()
+ */
+int u3_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd);
+
+/**
+ * Wait for a submitted command to complete
+ *
+ * The result of the command is in cmd->result, cmd->status and
+ * cmd->err_msg. Statistics of the command are recorded from the time it was
+ * submitted.
+ *
+ * @param device	U3 handle
+ *
+ * @returns		The completed command, or NULL if no completion could
+ * 			be read and an error string can be obtained using
+ * 			u3_error()
+ */
+struct u3_cmd *u3_reap_cmd(u3_handle_t *device);
+
+/**
+ * Subsystem implementations of u3_set_queue_depth(), u3_submit_cmd() and
+ * u3_reap_cmd(). The u3_* functions wrap them to keep command statistics.
+ */
+unsigned int u3_subsys_set_queue_depth(u3_handle_t *device,
+		unsigned int depth);
+int u3_subsys_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd);
+struct u3_cmd *u3_subsys_reap_cmd(u3_handle_t *device);
+
 #endif // __U3_SCSI_H__
@@ -0,0 +1,343 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef SUBSYS_BSG
+#include "u3_scsi.h"
+#include "u3_error.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <linux/bsg.h>
+#include <scsi/scsi.h>
+#include <scsi/sg.h>
+
+#include "sg_err.h"
+#include "uevent.h"
+
+#define BSG_TIMEOUT	2000	// timeout of commands without data, in ms
+#define BSG_MIN_RATE	64	// slowest transfer rate expected, in KiB/s,
+				// extends the timeout of commands with data
+
+const char *u3_subsystem_name = "bsg";
+const char *u3_subsystem_help = "'/dev/bsg/6:0:0:0'";
+
+/**
+ * Device handle of the bsg subsystem
+ */
+struct bsg_device {
+	int		fd;		// file descriptor of bsg device
+	unsigned int	max_transfer;	// largest transfer of a command in
+					// bytes, 0 if unknown
+};
+
+int u3_open(u3_handle_t *device, const char *which) 
+{
+	struct bsg_device *bsg_dev;
+	struct stat st;
+	int bsg_fd;
+	int k;
+
+	u3_set_error(device, "");
+	device->dev = NULL;
+
+	if ((bsg_fd = open(which, O_RDWR)) < 0) {
+		u3_set_error(device, "%s", strerror(errno));
+		return U3_FAILURE;
+	}
+
+	// bsg devices are character devices which take SG_IO ioctls
+	if (fstat(bsg_fd, &st) < 0 || !S_ISCHR(st.st_mode) ||
+	    ioctl(bsg_fd, SG_GET_VERSION_NUM, &k) < 0)
+	{
+		close(bsg_fd);
+		u3_set_error(device, "device is not a bsg device");
+		return U3_FAILURE;
+	}
+
+	// The block layer maps the data of a command without a reserved
+	// buffer, transfers are limited by the request queue only. bsg
+	// reports this limit as reserved size.
+	if (ioctl(bsg_fd, SG_GET_RESERVED_SIZE, &k) < 0 || k < 0)
+		k = 0;
+
+	if ((bsg_dev = (struct bsg_device *) calloc(1,
+			sizeof(struct bsg_device))) == NULL)
+	{
+		close(bsg_fd);
+		u3_set_error(device, "Failed allocating memory for file descriptor");
+		return U3_FAILURE;
+	}
+
+	bsg_dev->fd = bsg_fd;
+	bsg_dev->max_transfer = k;
+	device->dev = bsg_dev;
+	return U3_SUCCESS;
+}
+
+void u3_close(u3_handle_t *device) 
+{
+	struct bsg_device *bsg_dev = (struct bsg_device *)device->dev;
+	close(bsg_dev->fd);
+	free(bsg_dev);
+}
+
+int u3_watch_open(u3_handle_t *watch)
+{
+	struct uevent_watch *uevent;
+
+	u3_set_error(watch, "");
+	watch->dev = NULL;
+
+	if ((uevent = (struct uevent_watch *) calloc(1,
+			sizeof(struct uevent_watch))) == NULL)
+	{
+		u3_set_error(watch, "Failed allocating memory for watch");
+		return U3_FAILURE;
+	}
+	if (uevent_watch_open(uevent, "bsg") == -1) {
+		u3_set_error(watch, "Failed watching for devices: %s",
+			strerror(errno));
+		free(uevent);
+		return U3_FAILURE;
+	}
+
+	watch->dev = uevent;
+	return U3_SUCCESS;
+}
+
+int u3_watch_next(u3_handle_t *watch, char *name, size_t len, int timeout)
+{
+	int event;
+
+	event = uevent_watch_next((struct uevent_watch *) watch->dev, name, len,
+			timeout);
+	if (event == -1) {
+		u3_set_error(watch, "Failed watching for devices: %s",
+			strerror(errno));
+		return U3_FAILURE;
+	}
+	return event;
+}
+
+void u3_watch_close(u3_handle_t *watch)
+{
+	uevent_watch_close((struct uevent_watch *) watch->dev);
+	free(watch->dev);
+}
+
+/**
+ * Get timeout of a command
+ *
+ * @param dxfer_length	Size of the data transfered
+ *
+ * @returns		Timeout in milliseconds
+ */
+static unsigned int cmd_timeout(int dxfer_length) {
+	return BSG_TIMEOUT + (unsigned int) ((uint64_t) dxfer_length * 1000 /
+		(BSG_MIN_RATE * 1024));
+}
+
+/**
+ * Prepare sg v4 header of a command
+ */
+static void prepare_io_hdr(struct sg_io_v4 *io_hdr, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		unsigned char *sense_buf)
+{
+	memset(io_hdr, 0, sizeof(struct sg_io_v4));
+	io_hdr->guard = 'Q';					// fixed
+	io_hdr->protocol = BSG_PROTOCOL_SCSI;
+	io_hdr->subprotocol = BSG_SUB_PROTOCOL_SCSI_CMD;
+	io_hdr->request_len = U3_CMD_LEN;
+	io_hdr->request = (uintptr_t) cmd;			// command
+	io_hdr->max_response_len = SG_ERR_SENSE_LEN;
+	io_hdr->response = (uintptr_t) sense_buf;		// sense buffer
+	io_hdr->timeout = cmd_timeout(dxfer_length);
+
+	switch (dxfer_direction) {
+		case U3_DATA_TO_DEV:
+			io_hdr->dout_xfer_len = dxfer_length;
+			io_hdr->dout_xferp = (uintptr_t) dxfer_data;
+			break;
+		case U3_DATA_FROM_DEV:
+			io_hdr->din_xfer_len = dxfer_length;
+			io_hdr->din_xferp = (uintptr_t) dxfer_data;
+			break;
+	}
+}
+
+/**
+ * Get SCSI status of a command, shifted like the masked status of sg
+ */
+static int masked_status(const struct sg_io_v4 *io_hdr) {
+	return (io_hdr->device_status >> 1) & 0x7f;
+}
+
+/**
+ * Evaluate result of a command
+ *
+ * @param io_hdr	Header of the completed command
+ * @param err_msg	Buffer of U3_MAX_ERROR_LEN bytes for the error string
+ * @param status	Status of the command
+ *
+ * @returns		U3_SUCCESS if the command was executed, else
+ * 			U3_FAILURE and an error string is written to 'err_msg'
+ */
+static int check_io_hdr(const struct sg_io_v4 *io_hdr, char *err_msg,
+		uint8_t *status)
+{
+	struct sg_err_sense sense;
+	int category;
+	int resid;
+	size_t n;
+
+	sg_err_decode_sense((const unsigned char *)(uintptr_t) io_hdr->response,
+			io_hdr->response_len, &sense);
+	category = sg_err_category(masked_status(io_hdr),
+			io_hdr->transport_status, io_hdr->driver_status, &sense);
+	*status = masked_status(io_hdr);
+
+	if ((io_hdr->info & SG_INFO_OK_MASK) == SG_INFO_OK)
+		return U3_SUCCESS;
+
+	// A SCSI status, with or without sense data, isn't an error of the
+	// transport, the status tells the command failed.
+	if (io_hdr->transport_status == SG_ERR_DID_OK &&
+	    ((io_hdr->driver_status & SG_ERR_DRIVER_MASK) == SG_ERR_DRIVER_OK ||
+	     (io_hdr->driver_status & SG_ERR_DRIVER_MASK) ==
+	     SG_ERR_DRIVER_SENSE))
+	{
+		if (category == SG_ERR_CAT_RECOVERED)
+			*status = GOOD;
+		return U3_SUCCESS;
+	}
+
+	n = snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing scsi "
+		"command: Status (S:0x%x,T:0x%x,D:0x%x)",
+		io_hdr->device_status, io_hdr->transport_status,
+		io_hdr->driver_status);
+	if (n < U3_MAX_ERROR_LEN && category == SG_ERR_CAT_TIMEOUT) {
+		n += snprintf(err_msg + n, U3_MAX_ERROR_LEN - n, ", timed "
+			"out after %u ms", io_hdr->duration);
+	}
+	if (n < U3_MAX_ERROR_LEN && sense.valid) {
+		n += snprintf(err_msg + n, U3_MAX_ERROR_LEN - n, ", Sense "
+			"(K:0x%x,ASC:0x%02x,ASCQ:0x%02x)", sense.key,
+			sense.asc, sense.ascq);
+	}
+	resid = io_hdr->dout_xfer_len ? io_hdr->dout_resid :
+		io_hdr->din_resid;
+	if (n < U3_MAX_ERROR_LEN && resid > 0) {
+		snprintf(err_msg + n, U3_MAX_ERROR_LEN - n, ", %d of %u bytes "
+			"not transferred", resid, io_hdr->dout_xfer_len +
+			io_hdr->din_xfer_len);
+	}
+	return U3_FAILURE;
+}
+
+/**
+ * Check if a completed command should be resent
+ */
+static int should_retry(const struct sg_io_v4 *io_hdr, unsigned int retries)
+{
+	struct sg_err_sense sense;
+
+	if (retries >= SG_ERR_RETRY_MAX)
+		return 0;
+
+	sg_err_decode_sense((const unsigned char *)(uintptr_t) io_hdr->response,
+			io_hdr->response_len, &sense);
+	return sg_err_retryable(masked_status(io_hdr),
+			io_hdr->transport_status, io_hdr->driver_status,
+			&sense);
+}
+
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		uint8_t *status)
+{
+	struct bsg_device *bsg_dev = (struct bsg_device *)device->dev;
+	struct sg_io_v4 io_hdr;
+	unsigned char sense_buf[SG_ERR_SENSE_LEN];
+	unsigned int retries = 0;
+
+	if (bsg_dev->max_transfer != 0 &&
+	    (unsigned int) dxfer_length > bsg_dev->max_transfer)
+	{
+		u3_set_error(device, "Failed executing scsi command: "
+			"transfer of %d bytes exceeds the limit of %u bytes",
+			dxfer_length, bsg_dev->max_transfer);
+		return U3_FAILURE;
+	}
+
+	prepare_io_hdr(&io_hdr, cmd, dxfer_direction, dxfer_length,
+			dxfer_data, sense_buf);
+
+	do {
+		if (retries > 0)
+			sg_err_backoff(cmd, retries - 1);
+
+		// preform ioctl on device
+		if (ioctl(bsg_dev->fd, SG_IO, &io_hdr) < 0) {
+			u3_set_error(device, "Failed executing scsi command: "
+				"SG_IO ioctl failed with %s", strerror(errno));
+			return U3_FAILURE;
+		}
+	} while (should_retry(&io_hdr, retries++));
+
+	// evaluate result
+	return check_io_hdr(&io_hdr, device->err_msg, status);
+}
+
+unsigned int u3_subsys_set_queue_depth(u3_handle_t *device,
+		unsigned int depth)
+{
+	(void) device;
+	(void) depth;
+
+	// bsg only executes commands using the SG_IO ioctl
+	return 0;
+}
+
+int u3_subsys_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd) {
+	(void) cmd;
+
+	u3_set_error(device, "Queueing commands isn't supported by the %s "
+		"subsystem", u3_subsystem_name);
+	return U3_FAILURE;
+}
+
+struct u3_cmd *u3_subsys_reap_cmd(u3_handle_t *device) {
+	u3_set_error(device, "Queueing commands isn't supported by the %s "
+		"subsystem", u3_subsystem_name);
+	return NULL;
+}
+
+#endif //SUBSYS_BSG
@@ -63,7 +63,7 @@ void u3_close(u3_handle_t *device)
 //	}
 }
 
-int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
 		uint8_t *status)
 {
@@ -33,19 +33,46 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
 
 #include <linux/cdrom.h>
+#include <scsi/scsi.h>
 #include <scsi/sg.h>
 
 #include "sg_err.h"
+#include "uevent.h"
 
 #define SG_TIMEOUT 2000	//2000 millisecs == 2 seconds 
+#define SG_RESERVED_SIZE (64 * 1024) // reserved buffer, fits the largest
+				     // multi block CD write
 
 const char *u3_subsystem_name = "sg";
 const char *u3_subsystem_help = "'/dev/sda0', '/dev/sg3'";
 
+/**
+ * A command submitted using write()
+ */
+struct sg_pending {
+	int		pack_id;	// tag of the command
+	struct u3_cmd	*cmd;		// command, NULL if the slot is free
+	unsigned int	retries;	// times the command was resent
+	unsigned char	sense[SG_ERR_SENSE_LEN]; // sense buffer of the command
+};
+
+/**
+ * Device handle of the sg subsystem
+ */
+struct sg_device {
+	int		 fd;		// file descriptor of sg device
+	unsigned int	 depth;		// commands that can be in flight
+	unsigned int	 inflight;	// commands in flight
+	int		 next_pack_id;	// tag of next submitted command
+	struct sg_pending pending[U3_MAX_QUEUE_DEPTH];
+};
+
 int u3_open(u3_handle_t *device, const char *which) 
 {
+	struct sg_device *sg_dev;
 	int k;
 	int sg_fd;
 
@@ -84,31 +111,86 @@ int u3_open(u3_handle_t *device, const char *which)
 	}
 
 
-	if ((device->dev = malloc(sizeof(int))) == NULL) {
+	if ((sg_dev = (struct sg_device *) calloc(1, sizeof(struct sg_device)))
+		== NULL)
+	{
 		close(sg_fd);
 		u3_set_error(device, "Failed allocating memory for file descriptor");
 		return U3_FAILURE;
 	}
 		
-	*((int *)device->dev) = sg_fd;
+	// Large transfers that can't use direct IO use the reserved buffer of
+	// the file descriptor instead of a buffer allocated for every command
+	k = SG_RESERVED_SIZE;
+	ioctl(sg_fd, SG_SET_RESERVED_SIZE, &k);
+
+	sg_dev->fd = sg_fd;
+	device->dev = sg_dev;
 	return U3_SUCCESS;
 }
 
 void u3_close(u3_handle_t *device) 
 {
-	int *sg_fd = (int *)device->dev;
-	close(*sg_fd);
-	free(sg_fd);
+	struct sg_device *sg_dev = (struct sg_device *)device->dev;
+	close(sg_dev->fd);
+	free(sg_dev);
 }
 
-int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
-		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
-		uint8_t *status)
+int u3_watch_open(u3_handle_t *watch)
 {
-	sg_io_hdr_t io_hdr;
-	unsigned char sense_buf[32];
-	int *sg_fd = (int *)device->dev;
+	struct uevent_watch *uevent;
+
+	u3_set_error(watch, "");
+	watch->dev = NULL;
+
+	if ((uevent = (struct uevent_watch *) calloc(1,
+			sizeof(struct uevent_watch))) == NULL)
+	{
+		u3_set_error(watch, "Failed allocating memory for watch");
+		return U3_FAILURE;
+	}
+	if (uevent_watch_open(uevent, "scsi_generic") == -1) {
+		u3_set_error(watch, "Failed watching for devices: %s",
+			strerror(errno));
+		free(uevent);
+		return U3_FAILURE;
+	}
+
+	watch->dev = uevent;
+	return U3_SUCCESS;
+}
+
+int u3_watch_next(u3_handle_t *watch, char *name, size_t len, int timeout)
+{
+	int event;
+
+	event = uevent_watch_next((struct uevent_watch *) watch->dev, name, len,
+			timeout);
+	if (event == -1) {
+		u3_set_error(watch, "Failed watching for devices: %s",
+			strerror(errno));
+		return U3_FAILURE;
+	}
+	return event;
+}
+
+void u3_watch_close(u3_handle_t *watch)
+{
+	uevent_watch_close((struct uevent_watch *) watch->dev);
+	free(watch->dev);
+}
 
+/**
+ * Prepare sg header of a command
+ *
+ * Data is transferred using direct IO. The driver falls back to indirect IO
+ * if direct IO isn't allowed (/proc/scsi/sg/allow_dio) or the buffer isn't
+ * aligned.
+ */
+static void prepare_io_hdr(sg_io_hdr_t *io_hdr, uint8_t cmd[U3_CMD_LEN], int dxfer_direction,
+		int dxfer_length, uint8_t *dxfer_data,
+		unsigned char *sense_buf)
+{
 	// translate dxfer_direction
 	switch (dxfer_direction) {
 		case U3_DATA_NONE:
@@ -123,53 +205,251 @@ int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 	}
 
 	// Prepare command
-	memset(&io_hdr, 0, sizeof(sg_io_hdr_t));
-	io_hdr.interface_id = 'S';			// fixed
-	io_hdr.dxfer_direction = dxfer_direction;	// Select data direction
-	io_hdr.cmd_len = U3_CMD_LEN;			// length of command in bytes
-	io_hdr.mx_sb_len = 0;		// sense buffer size. do we use this???
-	io_hdr.iovec_count = 0;   			// don't use iovector stuff
-	io_hdr.dxfer_len = dxfer_length;		// Size of data transfered
-	io_hdr.dxferp = dxfer_data;			// Data buffer to transfer
-	io_hdr.cmdp = cmd;				// Command buffer to execute
-	io_hdr.sbp = sense_buf;				// Sense buffer
-	io_hdr.timeout = SG_TIMEOUT;			// timeout
-	io_hdr.flags = 0;	 			// take defaults: indirect IO, etc 
-	// io_hdr.pack_id = 0;				// internal packet. used by te program to recognize packets
-	// io_hdr.usr_ptr = NULL;			// user data
-
-	// preform ioctl on device
-	if (ioctl(*sg_fd, SG_IO, &io_hdr) < 0) {
-		u3_set_error(device, "Failed executing scsi command: "
-				"SG_IO ioctl failed with %s", strerror(errno));
-		return U3_FAILURE;
-	}
+	memset(io_hdr, 0, sizeof(sg_io_hdr_t));
+	io_hdr->interface_id = 'S';			// fixed
+	io_hdr->dxfer_direction = dxfer_direction;	// Select data direction
+	io_hdr->cmd_len = U3_CMD_LEN;			// length of command in bytes
+	io_hdr->mx_sb_len = sense_buf == NULL ? 0 : SG_ERR_SENSE_LEN; // sense buffer size
+	io_hdr->iovec_count = 0;   			// don't use iovector stuff
+	io_hdr->dxfer_len = dxfer_length;		// Size of data transfered
+	io_hdr->dxferp = dxfer_data;			// Data buffer to transfer
+	io_hdr->cmdp = cmd;				// Command buffer to execute
+	io_hdr->sbp = sense_buf;			// Sense buffer
+	io_hdr->timeout = SG_TIMEOUT;			// timeout
+	io_hdr->flags = SG_FLAG_DIRECT_IO;		// don't copy the data
+}
 
-	// evaluate result
-	if ((io_hdr.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
-		if (io_hdr.host_status == SG_ERR_DID_OK &&
-		    (io_hdr.driver_status & SG_ERR_DRIVER_SENSE))
+/**
+ * Evaluate result of a command
+ *
+ * @param io_hdr	Header of the completed command
+ * @param err_msg	Buffer of U3_MAX_ERROR_LEN bytes for the error string
+ * @param status	Status of the command
+ *
+ * @returns		U3_SUCCESS if the command was executed, else
+ * 			U3_FAILURE and an error string is written to 'err_msg'
+ */
+static int check_io_hdr(const sg_io_hdr_t *io_hdr, char *err_msg,
+		uint8_t *status)
+{
+	struct sg_err_sense sense;
+	int category;
+
+	sg_err_decode_sense(io_hdr->sbp, io_hdr->sb_len_wr, &sense);
+	category = sg_err_category(io_hdr->masked_status, io_hdr->host_status,
+			io_hdr->driver_status, &sense);
+	*status = io_hdr->masked_status;
+
+	if ((io_hdr->info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		if (io_hdr->host_status == SG_ERR_DID_OK &&
+		    (io_hdr->driver_status & SG_ERR_DRIVER_SENSE))
 		{
 			// 
 			// The usb-storage driver automatically request sense
 			// data if a command fails. So this state isn't really
 			// a error but only indicates that the sense data in
-			// the buffer is fresh. Currently we aren't don't use
-			// this sense data, we only wanna know if a command
-			// failed or not. so ignore this...
+			// the buffer is fresh. A recovered error means the
+			// command succeeded, else the status tells the
+			// command failed.
 			//
+			if (category == SG_ERR_CAT_RECOVERED)
+				*status = GOOD;
 
+		} else if (sense.valid) {
+			snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+				"scsi command: Status (S:0x%x,H:0x%x,D:0x%x), "
+				"Sense (K:0x%x,ASC:0x%02x,ASCQ:0x%02x)",
+				io_hdr->status, io_hdr->host_status,
+				io_hdr->driver_status, sense.key, sense.asc,
+				sense.ascq);
+			return U3_FAILURE;
 		} else {
+			snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+				"scsi command: Status (S:0x%x,H:0x%x,D:0x%x)",
+				io_hdr->status, io_hdr->host_status,
+				io_hdr->driver_status);
+			return U3_FAILURE;
+		}
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Check if a completed command should be resent
+ */
+static int should_retry(const sg_io_hdr_t *io_hdr, unsigned int retries) {
+	struct sg_err_sense sense;
+
+	if (retries >= SG_ERR_RETRY_MAX)
+		return 0;
+
+	sg_err_decode_sense(io_hdr->sbp, io_hdr->sb_len_wr, &sense);
+	return sg_err_retryable(io_hdr->masked_status, io_hdr->host_status,
+			io_hdr->driver_status, &sense);
+}
+
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		uint8_t *status)
+{
+	struct sg_device *sg_dev = (struct sg_device *)device->dev;
+	sg_io_hdr_t io_hdr;
+	unsigned char sense_buf[SG_ERR_SENSE_LEN];
+	unsigned int retries = 0;
+
+	prepare_io_hdr(&io_hdr, cmd, dxfer_direction, dxfer_length,
+			dxfer_data, sense_buf);
+
+	do {
+		if (retries > 0)
+			sg_err_backoff(cmd, retries - 1);
+
+		// preform ioctl on device
+		if (ioctl(sg_dev->fd, SG_IO, &io_hdr) < 0) {
 			u3_set_error(device, "Failed executing scsi command: "
-				"Status (S:0x%x,H:0x%x,D:0x%x)", io_hdr.status,
-				io_hdr.host_status, io_hdr.driver_status);
+				"SG_IO ioctl failed with %s", strerror(errno));
 			return U3_FAILURE;
 		}
+	} while (should_retry(&io_hdr, retries++));
+
+	// evaluate result
+	return check_io_hdr(&io_hdr, device->err_msg, status);
+}
+
+unsigned int u3_subsys_set_queue_depth(u3_handle_t *device,
+		unsigned int depth)
+{
+	struct sg_device *sg_dev = (struct sg_device *)device->dev;
+	int on = 1;
+
+	// let the driver queue more than one command of the file descriptor
+	if (depth > 1 && ioctl(sg_dev->fd, SG_SET_COMMAND_Q, &on) < 0)
+		depth = 0;
+
+	sg_dev->depth = depth;
+	return depth;
+}
+
+/**
+ * Submit a command using write()
+ *
+ * The sense data of the command is written to the sense buffer of 'slot'
+ * when it completes.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an error
+ * 			string is written to 'err_msg'
+ */
+static int write_cmd(struct sg_device *sg_dev, struct sg_pending *slot,
+		struct u3_cmd *cmd, char *err_msg)
+{
+	sg_io_hdr_t io_hdr;
+	ssize_t res;
+
+	prepare_io_hdr(&io_hdr, cmd->cmd, cmd->dxfer_direction,
+			cmd->dxfer_length, cmd->dxfer_data, slot->sense);
+	io_hdr.pack_id = sg_dev->next_pack_id++;
+	io_hdr.usr_ptr = cmd;
+
+	do {
+		res = write(sg_dev->fd, &io_hdr, sizeof(io_hdr));
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed submitting scsi "
+			"command: write to sg device failed with %s",
+			strerror(errno));
+		return U3_FAILURE;
+	}
+
+	slot->pack_id = io_hdr.pack_id;
+	return U3_SUCCESS;
+}
+
+int u3_subsys_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd) {
+	struct sg_device *sg_dev = (struct sg_device *)device->dev;
+	struct sg_pending *slot = NULL;
+	unsigned int i;
+
+	if (sg_dev->inflight >= sg_dev->depth) {
+		u3_set_error(device, "Failed submitting scsi command: %u "
+			"commands in flight already", sg_dev->inflight);
+		return U3_FAILURE;
+	}
+	for (i = 0; slot == NULL; i++) {
+		if (sg_dev->pending[i].cmd == NULL)
+			slot = &sg_dev->pending[i];
 	}
 
-	*status = io_hdr.masked_status;
+	slot->retries = 0;
+	if (write_cmd(sg_dev, slot, cmd, device->err_msg) != U3_SUCCESS)
+		return U3_FAILURE;
 
+	slot->cmd = cmd;
+	sg_dev->inflight++;
 	return U3_SUCCESS;
 }
 
+struct u3_cmd *u3_subsys_reap_cmd(u3_handle_t *device) {
+	struct sg_device *sg_dev = (struct sg_device *)device->dev;
+	struct sg_pending *slot;
+	struct u3_cmd *cmd;
+	sg_io_hdr_t io_hdr;
+	unsigned int i;
+	ssize_t res;
+
+	if (sg_dev->inflight == 0) {
+		u3_set_error(device, "No scsi command in flight");
+		return NULL;
+	}
+
+	for (;;) {
+		// read the first completion of any command
+		memset(&io_hdr, 0, sizeof(io_hdr));
+		io_hdr.interface_id = 'S';
+		io_hdr.pack_id = -1;
+		do {
+			res = read(sg_dev->fd, &io_hdr, sizeof(io_hdr));
+		} while (res < 0 && errno == EINTR);
+		if (res < 0) {
+			u3_set_error(device, "Failed reading scsi command "
+				"completion: %s", strerror(errno));
+			return NULL;
+		}
+
+		for (i = 0; i < U3_MAX_QUEUE_DEPTH; i++) {
+			if (sg_dev->pending[i].cmd != NULL &&
+			    sg_dev->pending[i].pack_id == io_hdr.pack_id)
+				break;
+		}
+		if (i == U3_MAX_QUEUE_DEPTH) {
+			u3_set_error(device, "Completion of unknown scsi "
+				"command %d", io_hdr.pack_id);
+			return NULL;
+		}
+		slot = &sg_dev->pending[i];
+		cmd = slot->cmd;
+		cmd->err_msg[0] = '\0';
+
+		// read() returns the sense buffer passed to write_cmd()
+		if (!should_retry(&io_hdr, slot->retries))
+			break;
+
+		// resend the command, the other commands keep going
+		sg_err_backoff(cmd->cmd, slot->retries++);
+		if (write_cmd(sg_dev, slot, cmd, cmd->err_msg) != U3_SUCCESS) {
+			cmd->result = U3_FAILURE;
+			cmd->status = 0;
+			slot->cmd = NULL;
+			sg_dev->inflight--;
+			return cmd;
+		}
+	}
+
+	slot->cmd = NULL;
+	sg_dev->inflight--;
+
+	cmd->result = check_io_hdr(&io_hdr, cmd->err_msg, &cmd->status);
+	return cmd;
+}
+
 #endif //SUBSYS_SG
@@ -90,7 +90,7 @@ void u3_close(u3_handle_t *device)
 	CloseHandle(hDevice);
 }
 
-int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
 		uint8_t *status)
 {
@@ -161,4 +161,53 @@ int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 	return U3_SUCCESS;
 }
 
+int u3_watch_open(u3_handle_t *watch)
+{
+	// drive letters come and go without a notification we can wait on
+	// from a console program
+	u3_set_error(watch, "Watching for devices is not supported by the "
+		"spt subsystem");
+	return U3_FAILURE;
+}
+
+int u3_watch_next(u3_handle_t *watch, char *name, size_t len, int timeout)
+{
+	(void) name;
+	(void) len;
+	(void) timeout;
+
+	u3_set_error(watch, "Watching for devices is not supported by the "
+		"spt subsystem");
+	return U3_FAILURE;
+}
+
+void u3_watch_close(u3_handle_t *watch)
+{
+	(void) watch;
+}
+
+unsigned int u3_subsys_set_queue_depth(u3_handle_t *device,
+		unsigned int depth)
+{
+	(void) device;
+	(void) depth;
+
+	// commands are only executed by u3_subsys_send_cmd()
+	return 0;
+}
+
+int u3_subsys_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd) {
+	(void) cmd;
+
+	u3_set_error(device, "Queueing commands isn't supported by the %s "
+		"subsystem", u3_subsystem_name);
+	return U3_FAILURE;
+}
+
+struct u3_cmd *u3_subsys_reap_cmd(u3_handle_t *device) {
+	u3_set_error(device, "Queueing commands isn't supported by the %s "
+		"subsystem", u3_subsystem_name);
+	return NULL;
+}
+
 #endif // SUBSYS_SPT
@@ -26,17 +26,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
-#include <assert.h>
-#include <usb.h>
+#include <libusb.h>
 #include <errno.h>
-#include <regex.h>
-
-// USB maximum packet length
-#define USB_MAX_PACKET_LEN 2048
+#include <pthread.h>
 
 // USB command block wrapper length
 #define U3_CBWCB_LEN	12
@@ -47,8 +46,23 @@
 #define CBW_DATA_NONE		0x00
 #define CBW_FLAG_DIRECTION	0x80
 
+// USB MSC command status wrapper status values
+#define CSW_STATUS_PHASE_ERROR	0x02
+
+// USB MSC class specific request resetting the bulk only transport
+#define MSC_REQUEST_RESET	0xff
+
 #define U3_DEVICE_TIMEOUT 2000	//2000 millisecs == 2 seconds 
 
+#define USB_MAX_FOUND	128	// devices remembered by discovery
+#define USB_MAX_PORTS	7	// port numbers from the root hub, USB allows
+				// no deeper hub trees
+#define USB_SERIAL_LEN	128	// max. length of a serial number
+#define USB_ID_HASH_BITS 5	// VID:PID hash table of 32 slots, at least
+				// twice the entries of u3_dev_list
+#define USB_ID_HASH_SIZE (1 << USB_ID_HASH_BITS)
+#define USB_WATCH_QUEUE	128	// hotplug events waiting to be reported
+
 uint16_t u3_dev_list[][2] = {
 	{ 0x08ec, 0x0020 }, // Verbatim Store 'N Go
 	{ 0x0781, 0x5406 }, // Sandisk Cruzer Micro
@@ -61,18 +75,12 @@ uint16_t u3_dev_list[][2] = {
 	{ 0, 0 },
 };
 
-struct u3_usb_handle {
-	usb_dev_handle *handle;
-	int interface_num;
-	int ep_out;
-	int ep_in;
-};
-typedef struct u3_usb_handle u3_usb_handle_t;
-
+// The multi byte fields of the wrappers are little endian, see le32() and
+// get_le32()
 struct usb_msc_cbw {
 	uint8_t dCBWSignature[4];
-	uint32_t dCBWTag;
-	uint32_t dCBWDataTransferLength;
+	uint8_t dCBWTag[4];
+	uint8_t dCBWDataTransferLength[4];
 	uint8_t bmCBWFlags;
 	uint8_t bCBWLUN;
 	uint8_t bCBWCBLength;
@@ -81,166 +89,556 @@ struct usb_msc_cbw {
 
 struct usb_msc_csw {
 	uint8_t dCSWSignature[4];
-	uint32_t dCSWTag;
-	uint32_t dCSWDataResidue;
+	uint8_t dCSWTag[4];
+	uint8_t dCSWDataResidue[4];
 	uint8_t bCSWStatus;
 } __attribute__ ((packed));
 
+/**
+ * Transfers of one command
+ *
+ * The command block, data and status transfers are submitted back to back,
+ * the bulk endpoints keep them in order. The transfers of further commands
+ * can follow right away, the device takes the next command block once it
+ * returned the status of the previous one.
+ */
+enum usb_stage {
+	USB_STAGE_CBW = 0,
+	USB_STAGE_DATA = 1,
+	USB_STAGE_CSW = 2,
+	USB_STAGES = 3,
+};
+
+/**
+ * A command submitted to the device
+ */
+struct usb_pending {
+	struct u3_cmd	*cmd;		// command, NULL if the entry is free
+	uint32_t	tag;		// tag of the command block
+	unsigned long	seq;		// submission order
+	int		has_data;	// command has a data stage
+	int		pending;	// transfers not completed yet
+	int		completed;	// all transfers completed
+	unsigned char	stalled;	// endpoint of a stalled transfer, or 0
+	int		csw_len;	// bytes of status received
+	struct libusb_transfer *transfers[USB_STAGES];
+	struct usb_msc_cbw cbw;
+	struct usb_msc_csw csw;
+};
+
+struct u3_usb_handle {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int interface_num;
+	unsigned char ep_out;
+	unsigned char ep_in;
+
+	uint32_t next_tag;		// tag of the next command block
+	unsigned long next_seq;		// order of the next command
+	unsigned int depth;		// commands that can be in flight
+	unsigned int inflight;		// commands in flight
+	int resync;			// transport lost track of the commands,
+					// reset it once none are in flight
+	struct usb_pending pending[U3_MAX_QUEUE_DEPTH];
+};
+typedef struct u3_usb_handle u3_usb_handle_t;
+
 const char *u3_subsystem_name = "libusb";
-const char *u3_subsystem_help = "'scan' to automatically use the first detected U3 device, or 'vid:pid' if not detected";
+const char *u3_subsystem_help = "'scan' to automatically use the first detected U3 device, 'vid:pid' if not detected, or the serial number of the device";
 
-static struct usb_device *
-locate_u3_device(uint16_t vid, uint16_t pid)
-{
-	struct usb_bus *bus;
-	struct usb_device *dev;
-
-	// rescan busses and devices
-	usb_find_busses();
-	usb_find_devices();
-
-	for (bus = usb_get_busses(); bus; bus = bus->next) {
-		for (dev = bus->devices; dev; dev = dev->next) {
-			if (dev->descriptor.idVendor == vid &&
-			    (dev->descriptor.idProduct == pid))
-			{
-				return dev;
-			}
+/**
+ * A device found by discovery
+ */
+struct usb_found {
+	libusb_device	*dev;		// referenced device
+	uint16_t	vid;		// vendor id
+	uint16_t	pid;		// product id
+	int		known;		// VID:PID is in u3_dev_list
+	uint8_t		bus;		// bus number
+	uint8_t		ports[USB_MAX_PORTS]; // port numbers from the root hub
+	int		n_ports;	// number of entries in 'ports'
+	uint8_t		serial_index;	// string descriptor of the serial number
+	int		serial_read;	// 'serial' has been read
+	char		serial[USB_SERIAL_LEN]; // serial number, "" if unknown
+};
+
+/**
+ * Device discovery, shared by all handles
+ *
+ * The bus is enumerated once and the devices found are remembered till a
+ * lookup misses, then it is enumerated again. The libusb context lives as
+ * long as handles use it.
+ */
+static struct {
+	pthread_mutex_t	lock;		// protects all fields
+	libusb_context	*ctx;		// shared context, or NULL
+	unsigned int	users;		// handles using 'ctx'
+	uint32_t	id_hash[USB_ID_HASH_SIZE]; // VID:PID of u3_dev_list,
+					// 0 is a free slot
+	int		hashed;		// 'id_hash' has been filled
+	struct usb_found found[USB_MAX_FOUND]; // sorted by bus and ports
+	int		n_found;	// number of entries in 'found'
+	int		scanned;	// 'found' is valid
+} discovery = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Hotplug watch, see u3_watch_open()
+ *
+ * Hotplug callbacks run in any thread handling events of the shared
+ * context, they only queue the devices. Names are given to the devices when
+ * the events are reported.
+ */
+struct usb_watch {
+	pthread_mutex_t	lock;		// protects 'events', 'n_events' and
+					// 'lost'
+	libusb_hotplug_callback_handle callback;
+	struct {
+		int		event;	// U3_WATCH_ARRIVED or U3_WATCH_LEFT
+		libusb_device	*dev;	// referenced device
+	} events[USB_WATCH_QUEUE];	// oldest first
+	int		n_events;	// number of entries in 'events'
+	int		lost;		// events were dropped, 'events' was full
+	struct {
+		libusb_device	*dev;	// referenced device
+		char		name[USB_SERIAL_LEN]; // name reported
+	} named[USB_MAX_FOUND];		// devices reported as arrived
+	int		n_named;	// number of entries in 'named'
+};
+
+/**
+ * Get hash table slot of a VID:PID
+ */
+static unsigned int id_slot(uint32_t id) {
+	return (id * 2654435761u) >> (32 - USB_ID_HASH_BITS);
+}
+
+/**
+ * Fill the VID:PID hash table from u3_dev_list, discovery.lock must be held
+ */
+static void hash_ids(void) {
+	unsigned int slot;
+	int i;
+
+	for (i = 0; u3_dev_list[i][0] != 0 || u3_dev_list[i][1] != 0; i++) {
+		slot = id_slot(((uint32_t) u3_dev_list[i][0] << 16) |
+				u3_dev_list[i][1]);
+		while (discovery.id_hash[slot] != 0)
+			slot = (slot + 1) % USB_ID_HASH_SIZE;
+		discovery.id_hash[slot] = ((uint32_t) u3_dev_list[i][0] << 16) |
+				u3_dev_list[i][1];
+	}
+	discovery.hashed = 1;
+}
+
+/**
+ * Check if a VID:PID is in u3_dev_list
+ */
+static int id_known(uint16_t vid, uint16_t pid) {
+	uint32_t id = ((uint32_t) vid << 16) | pid;
+	unsigned int slot;
+
+	if (!discovery.hashed)
+		hash_ids();
+
+	for (slot = id_slot(id); discovery.id_hash[slot] != 0;
+	     slot = (slot + 1) % USB_ID_HASH_SIZE)
+	{
+		if (discovery.id_hash[slot] == id)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Forget the devices found
+ */
+static void forget_devices(void) {
+	int i;
+
+	for (i = 0; i < discovery.n_found; i++)
+		libusb_unref_device(discovery.found[i].dev);
+	discovery.n_found = 0;
+	discovery.scanned = 0;
+}
+
+/**
+ * Order devices by bus and port numbers
+ */
+static int compare_found(const void *a, const void *b) {
+	const struct usb_found *fa = (const struct usb_found *) a;
+	const struct usb_found *fb = (const struct usb_found *) b;
+	int i;
+
+	if (fa->bus != fb->bus)
+		return fa->bus - fb->bus;
+	for (i = 0; i < fa->n_ports && i < fb->n_ports; i++) {
+		if (fa->ports[i] != fb->ports[i])
+			return fa->ports[i] - fb->ports[i];
+	}
+	return fa->n_ports - fb->n_ports;
+}
+
+/**
+ * Enumerate the bus and remember all devices
+ */
+static void scan_bus(void) {
+	libusb_device **list;
+	struct libusb_device_descriptor desc;
+	struct usb_found *f;
+	ssize_t cnt, i;
+	int n;
+
+	forget_devices();
+	if ((cnt = libusb_get_device_list(discovery.ctx, &list)) < 0)
+		return;
+
+	for (i = 0; i < cnt && discovery.n_found < USB_MAX_FOUND; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+
+		f = &discovery.found[discovery.n_found++];
+		memset(f, 0, sizeof(struct usb_found));
+		f->dev = libusb_ref_device(list[i]);
+		f->vid = desc.idVendor;
+		f->pid = desc.idProduct;
+		f->known = id_known(desc.idVendor, desc.idProduct);
+		f->bus = libusb_get_bus_number(list[i]);
+		n = libusb_get_port_numbers(list[i], f->ports, USB_MAX_PORTS);
+		f->n_ports = n < 0 ? 0 : n;
+		f->serial_index = desc.iSerialNumber;
+	}
+	libusb_free_device_list(list, 1);
+
+	qsort(discovery.found, discovery.n_found, sizeof(struct usb_found),
+		compare_found);
+	discovery.scanned = 1;
+
+	if (debug) {
+		for (i = 0; i < discovery.n_found; i++) {
+			f = &discovery.found[i];
+			if (!f->known)
+				continue;
+			fprintf(stderr, "Found U3 device %.4x:%.4x on bus %u "
+				"port", f->vid, f->pid, f->bus);
+			for (n = 0; n < f->n_ports; n++)
+				fprintf(stderr, "%c%u", n ? '.' : ' ',
+					f->ports[n]);
+			fprintf(stderr, "\n");
 		}
 	}
+}
 
-	return NULL;
+/**
+ * Read the serial number of a device
+ *
+ * @param dev		Device
+ * @param index		String descriptor of the serial number, 0 if none
+ * @param serial	Buffer of USB_SERIAL_LEN bytes, set to "" if the
+ * 			serial number can't be read
+ */
+static void read_serial(libusb_device *dev, uint8_t index, char *serial) {
+	libusb_device_handle *handle;
+	int len;
+
+	serial[0] = '\0';
+	if (index != 0 && libusb_open(dev, &handle) == 0) {
+		len = libusb_get_string_descriptor_ascii(handle, index,
+				(unsigned char *) serial, USB_SERIAL_LEN - 1);
+		serial[len < 0 ? 0 : len] = '\0';
+		libusb_close(handle);
+	}
 }
 
-int u3_open(u3_handle_t *device, const char *which) 
-{
-	uint16_t vid, pid;
-	regex_t vid_pid_regex;
-	int has_vid_pid = 0;
+/**
+ * Get the serial number of a device found, it is read on first use
+ */
+static const char *found_serial(struct usb_found *f) {
+	if (!f->serial_read)
+		read_serial(f->dev, f->serial_index, f->serial);
+	f->serial_read = 1;
+	return f->serial;
+}
 
-        struct usb_device *u3_device;
-	u3_usb_handle_t *handle_wrapper;
+/**
+ * Parse a 'vid:pid' device name
+ *
+ * @returns		1 if 'which' is a 'vid:pid' name, else 0
+ */
+static int parse_vid_pid(const char *which, uint16_t *vid, uint16_t *pid) {
+	unsigned long id[2];
+	char *end;
+	int i;
 
-	struct usb_config_descriptor *config_desc;
-	struct usb_interface_descriptor *interface_desc;
-	struct usb_endpoint_descriptor *endpoint_desc;
+	for (i = 0; i < 2; i++) {
+		if (!isxdigit((unsigned char) *which))
+			return 0;
+		id[i] = strtoul(which, &end, 16);
+		if (id[i] > 0xffff || *end != (i == 0 ? ':' : '\0'))
+			return 0;
+		which = end + 1;
+	}
 
-	int err;
-	char errbuf[U3_MAX_ERROR_LEN];
+	*vid = id[0];
+	*pid = id[1];
+	return 1;
+}
 
-	// init
-	u3_set_error(device, "");
+/**
+ * Look up a device by name in the devices found
+ */
+static struct usb_found *lookup_device(const char *which) {
+	uint16_t vid, pid;
+	int is_vid_pid;
+	int i;
 
-	err = regcomp(&vid_pid_regex, "[::xdigit::]*:[::xdigit::]*", 0);
-	if (err != 0) {
-		regerror(err, &vid_pid_regex, errbuf, U3_MAX_ERROR_LEN);
-		u3_set_error(device, "Failed constructing 'vid:pid' regular "
-				"expression: %s", errbuf);
-		return U3_FAILURE;
+	is_vid_pid = parse_vid_pid(which, &vid, &pid);
+	for (i = 0; i < discovery.n_found; i++) {
+		struct usb_found *f = &discovery.found[i];
+
+		if (is_vid_pid) {
+			if (f->vid == vid && f->pid == pid)
+				return f;
+		} else if (strcmp(which, "scan") == 0) {
+			if (f->known)
+				return f;
+		} else if (f->known && strcmp(found_serial(f), which) == 0) {
+			return f;
+		}
 	}
-	if (regexec(&vid_pid_regex, which, 0, 0, 0) == 0) {
-		// Do de regexing here, this prevents leaking of the
-		// vid_pid_regex memory
-		char *seperator=0;
-		has_vid_pid = 1;
-		vid = strtoul(which, &seperator, 16);
-		pid = strtoul(seperator+1, &seperator, 16);
+	return NULL;
+}
+
+/**
+ * Find a device by name
+ *
+ * Names are 'scan' for the first known U3 device, 'vid:pid', or the serial
+ * number of a known U3 device. The devices found before are used if they
+ * contain the device, else the bus is enumerated again. discovery.lock must
+ * be held.
+ *
+ * @param device	U3 handle, for error strings
+ * @param which		Device name
+ * @param rescan	Enumerate the bus even if the device is known
+ *
+ * @returns		Referenced device, or NULL if none was found and an
+ * 			error string can be obtained using u3_error()
+ */
+static libusb_device *find_device(u3_handle_t *device, const char *which,
+		int rescan)
+{
+	struct usb_found *f = NULL;
+	uint16_t vid, pid;
+
+	if (discovery.scanned && !rescan)
+		f = lookup_device(which);
+	if (f == NULL) {
+		scan_bus();
+		f = lookup_device(which);
 	}
-	regfree(&vid_pid_regex);
+	if (f != NULL)
+		return libusb_ref_device(f->dev);
 
-	usb_init();
-	if (debug)
-		usb_set_debug(255);
+	if (parse_vid_pid(which, &vid, &pid)) {
+		u3_set_error(device, "Could not locate the U3 device '%s', "
+				"try 'scan' for first available device", which);
+	} else if (strcmp(which, "scan") == 0) {
+		u3_set_error(device, "Could not locate any known U3 device, "
+				"the VID:PID of your device might not be known to U3 tool");
+	} else {
+		u3_set_error(device, "Could not locate a U3 device with "
+			"serial number '%s', try 'scan' for first available "
+			"device", which);
+	}
+	return NULL;
+}
 
-	// Find device
-	if (has_vid_pid) {
-		u3_device = locate_u3_device(vid, pid);
+/**
+ * Get the shared libusb context, discovery.lock must be held
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int context_get(u3_handle_t *device) {
+	int err;
 
-		if (u3_device == NULL) {
-			u3_set_error(device, "Could not locate the U3 device '%s', "
-					"try 'scan' for first available device", which);
+	if (discovery.ctx == NULL) {
+		if ((err = libusb_init(&discovery.ctx)) != 0) {
+			discovery.ctx = NULL;
+			u3_set_error(device, "Failed initializing libusb: %s",
+				libusb_error_name(err));
 			return U3_FAILURE;
 		}
-	} else if (strcmp(which, "scan") == 0) {
-		int i = 0;
-		u3_device = NULL;
-		while (u3_device == NULL &&
-		       !(u3_dev_list[i][0] == 0 && u3_dev_list[i][1] == 0))
-		{
-			u3_device = locate_u3_device(u3_dev_list[i][0],
-						u3_dev_list[i][1]);
-			i++;
+		if (debug) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
+			libusb_set_option(discovery.ctx,
+				LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+#else
+			libusb_set_debug(discovery.ctx, LIBUSB_LOG_LEVEL_DEBUG);
+#endif
 		}
+	}
 
-		if (u3_device == NULL) {
-			u3_set_error(device, "Could not locate any known U3 device, "
-					"the VID:PID of your device might not be known to U3 tool");
-			return U3_FAILURE;
+	discovery.users++;
+	return U3_SUCCESS;
+}
+
+/**
+ * Release the shared libusb context, the devices found are forgotten with
+ * the last user
+ */
+static void context_put(void) {
+	pthread_mutex_lock(&discovery.lock);
+	if (--discovery.users == 0) {
+		forget_devices();
+		libusb_exit(discovery.ctx);
+		discovery.ctx = NULL;
+	}
+	pthread_mutex_unlock(&discovery.lock);
+}
+
+/**
+ * Free the transfers of a handle
+ */
+static void free_transfers(u3_usb_handle_t *handle_wrapper) {
+	int i, j;
+
+	for (i = 0; i < U3_MAX_QUEUE_DEPTH; i++) {
+		for (j = 0; j < USB_STAGES; j++) {
+			if (handle_wrapper->pending[i].transfers[j] != NULL)
+				libusb_free_transfer(
+					handle_wrapper->pending[i].transfers[j]);
 		}
-//	} else if (regexec(&serial_regex, which, 0, 0, 0) == 0) {
-//TODO: search for a specific serial number
-	} else {
-		u3_set_error(device, "Unknown device name '%s', try 'scan' "
-			"for first available device", which);
+	}
+}
+
+int u3_open(u3_handle_t *device, const char *which) 
+{
+	libusb_context *ctx;
+	libusb_device *u3_device;
+	u3_usb_handle_t *handle_wrapper;
+
+	struct libusb_device_descriptor device_desc;
+	struct libusb_config_descriptor *config_desc;
+	const struct libusb_interface_descriptor *interface_desc;
+	const struct libusb_endpoint_descriptor *endpoint_desc;
+
+	int err;
+	int i, j;
+	int configuration;
+
+	// init
+	u3_set_error(device, "");
+
+	// Find device
+	pthread_mutex_lock(&discovery.lock);
+	if (context_get(device) != U3_SUCCESS) {
+		pthread_mutex_unlock(&discovery.lock);
 		return U3_FAILURE;
 	}
+	ctx = discovery.ctx;
+	u3_device = find_device(device, which, 0);
+	pthread_mutex_unlock(&discovery.lock);
+	if (u3_device == NULL)
+		goto init_fail;
 
 	// Open device
-	handle_wrapper = (u3_usb_handle_t *) malloc(sizeof(u3_usb_handle_t));
+	handle_wrapper = (u3_usb_handle_t *) calloc(1, sizeof(u3_usb_handle_t));
 	if (handle_wrapper == NULL) {
 		u3_set_error(device, "Failed allocate memory!!");
-		return U3_FAILURE;
+		libusb_unref_device(u3_device);
+		goto init_fail;
 	}
+	handle_wrapper->ctx = ctx;
+	handle_wrapper->next_tag = 1;
 
-	handle_wrapper->handle = usb_open(u3_device);
+	err = libusb_open(u3_device, &handle_wrapper->handle);
+	if (err == LIBUSB_ERROR_NO_DEVICE) {
+		// unplugged since the bus was enumerated, look again
+		libusb_unref_device(u3_device);
+		pthread_mutex_lock(&discovery.lock);
+		u3_device = find_device(device, which, 1);
+		pthread_mutex_unlock(&discovery.lock);
+		if (u3_device == NULL) {
+			free(handle_wrapper);
+			goto init_fail;
+		}
+		err = libusb_open(u3_device, &handle_wrapper->handle);
+	}
+	if (err == 0) {
+		err = libusb_get_device_descriptor(u3_device, &device_desc);
+		if (err == 0) {
+			err = libusb_get_config_descriptor(u3_device, 0,
+					&config_desc);
+		}
+	} else {
+		handle_wrapper->handle = NULL;
+	}
+	libusb_unref_device(u3_device);
+	if (err != 0) {
+		u3_set_error(device, "Failed opening USB device: %s",
+			libusb_error_name(err));
+		goto open_fail;
+	}
 
 	// Set configuration
-	if (u3_device->descriptor.bNumConfigurations != 1) {
+	if (device_desc.bNumConfigurations != 1) {
 		u3_set_error(device,
 			"Multiple USB configuration not supported");
-		goto open_fail;
+		goto config_fail;
 	} 
-	config_desc = u3_device->config;
-	usb_set_configuration(handle_wrapper->handle,
+	if (libusb_get_configuration(handle_wrapper->handle,
+			&configuration) != 0 ||
+	    configuration != config_desc->bConfigurationValue)
+	{
+		libusb_set_configuration(handle_wrapper->handle,
 				config_desc->bConfigurationValue);
+	}
 
 	// Claim device
 	if (config_desc->bNumInterfaces != 1) {
 		u3_set_error(device, "Multiple USB configuration interfaces "
 			"not supported");
-		goto open_fail;
+		goto config_fail;
 	}
 	if (config_desc->interface->num_altsetting != 1) {
 		u3_set_error(device, "Multiple USB configuration interface "
 			" alt. settings not supported");
-		goto open_fail;
+		goto config_fail;
 	}
 	interface_desc = config_desc->interface->altsetting;
 	handle_wrapper->interface_num = interface_desc->bInterfaceNumber;
-	err = usb_detach_kernel_driver_np(handle_wrapper->handle, handle_wrapper->interface_num);
-	if (err != 0 && err != -61) {
-		u3_set_error(device, "failed to detach USB device with %s", strerror(errno));
-		goto open_fail;
+	if (libusb_kernel_driver_active(handle_wrapper->handle,
+			handle_wrapper->interface_num) == 1)
+	{
+		err = libusb_detach_kernel_driver(handle_wrapper->handle,
+				handle_wrapper->interface_num);
+		if (err != 0 && err != LIBUSB_ERROR_NOT_FOUND) {
+			u3_set_error(device, "failed to detach USB device "
+				"with %s", libusb_error_name(err));
+			goto config_fail;
+		}
 	}
 
-	if ((err=usb_claim_interface(handle_wrapper->handle,
+	if ((err=libusb_claim_interface(handle_wrapper->handle,
 				handle_wrapper->interface_num)) != 0)
 	{
-		if (err == -EBUSY) {
+		if (err == LIBUSB_ERROR_BUSY) {
 			// Don't try to detach driver on Linux, this can cause
 			// data loss and leaves the device in a unspecified
 			// state. The user should 'unbind' the driver through
 			// sysfs, or unload the usb-storage driver.
 			u3_set_error(device, "Failed to claim device: Device is busy");
-			goto open_fail;
+			goto config_fail;
 		} else {
-			u3_set_error(device, "Failed to claim device: %s", usb_strerror());
-			goto open_fail;
+			u3_set_error(device, "Failed to claim device: %s",
+				libusb_error_name(err));
+			goto config_fail;
 		}
 	}
 
 	// Set alt. setting
-	usb_set_altinterface(handle_wrapper->handle,
+	libusb_set_interface_alt_setting(handle_wrapper->handle,
+			handle_wrapper->interface_num,
 			interface_desc->bAlternateSetting);
 
 	// Find the correct endpoints
@@ -251,7 +649,7 @@ int u3_open(u3_handle_t *device, const char *which)
 	}
 	endpoint_desc = interface_desc->endpoint;
 
-	if (endpoint_desc[0].bEndpointAddress & USB_ENDPOINT_DIR_MASK) {
+	if (endpoint_desc[0].bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) {
 		handle_wrapper->ep_in  = endpoint_desc[0].bEndpointAddress;
 		handle_wrapper->ep_out = endpoint_desc[1].bEndpointAddress;
 	} else {
@@ -259,21 +657,40 @@ int u3_open(u3_handle_t *device, const char *which)
 		handle_wrapper->ep_in  = endpoint_desc[1].bEndpointAddress;
 	}
 
-	if (!((handle_wrapper->ep_in & USB_ENDPOINT_DIR_MASK) ^
-	     (handle_wrapper->ep_out & USB_ENDPOINT_DIR_MASK)))
+	if (!((handle_wrapper->ep_in & LIBUSB_ENDPOINT_DIR_MASK) ^
+	     (handle_wrapper->ep_out & LIBUSB_ENDPOINT_DIR_MASK)))
 	{
 		u3_set_error(device, "Both usb endpoints in same direction!");
 		goto claimed_fail;
 	}
 
+	// Allocate the transfers of all commands that can be in flight
+	for (i = 0; i < U3_MAX_QUEUE_DEPTH; i++) {
+		for (j = 0; j < USB_STAGES; j++) {
+			handle_wrapper->pending[i].transfers[j] =
+				libusb_alloc_transfer(0);
+			if (handle_wrapper->pending[i].transfers[j] == NULL) {
+				u3_set_error(device, "Failed allocate memory!!");
+				goto claimed_fail;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config_desc);
 	device->dev = handle_wrapper;
 	return U3_SUCCESS;
 claimed_fail:
-        usb_release_interface(handle_wrapper->handle,
+	free_transfers(handle_wrapper);
+	libusb_release_interface(handle_wrapper->handle,
 				handle_wrapper->interface_num);
+config_fail:
+	libusb_free_config_descriptor(config_desc);
 open_fail:
-	usb_close(handle_wrapper->handle);
+	if (handle_wrapper->handle != NULL)
+		libusb_close(handle_wrapper->handle);
 	free(handle_wrapper);
+init_fail:
+	context_put();
 	return U3_FAILURE;
 
 }
@@ -282,24 +699,108 @@ void u3_close(u3_handle_t *device)
 {
 	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
 
-        usb_release_interface(handle_wrapper->handle,
+	free_transfers(handle_wrapper);
+	libusb_release_interface(handle_wrapper->handle,
 				handle_wrapper->interface_num);
-        usb_close(handle_wrapper->handle);
+	libusb_close(handle_wrapper->handle);
+	context_put();
 	free(handle_wrapper);
 }
 
-int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
-		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
-		uint8_t *status)
+static void le32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * Completion callback of the transfers of a command
+ */
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer) {
+	struct usb_pending *entry = (struct usb_pending *) transfer->user_data;
+
+	if (transfer->status == LIBUSB_TRANSFER_STALL && entry->stalled == 0)
+		entry->stalled = transfer->endpoint;
+	if (--entry->pending == 0)
+		entry->completed = 1;
+}
+
+/**
+ * Reset the bulk only transport
+ *
+ * After a reset the device expects a new command block, the commands in
+ * flight before are lost.
+ */
+static void reset_recovery(u3_usb_handle_t *handle_wrapper) {
+	if (debug)
+		fprintf(stderr, "Resetting USB bulk only transport\n");
+
+	libusb_control_transfer(handle_wrapper->handle,
+		LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		MSC_REQUEST_RESET, 0, handle_wrapper->interface_num, NULL, 0,
+		U3_DEVICE_TIMEOUT);
+	libusb_clear_halt(handle_wrapper->handle, handle_wrapper->ep_in);
+	libusb_clear_halt(handle_wrapper->handle, handle_wrapper->ep_out);
+	handle_wrapper->resync = 0;
+}
+
+/**
+ * Find the command in flight with a tag
+ *
+ * @returns		Entry of the command, or NULL if no command has 'tag'
+ */
+static struct usb_pending *find_tag(u3_usb_handle_t *handle_wrapper,
+		uint32_t tag)
+{
+	int i;
+
+	for (i = 0; i < U3_MAX_QUEUE_DEPTH; i++) {
+		if (handle_wrapper->pending[i].cmd != NULL &&
+		    handle_wrapper->pending[i].tag == tag)
+			return &handle_wrapper->pending[i];
+	}
+	return NULL;
+}
+
+/**
+ * Submit the transfers of a command
+ *
+ * @returns		Entry of the command if successful, else NULL and an
+ * 			error string can be obtained using u3_error()
+ */
+static struct usb_pending *submit_cmd(u3_handle_t *device, struct u3_cmd *cmd)
 {
-	unsigned int tag = 1;
-	int res;
 	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
-        struct usb_msc_cbw cbw;
-        struct usb_msc_csw csw;
+	struct usb_pending *entry = NULL;
+	struct usb_msc_cbw *cbw;
+	struct timeval tv;
+	unsigned int timeout;
+	int dxfer_direction;
+	int dxfer_length;
+	int i;
+	int res;
+
+	if (handle_wrapper->inflight == 0 && handle_wrapper->resync)
+		reset_recovery(handle_wrapper);
+
+	for (i = 0; i < U3_MAX_QUEUE_DEPTH && entry == NULL; i++) {
+		if (handle_wrapper->pending[i].cmd == NULL)
+			entry = &handle_wrapper->pending[i];
+	}
+	if (entry == NULL) {
+		u3_set_error(device, "Failed executing scsi command: %u "
+			"commands in flight already", handle_wrapper->inflight);
+		return NULL;
+	}
 
 	// translate dxfer_direction
-	switch (dxfer_direction) {
+	dxfer_length = cmd->dxfer_length;
+	switch (cmd->dxfer_direction) {
 		case U3_DATA_TO_DEV:
 			dxfer_direction = CBW_DATA_OUT;
 			break;
@@ -313,79 +814,563 @@ int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
 			break;
 	}
 
-	// Prepare command
-	memset(&cbw, 0, sizeof(cbw));
-	cbw.dCBWSignature[0] = 'U';
-	cbw.dCBWSignature[1] = 'S';
-	cbw.dCBWSignature[2] = 'B';
-	cbw.dCBWSignature[3] = 'C';
-	cbw.dCBWDataTransferLength = dxfer_length;
-	cbw.bmCBWFlags = dxfer_direction & CBW_FLAG_DIRECTION;
-	cbw.dCBWTag = tag;
-	cbw.bCBWLUN = 1;
-	cbw.bCBWCBLength = U3_CBWCB_LEN;
-	memcpy(&(cbw.CBWCB), cmd, U3_CBWCB_LEN);
-
-	// send command
-        if ((res = usb_bulk_write(handle_wrapper->handle, handle_wrapper->ep_out,
-			(char *) &cbw, sizeof(cbw), U3_DEVICE_TIMEOUT))
-                        != sizeof(cbw))
-        {
+	// Prepare command, every command block gets a tag of its own
+	cbw = &entry->cbw;
+	memset(cbw, 0, sizeof(struct usb_msc_cbw));
+	cbw->dCBWSignature[0] = 'U';
+	cbw->dCBWSignature[1] = 'S';
+	cbw->dCBWSignature[2] = 'B';
+	cbw->dCBWSignature[3] = 'C';
+	le32(cbw->dCBWDataTransferLength, dxfer_length);
+	cbw->bmCBWFlags = dxfer_direction & CBW_FLAG_DIRECTION;
+	le32(cbw->dCBWTag, handle_wrapper->next_tag);
+	cbw->bCBWLUN = 1;
+	cbw->bCBWCBLength = U3_CBWCB_LEN;
+	memcpy(&(cbw->CBWCB), cmd->cmd, U3_CBWCB_LEN);
+
+	memset(&entry->csw, 0, sizeof(struct usb_msc_csw));
+	entry->tag = handle_wrapper->next_tag++;
+	entry->has_data = dxfer_length != 0;
+	entry->pending = 0;
+	entry->completed = 0;
+	entry->stalled = 0;
+	entry->csw_len = 0;
+
+	// Prepare transfers: command block, the data in one transfer, and
+	// the command status. Their timeouts run from now, while the device
+	// only takes the command block after the commands in flight, so each
+	// of those gets a timeout of its own.
+	timeout = U3_DEVICE_TIMEOUT * (handle_wrapper->inflight + 1);
+	libusb_fill_bulk_transfer(entry->transfers[USB_STAGE_CBW],
+		handle_wrapper->handle, handle_wrapper->ep_out,
+		(unsigned char *) cbw, sizeof(struct usb_msc_cbw),
+		transfer_done, entry, timeout);
+	libusb_fill_bulk_transfer(entry->transfers[USB_STAGE_DATA],
+		handle_wrapper->handle, dxfer_direction == CBW_DATA_IN ?
+		handle_wrapper->ep_in : handle_wrapper->ep_out,
+		cmd->dxfer_data, dxfer_length, transfer_done, entry,
+		timeout);
+	libusb_fill_bulk_transfer(entry->transfers[USB_STAGE_CSW],
+		handle_wrapper->handle, handle_wrapper->ep_in,
+		(unsigned char *) &entry->csw, sizeof(struct usb_msc_csw),
+		transfer_done, entry, timeout);
+
+	// Submit them back to back, a command without data has no data
+	// stage
+	res = 0;
+	for (i = 0; i < USB_STAGES && res == 0; i++) {
+		if (i == USB_STAGE_DATA && !entry->has_data)
+			continue;
+		if ((res = libusb_submit_transfer(entry->transfers[i])) == 0)
+			entry->pending++;
+	}
+	if (res != 0) {
 		u3_set_error(device, "Failed executing scsi command: "
-			"Could not write command block to device");
-		return U3_FAILURE;
-        }
-
-	// read/write extra command data
-	if (dxfer_direction == CBW_DATA_OUT) {
-		int bytes_send = 0;
-		while (bytes_send < dxfer_length) {
-			int plen;
-
-			plen = dxfer_length - bytes_send;
-			if (plen > USB_MAX_PACKET_LEN)
-				plen = USB_MAX_PACKET_LEN;
-
-			if ((res = usb_bulk_write(handle_wrapper->handle,
-					handle_wrapper->ep_out,
-					(char *) dxfer_data+bytes_send, plen,
-					U3_DEVICE_TIMEOUT)) < 0)
-			{
-				u3_set_error(device, "Failed executing scsi command: "
-					"Could not write data to device");
-				return U3_FAILURE;
-			}
+			"Could not submit transfer: %s", libusb_error_name(res));
 
-			bytes_send += plen;
+		// cancel the stages submitted already, the device may have
+		// taken part of the command
+		if (entry->pending > 0)
+			handle_wrapper->resync = 1;
+		while (i-- > 0)
+			libusb_cancel_transfer(entry->transfers[i]);
+		entry->completed = entry->pending == 0;
+		while (!entry->completed) {
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+			libusb_handle_events_timeout_completed(
+				handle_wrapper->ctx, &tv, &entry->completed);
 		}
-	} else if (dxfer_direction == CBW_DATA_IN) {
-		if ((res = usb_bulk_read(handle_wrapper->handle, handle_wrapper->ep_in,
-				(char *) dxfer_data, dxfer_length,
-				U3_DEVICE_TIMEOUT)) < 0)
+		return NULL;
+	}
+
+	entry->cmd = cmd;
+	entry->seq = handle_wrapper->next_seq++;
+	handle_wrapper->inflight++;
+	return entry;
+}
+
+/**
+ * Run the event loop till all transfers of a command completed
+ */
+static void wait_cmd(u3_usb_handle_t *handle_wrapper,
+		struct usb_pending *entry)
+{
+	struct timeval tv;
+
+	while (!entry->completed) {
+		if (entry->stalled) {
+			// The device refused the command block or data, it
+			// still reports the status once the endpoint is
+			// cleared
+			libusb_clear_halt(handle_wrapper->handle,
+					entry->stalled);
+			entry->stalled = 0;
+		}
+
+		// the transfers time out themselves, this only bounds
+		// every iteration
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		libusb_handle_events_timeout_completed(handle_wrapper->ctx,
+				&tv, &entry->completed);
+	}
+	entry->csw_len = entry->transfers[USB_STAGE_CSW]->actual_length;
+}
+
+/**
+ * Check the command status of a command
+ *
+ * @returns		U3_SUCCESS if the status belongs to the command, else
+ * 			U3_FAILURE and an error string is written to 'err_msg'
+ */
+static int check_csw(u3_usb_handle_t *handle_wrapper,
+		const struct usb_pending *entry, char *err_msg)
+{
+	const struct usb_msc_csw *csw = &entry->csw;
+	uint32_t tag = get_le32(csw->dCSWTag);
+
+	if (entry->csw_len != sizeof(struct usb_msc_csw) ||
+	    memcmp(csw->dCSWSignature, "USBS", 4) != 0)
+	{
+		snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing scsi "
+			"command: Invalid command status received");
+		return U3_FAILURE;
+	}
+	if (tag != entry->tag) {
+		if (find_tag(handle_wrapper, tag) != NULL) {
+			snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+				"scsi command: Received status of command %u "
+				"instead of command %u", tag, entry->tag);
+		} else {
+			snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+				"scsi command: Received status with unknown "
+				"tag %u for command %u", tag, entry->tag);
+		}
+		return U3_FAILURE;
+	}
+	if (csw->bCSWStatus == CSW_STATUS_PHASE_ERROR) {
+		snprintf(err_msg, U3_MAX_ERROR_LEN, "Failed executing scsi "
+			"command: Phase error");
+		return U3_FAILURE;
+	}
+
+	return U3_SUCCESS;
+}
+
+/**
+ * Evaluate the transfers of a completed command and release its entry
+ *
+ * The result, status and error string are stored in the command. On
+ * errors the transport is reset once no commands are in flight.
+ *
+ * @returns		The command
+ */
+static struct u3_cmd *finish_cmd(u3_usb_handle_t *handle_wrapper,
+		struct usb_pending *entry)
+{
+	struct libusb_transfer **transfers = entry->transfers;
+	struct u3_cmd *cmd = entry->cmd;
+	int transferred;
+	int data_stalled;
+
+	cmd->result = U3_FAILURE;
+	cmd->status = 0;
+	cmd->err_msg[0] = '\0';
+	data_stalled = entry->has_data &&
+		transfers[USB_STAGE_DATA]->status == LIBUSB_TRANSFER_STALL;
+
+	if (transfers[USB_STAGE_CBW]->status != LIBUSB_TRANSFER_COMPLETED ||
+	    transfers[USB_STAGE_CBW]->actual_length !=
+	    sizeof(struct usb_msc_cbw))
+	{
+		snprintf(cmd->err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+			"scsi command: Could not write command block to "
+			"device");
+	} else if (entry->has_data && !data_stalled &&
+		   transfers[USB_STAGE_DATA]->status !=
+		   LIBUSB_TRANSFER_COMPLETED)
+	{
+		snprintf(cmd->err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+			"scsi command: Could not %s device",
+			cmd->dxfer_direction == U3_DATA_FROM_DEV ?
+			"read data from" : "write data to");
+	} else if (transfers[USB_STAGE_CSW]->status !=
+		   LIBUSB_TRANSFER_COMPLETED &&
+		   (!data_stalled || handle_wrapper->inflight > 1 ||
+		    libusb_bulk_transfer(handle_wrapper->handle,
+			handle_wrapper->ep_in, (unsigned char *) &entry->csw,
+			sizeof(struct usb_msc_csw), &transferred,
+			U3_DEVICE_TIMEOUT) != 0))
+	{
+		// The status transfer queued behind a stalled data stage may
+		// have failed too, it is read again if no other command
+		// follows
+		snprintf(cmd->err_msg, U3_MAX_ERROR_LEN, "Failed executing "
+			"scsi command: Could not read command status from "
+			"device");
+	} else {
+		if (transfers[USB_STAGE_CSW]->status !=
+		    LIBUSB_TRANSFER_COMPLETED)
+			entry->csw_len = transferred;
+		if (check_csw(handle_wrapper, entry, cmd->err_msg) ==
+		    U3_SUCCESS)
 		{
-			u3_set_error(device, "Failed executing scsi command: "
-				"Could not read data from device");
-			return U3_FAILURE;
+			cmd->result = U3_SUCCESS;
+			cmd->status = entry->csw.bCSWStatus;
 		}
 	}
 
-	memset(&csw, 0, sizeof(csw));
+	if (cmd->result != U3_SUCCESS)
+		handle_wrapper->resync = 1;
 
-	// read command status
-        if ((res = usb_bulk_read(handle_wrapper->handle, handle_wrapper->ep_in,
-			(char *) &csw, sizeof(csw), U3_DEVICE_TIMEOUT))
-                        < 0)
-        {
-		u3_set_error(device, "Failed executing scsi command: "
-			"Could not read command status from device");
+	entry->cmd = NULL;
+	handle_wrapper->inflight--;
+	return cmd;
+}
+
+int u3_subsys_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		uint8_t *status)
+{
+	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
+	struct usb_pending *entry;
+	struct u3_cmd command;
+
+	memcpy(command.cmd, cmd, U3_CMD_LEN);
+	command.dxfer_direction = dxfer_direction;
+	command.dxfer_length = dxfer_length;
+	command.dxfer_data = dxfer_data;
+
+	if ((entry = submit_cmd(device, &command)) == NULL)
 		return U3_FAILURE;
-        }
 
-	assert(tag == csw.dCSWTag);
-	tag++;
-        *status = csw.bCSWStatus;
+	wait_cmd(handle_wrapper, entry);
+	finish_cmd(handle_wrapper, entry);
+	if (command.result != U3_SUCCESS) {
+		u3_set_error(device, "%s", command.err_msg);
+		return U3_FAILURE;
+	}
 
+	*status = command.status;
 	return U3_SUCCESS;
 }
 
+/**
+ * Queue an event, the watch lock must be held
+ *
+ * @returns		1 if the event was queued, 0 if the queue is full
+ */
+static int queue_event(struct usb_watch *usb_watch, int event,
+	libusb_device *dev)
+{
+	if (usb_watch->n_events == USB_WATCH_QUEUE) {
+		usb_watch->lost = 1;
+		return 0;
+	}
+
+	usb_watch->events[usb_watch->n_events].event = event;
+	usb_watch->events[usb_watch->n_events].dev = libusb_ref_device(dev);
+	usb_watch->n_events++;
+	return 1;
+}
+
+/**
+ * Queue a device arriving or leaving, called by libusb
+ */
+static int LIBUSB_CALL hotplug_event(libusb_context *ctx, libusb_device *dev,
+		libusb_hotplug_event event, void *user_data)
+{
+	struct usb_watch *usb_watch = (struct usb_watch *) user_data;
+	struct libusb_device_descriptor desc;
+
+	(void) ctx;
+
+	// the descriptor is cached by libusb, this doesn't do I/O
+	if (libusb_get_device_descriptor(dev, &desc) != 0 ||
+	    !id_known(desc.idVendor, desc.idProduct))
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&usb_watch->lock);
+	queue_event(usb_watch, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+		U3_WATCH_ARRIVED : U3_WATCH_LEFT, dev);
+	pthread_mutex_unlock(&usb_watch->lock);
+
+	// stay registered
+	return 0;
+}
+
+/**
+ * Name a device that arrived or look up the name of a device that left
+ *
+ * @param usb_watch	Watch
+ * @param event		U3_WATCH_ARRIVED or U3_WATCH_LEFT
+ * @param dev		Device, the reference is taken over
+ * @param name		Buffer to return the name in
+ * @param len		Size of 'name'
+ *
+ * @returns		1 if the event is reported, 0 if the device
+ * 			is unknown
+ */
+static int name_device(struct usb_watch *usb_watch, int event,
+	libusb_device *dev, char *name, size_t len)
+{
+	struct libusb_device_descriptor desc;
+	int i;
+
+	for (i = 0; i < usb_watch->n_named; i++) {
+		if (usb_watch->named[i].dev == dev)
+			break;
+	}
+
+	if (event == U3_WATCH_LEFT) {
+		libusb_unref_device(dev);
+		if (i == usb_watch->n_named)
+			return 0;
+
+		snprintf(name, len, "%s", usb_watch->named[i].name);
+		libusb_unref_device(usb_watch->named[i].dev);
+		usb_watch->named[i] = usb_watch->named[--usb_watch->n_named];
+		return 1;
+	}
+
+	// a device is queued again by rescan()
+	if (i < usb_watch->n_named || usb_watch->n_named == USB_MAX_FOUND) {
+		libusb_unref_device(dev);
+		return 0;
+	}
+
+	// the serial number tells devices of the same type apart
+	libusb_get_device_descriptor(dev, &desc);
+	i = usb_watch->n_named++;
+	usb_watch->named[i].dev = dev;
+	read_serial(dev, desc.iSerialNumber, usb_watch->named[i].name);
+	if (usb_watch->named[i].name[0] == '\0') {
+		snprintf(usb_watch->named[i].name, USB_SERIAL_LEN, "%.4x:%.4x",
+			desc.idVendor, desc.idProduct);
+	}
+	snprintf(name, len, "%s", usb_watch->named[i].name);
+	return 1;
+}
+
+/**
+ * Queue the changes missed while events were lost
+ *
+ * Known devices on the bus that weren't reported are queued as arrived,
+ * reported devices that are gone as left.
+ *
+ * @returns		U3_SUCCESS if successful, else U3_FAILURE and an
+ * 			error string can be obtained using u3_error()
+ */
+static int rescan(u3_handle_t *watch)
+{
+	struct usb_watch *usb_watch = (struct usb_watch *) watch->dev;
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	ssize_t cnt, i;
+	int j;
+
+	// A device arriving meanwhile is queued by the callback too, it's
+	// named once.
+	if ((cnt = libusb_get_device_list(discovery.ctx, &list)) < 0) {
+		u3_set_error(watch, "Failed listing USB devices: %s",
+			libusb_error_name(cnt));
+		return U3_FAILURE;
+	}
+
+	pthread_mutex_lock(&usb_watch->lock);
+	usb_watch->lost = 0;
+	for (j = 0; j < usb_watch->n_named; j++) {
+		for (i = 0; i < cnt; i++) {
+			if (list[i] == usb_watch->named[j].dev)
+				break;
+		}
+		if (i == cnt && !queue_event(usb_watch, U3_WATCH_LEFT,
+				usb_watch->named[j].dev))
+			break;
+	}
+	for (i = 0; i < cnt && !usb_watch->lost; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+		    !id_known(desc.idVendor, desc.idProduct))
+			continue;
+		for (j = 0; j < usb_watch->n_named; j++) {
+			if (usb_watch->named[j].dev == list[i])
+				break;
+		}
+		if (j == usb_watch->n_named)
+			queue_event(usb_watch, U3_WATCH_ARRIVED, list[i]);
+	}
+	pthread_mutex_unlock(&usb_watch->lock);
+
+	libusb_free_device_list(list, 1);
+	return U3_SUCCESS;
+}
+
+int u3_watch_open(u3_handle_t *watch)
+{
+	struct usb_watch *usb_watch;
+	int err;
+
+	u3_set_error(watch, "");
+	watch->dev = NULL;
+
+	pthread_mutex_lock(&discovery.lock);
+	if (context_get(watch) != U3_SUCCESS) {
+		pthread_mutex_unlock(&discovery.lock);
+		return U3_FAILURE;
+	}
+	// hotplug callbacks only read the table
+	if (!discovery.hashed)
+		hash_ids();
+	pthread_mutex_unlock(&discovery.lock);
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		u3_set_error(watch, "Watching for devices is not supported by "
+			"libusb on this platform");
+		context_put();
+		return U3_FAILURE;
+	}
+
+	usb_watch = (struct usb_watch *) calloc(1, sizeof(struct usb_watch));
+	if (usb_watch == NULL) {
+		u3_set_error(watch, "Failed allocate memory!!");
+		context_put();
+		return U3_FAILURE;
+	}
+	pthread_mutex_init(&usb_watch->lock, NULL);
+
+	// devices present are reported as arrived by the registration
+	err = libusb_hotplug_register_callback(discovery.ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, hotplug_event, usb_watch,
+		&usb_watch->callback);
+	if (err != 0) {
+		u3_set_error(watch, "Failed watching for devices: %s",
+			libusb_error_name(err));
+		pthread_mutex_destroy(&usb_watch->lock);
+		free(usb_watch);
+		context_put();
+		return U3_FAILURE;
+	}
+
+	watch->dev = usb_watch;
+	return U3_SUCCESS;
+}
+
+int u3_watch_next(u3_handle_t *watch, char *name, size_t len, int timeout)
+{
+	struct usb_watch *usb_watch = (struct usb_watch *) watch->dev;
+	libusb_device *dev = NULL;
+	struct timeval tv;
+	int waited = 0;
+	int event;
+	int lost;
+
+	for (;;) {
+		pthread_mutex_lock(&usb_watch->lock);
+		lost = usb_watch->lost;
+		event = U3_WATCH_TIMEOUT;
+		if (usb_watch->n_events > 0) {
+			event = usb_watch->events[0].event;
+			dev = usb_watch->events[0].dev;
+			usb_watch->n_events--;
+			memmove(usb_watch->events, usb_watch->events + 1,
+				usb_watch->n_events *
+				sizeof(usb_watch->events[0]));
+		}
+		pthread_mutex_unlock(&usb_watch->lock);
+
+		if (event != U3_WATCH_TIMEOUT) {
+			if (name_device(usb_watch, event, dev, name, len))
+				return event;
+			continue;
+		}
+
+		// Events were lost while the queue was full. Once it's empty
+		// the bus is compared with the devices reported.
+		if (lost) {
+			if (rescan(watch) != U3_SUCCESS)
+				return U3_FAILURE;
+			continue;
+		}
+		if (waited)
+			return U3_WATCH_TIMEOUT;
+
+		// the callback runs from here, or in a thread sending commands
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		libusb_handle_events_timeout_completed(discovery.ctx, &tv,
+			NULL);
+		waited = 1;
+	}
+}
+
+void u3_watch_close(u3_handle_t *watch)
+{
+	struct usb_watch *usb_watch = (struct usb_watch *) watch->dev;
+	int i;
+
+	libusb_hotplug_deregister_callback(discovery.ctx,
+		usb_watch->callback);
+	for (i = 0; i < usb_watch->n_events; i++)
+		libusb_unref_device(usb_watch->events[i].dev);
+	for (i = 0; i < usb_watch->n_named; i++)
+		libusb_unref_device(usb_watch->named[i].dev);
+	pthread_mutex_destroy(&usb_watch->lock);
+	free(usb_watch);
+	context_put();
+}
+
+unsigned int u3_subsys_set_queue_depth(u3_handle_t *device,
+		unsigned int depth)
+{
+	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
+
+	if (depth > U3_MAX_QUEUE_DEPTH)
+		depth = U3_MAX_QUEUE_DEPTH;
+
+	handle_wrapper->depth = depth;
+	return depth;
+}
+
+int u3_subsys_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd) {
+	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
+
+	if (handle_wrapper->inflight >= handle_wrapper->depth) {
+		u3_set_error(device, "Failed submitting scsi command: %u "
+			"commands in flight already", handle_wrapper->inflight);
+		return U3_FAILURE;
+	}
+
+	if (submit_cmd(device, cmd) == NULL)
+		return U3_FAILURE;
+	return U3_SUCCESS;
+}
+
+struct u3_cmd *u3_subsys_reap_cmd(u3_handle_t *device) {
+	u3_usb_handle_t *handle_wrapper = (u3_usb_handle_t *) device->dev;
+	struct usb_pending *entry = NULL;
+	int i;
+
+	if (handle_wrapper->inflight == 0) {
+		u3_set_error(device, "No scsi command in flight");
+		return NULL;
+	}
+
+	// the bulk endpoints complete commands in order, wait for the oldest
+	for (i = 0; i < U3_MAX_QUEUE_DEPTH; i++) {
+		if (handle_wrapper->pending[i].cmd != NULL &&
+		    (entry == NULL ||
+		     handle_wrapper->pending[i].seq < entry->seq))
+			entry = &handle_wrapper->pending[i];
+	}
+
+	wait_cmd(handle_wrapper, entry);
+	return finish_cmd(handle_wrapper, entry);
+}
+
 #endif //SUBSYS_LIBUSB
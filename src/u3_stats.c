@@ -0,0 +1,456 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "u3_stats.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define MAX_OPCODES	32		// distinct opcodes recorded
+#define KEY_OTHER	0xFFFF		// key of opcodes that didn't fit
+#define VENDOR_OPCODE	0xFF		// first CDB byte of U3 commands
+
+/**
+ * Latency histogram
+ */
+struct histogram {
+	uint64_t	count;		// number of values
+	uint64_t	sum;		// sum of values
+	uint64_t	min;		// smallest value
+	uint64_t	max;		// largest value
+	uint32_t	buckets[U3_STATS_BUCKETS];
+};
+
+/**
+ * Statistics of one opcode
+ */
+struct opcode_stats {
+	unsigned int	key;		// opcode, see opcode_key()
+	uint64_t	failures;	// subsystem returned U3_FAILURE
+	uint64_t	bad_status;	// device returned a non zero status
+	uint64_t	retries;	// commands resent by the subsystem
+	uint64_t	bytes_to_dev;	// data sent to the device
+	uint64_t	bytes_from_dev;	// data read from the device
+	struct histogram latency;	// time per command in microseconds
+};
+
+/**
+ * Names of known opcodes
+ */
+static const struct {
+	unsigned int	key;
+	const char	*name;
+} opcode_names[] = {
+	{ 0x0025,	"read capacity" },
+	{ 0x0028,	"read(10)" },
+	{ 0xFF00,	"read property" },
+	{ 0xFF01,	"reset" },
+	{ 0xFF03,	"chip info" },
+	{ 0xFF20,	"partition round" },
+	{ 0xFF21,	"partition info" },
+	{ 0xFF22,	"partition" },
+	{ 0xFF42,	"cd write" },
+	{ 0xFFA0,	"data part. info" },
+	{ 0xFFA2,	"enable security" },
+	{ 0xFFA3,	"security round" },
+	{ 0xFFA4,	"unlock" },
+	{ 0xFFA6,	"change password" },
+	{ 0xFFA7,	"disable security" },
+};
+
+static struct {
+	pthread_mutex_t	lock;
+	struct opcode_stats opcodes[MAX_OPCODES];
+	unsigned int	n_opcodes;
+	uint64_t	first_start;	// start of first command
+	uint64_t	busy_until;	// end of last command
+	uint64_t	busy;		// time at least one command ran
+	struct histogram gaps;		// time between commands
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/********************************* Histograms *********************************/
+
+/**
+ * Get bucket of a value
+ *
+ * Values below U3_STATS_SUB_BUCKETS have a bucket of their own. Larger
+ * values in [2^m, 2^(m+1)) are split into U3_STATS_SUB_BUCKETS buckets of
+ * 2^(m - U3_STATS_SUB_BITS) wide.
+ */
+static unsigned int bucket_index(uint64_t value) {
+	unsigned int msb = 0;
+
+	if (value < U3_STATS_SUB_BUCKETS)
+		return value;
+
+	while ((value >> msb) > 1)
+		msb++;
+
+	return (msb - U3_STATS_SUB_BITS + 1) * U3_STATS_SUB_BUCKETS +
+		(value >> (msb - U3_STATS_SUB_BITS)) - U3_STATS_SUB_BUCKETS;
+}
+
+/**
+ * Get middle of the value range of a bucket
+ */
+static uint64_t bucket_value(unsigned int index) {
+	unsigned int group = index / U3_STATS_SUB_BUCKETS;
+	unsigned int sub = index % U3_STATS_SUB_BUCKETS;
+	unsigned int shift;
+
+	if (group == 0)
+		return sub;
+
+	shift = group - 1;
+	return ((uint64_t) (U3_STATS_SUB_BUCKETS + sub) << shift) +
+		((1ULL << shift) >> 1);
+}
+
+static void histogram_add(struct histogram *hist, uint64_t value) {
+	if (hist->count == 0 || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[bucket_index(value)]++;
+}
+
+/**
+ * Get percentile of histogram
+ *
+ * @param hist		Histogram
+ * @param percent	Percentile, 0 to 100
+ *
+ * @returns		Approximate value, within [min, max]
+ */
+static uint64_t histogram_percentile(const struct histogram *hist,
+		double percent)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t) (percent / 100 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < U3_STATS_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	value = bucket_value(i);
+	if (value < hist->min)
+		value = hist->min;
+	if (value > hist->max)
+		value = hist->max;
+	return value;
+}
+
+/********************************* Recording **********************************/
+
+/**
+ * Get key of the opcode of a CDB
+ *
+ * U3 commands all share one SCSI opcode and are told apart by the second
+ * byte, so they are keyed by both bytes.
+ */
+static unsigned int opcode_key(const uint8_t cmd[U3_CMD_LEN]) {
+	if (cmd[0] == VENDOR_OPCODE)
+		return (VENDOR_OPCODE << 8) | cmd[1];
+	return cmd[0];
+}
+
+/**
+ * Find statistics of an opcode, adding them if needed
+ *
+ * The lock must be held.
+ */
+static struct opcode_stats *find_opcode(const uint8_t cmd[U3_CMD_LEN]) {
+	unsigned int key = opcode_key(cmd);
+	unsigned int i;
+
+	for (i = 0; i < stats.n_opcodes; i++) {
+		if (stats.opcodes[i].key == key)
+			return &stats.opcodes[i];
+	}
+
+	// keep the last slot for everything that doesn't fit
+	if (stats.n_opcodes == MAX_OPCODES - 1)
+		key = KEY_OTHER;
+	if (stats.n_opcodes == MAX_OPCODES)
+		return &stats.opcodes[MAX_OPCODES - 1];
+
+	stats.opcodes[stats.n_opcodes].key = key;
+	return &stats.opcodes[stats.n_opcodes++];
+}
+
+uint64_t u3_stats_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#endif
+	struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void u3_stats_record(const uint8_t cmd[U3_CMD_LEN], int dxfer_direction,
+		int dxfer_length, uint64_t start_us, uint64_t end_us,
+		int result, uint8_t status)
+{
+	struct opcode_stats *op;
+
+	if (end_us < start_us)
+		end_us = start_us;
+
+	pthread_mutex_lock(&stats.lock);
+
+	op = find_opcode(cmd);
+	histogram_add(&op->latency, end_us - start_us);
+	if (result != U3_SUCCESS) {
+		op->failures++;
+	} else {
+		if (status != 0)
+			op->bad_status++;
+		if (dxfer_direction == U3_DATA_TO_DEV)
+			op->bytes_to_dev += dxfer_length;
+		else if (dxfer_direction == U3_DATA_FROM_DEV)
+			op->bytes_from_dev += dxfer_length;
+	}
+
+	// Track the union of command intervals, commands of several threads
+	// may overlap. What is left of the wall time is host time.
+	if (stats.busy_until == 0) {
+		stats.first_start = start_us;
+		stats.busy += end_us - start_us;
+		stats.busy_until = end_us;
+	} else if (start_us >= stats.busy_until) {
+		histogram_add(&stats.gaps, start_us - stats.busy_until);
+		stats.busy += end_us - start_us;
+		stats.busy_until = end_us;
+	} else if (end_us > stats.busy_until) {
+		stats.busy += end_us - stats.busy_until;
+		stats.busy_until = end_us;
+	}
+
+	pthread_mutex_unlock(&stats.lock);
+}
+
+void u3_stats_retry(const uint8_t cmd[U3_CMD_LEN]) {
+	pthread_mutex_lock(&stats.lock);
+	find_opcode(cmd)->retries++;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+int u3_send_cmd(u3_handle_t *device, uint8_t cmd[U3_CMD_LEN],
+		int dxfer_direction, int dxfer_length, uint8_t *dxfer_data,
+		uint8_t *status)
+{
+	uint64_t start;
+	int retval;
+
+	start = u3_stats_now();
+	retval = u3_subsys_send_cmd(device, cmd, dxfer_direction,
+			dxfer_length, dxfer_data, status);
+	u3_stats_record(cmd, dxfer_direction, dxfer_length, start,
+			u3_stats_now(), retval,
+			retval == U3_SUCCESS ? *status : 0);
+
+	return retval;
+}
+
+unsigned int u3_set_queue_depth(u3_handle_t *device, unsigned int depth) {
+	if (depth > U3_MAX_QUEUE_DEPTH)
+		depth = U3_MAX_QUEUE_DEPTH;
+	return u3_subsys_set_queue_depth(device, depth);
+}
+
+int u3_submit_cmd(u3_handle_t *device, struct u3_cmd *cmd) {
+	int retval;
+
+	cmd->start = u3_stats_now();
+	retval = u3_subsys_submit_cmd(device, cmd);
+	if (retval != U3_SUCCESS) {
+		u3_stats_record(cmd->cmd, cmd->dxfer_direction,
+				cmd->dxfer_length, cmd->start, u3_stats_now(),
+				U3_FAILURE, 0);
+	}
+
+	return retval;
+}
+
+struct u3_cmd *u3_reap_cmd(u3_handle_t *device) {
+	struct u3_cmd *cmd;
+
+	cmd = u3_subsys_reap_cmd(device);
+	if (cmd != NULL) {
+		u3_stats_record(cmd->cmd, cmd->dxfer_direction,
+				cmd->dxfer_length, cmd->start, u3_stats_now(),
+				cmd->result,
+				cmd->result == U3_SUCCESS ? cmd->status : 0);
+	}
+
+	return cmd;
+}
+
+/********************************** Output ************************************/
+
+static const char *opcode_name(unsigned int key) {
+	unsigned int i;
+
+	if (key == KEY_OTHER)
+		return "other";
+
+	for (i = 0; i < sizeof(opcode_names) / sizeof(opcode_names[0]); i++) {
+		if (opcode_names[i].key == key)
+			return opcode_names[i].name;
+	}
+	return "";
+}
+
+static void format_opcode(char *buf, size_t len, unsigned int key) {
+	if (key == KEY_OTHER)
+		snprintf(buf, len, "-");
+	else if (key > 0xFF)
+		snprintf(buf, len, "%.2X %.2X", (key >> 8) & 0xFF, key & 0xFF);
+	else
+		snprintf(buf, len, "%.2X", key);
+}
+
+static void print_text(FILE *fp) {
+	const struct opcode_stats *op;
+	const struct histogram *h;
+	uint64_t wall;
+	unsigned int i;
+	char opcode[8];
+
+	fprintf(fp, "Command statistics (%s), latency in microseconds:\n",
+		u3_subsystem_name);
+	fprintf(fp, "%-5s %-16s %7s %4s %4s %4s %10s %10s %7s %7s %7s %7s "
+		"%7s %7s %7s\n", "op", "command", "calls", "fail", "stat",
+		"rtry", "bytes out", "bytes in", "min", "mean", "p50",
+		"p90", "p99", "p99.9", "max");
+
+	for (i = 0; i < stats.n_opcodes; i++) {
+		op = &stats.opcodes[i];
+		h = &op->latency;
+		format_opcode(opcode, sizeof(opcode), op->key);
+		fprintf(fp, "%-5s %-16s %7llu %4llu %4llu %4llu %10llu %10llu "
+			"%7llu %7llu %7llu %7llu %7llu %7llu %7llu\n",
+			opcode, opcode_name(op->key),
+			(unsigned long long) h->count,
+			(unsigned long long) op->failures,
+			(unsigned long long) op->bad_status,
+			(unsigned long long) op->retries,
+			(unsigned long long) op->bytes_to_dev,
+			(unsigned long long) op->bytes_from_dev,
+			(unsigned long long) h->min,
+			(unsigned long long) (h->count ? h->sum / h->count : 0),
+			(unsigned long long) histogram_percentile(h, 50),
+			(unsigned long long) histogram_percentile(h, 90),
+			(unsigned long long) histogram_percentile(h, 99),
+			(unsigned long long) histogram_percentile(h, 99.9),
+			(unsigned long long) h->max);
+	}
+
+	wall = stats.busy_until - stats.first_start;
+	fprintf(fp, "Time in commands: %.3f s, between commands: %.3f s "
+		"(%.1f%% host)\n", stats.busy / 1e6, (wall - stats.busy) / 1e6,
+		wall ? (wall - stats.busy) * 100.0 / wall : 0.0);
+	if (stats.gaps.count > 0) {
+		fprintf(fp, "Gaps between commands: p50 %llu us, p99 %llu us, "
+			"max %llu us\n",
+			(unsigned long long) histogram_percentile(&stats.gaps, 50),
+			(unsigned long long) histogram_percentile(&stats.gaps, 99),
+			(unsigned long long) stats.gaps.max);
+	}
+}
+
+static void print_json_histogram(FILE *fp, const struct histogram *h) {
+	fprintf(fp, "\"count\": %llu, \"min_us\": %llu, \"mean_us\": %llu, "
+		"\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, "
+		"\"p999_us\": %llu, \"max_us\": %llu, \"total_us\": %llu",
+		(unsigned long long) h->count,
+		(unsigned long long) h->min,
+		(unsigned long long) (h->count ? h->sum / h->count : 0),
+		(unsigned long long) histogram_percentile(h, 50),
+		(unsigned long long) histogram_percentile(h, 90),
+		(unsigned long long) histogram_percentile(h, 99),
+		(unsigned long long) histogram_percentile(h, 99.9),
+		(unsigned long long) h->max,
+		(unsigned long long) h->sum);
+}
+
+static void print_json(FILE *fp) {
+	const struct opcode_stats *op;
+	unsigned int i;
+	char opcode[8];
+
+	fprintf(fp, "{\"subsystem\": \"%s\", \"commands\": [",
+		u3_subsystem_name);
+	for (i = 0; i < stats.n_opcodes; i++) {
+		op = &stats.opcodes[i];
+		format_opcode(opcode, sizeof(opcode), op->key);
+		fprintf(fp, "%s\n  {\"opcode\": \"%s\", \"name\": \"%s\", "
+			"\"failures\": %llu, \"bad_status\": %llu, "
+			"\"retries\": %llu, \"bytes_to_device\": %llu, "
+			"\"bytes_from_device\": %llu, ", i ? "," : "",
+			opcode, opcode_name(op->key),
+			(unsigned long long) op->failures,
+			(unsigned long long) op->bad_status,
+			(unsigned long long) op->retries,
+			(unsigned long long) op->bytes_to_dev,
+			(unsigned long long) op->bytes_from_dev);
+		print_json_histogram(fp, &op->latency);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "],\n \"device_us\": %llu, \"host_us\": %llu,\n"
+		" \"gaps\": {", (unsigned long long) stats.busy,
+		(unsigned long long) (stats.busy_until - stats.first_start -
+				stats.busy));
+	print_json_histogram(fp, &stats.gaps);
+	fprintf(fp, "}}\n");
+}
+
+void u3_stats_print(FILE *fp, enum u3_stats_format format) {
+	pthread_mutex_lock(&stats.lock);
+	if (format == U3_STATS_TEXT)
+		print_text(fp);
+	else if (format == U3_STATS_JSON)
+		print_json(fp);
+	pthread_mutex_unlock(&stats.lock);
+}
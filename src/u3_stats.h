@@ -0,0 +1,99 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __U3_STATS_H__
+#define __U3_STATS_H__
+/**
+ * @file	u3_stats.h
+ *
+ *		Statistics of the commands sent to the device. Every command
+ *		passes through u3_send_cmd(), which times the subsystem call and
+ *		records it per opcode: call count, failures, bytes moved and a
+ *		latency histogram.
+ *
+ *		The histograms are log-linear like HDR histograms: every power
+ *		of two range of microseconds is split into
+ *		U3_STATS_SUB_BUCKETS linear buckets, so percentiles have a
+ *		relative error below 1 / U3_STATS_SUB_BUCKETS.
+ *
+ *		Besides the time spent in commands, the time between commands
+ *		is recorded. That is time spent by u3-tool itself, so it tells
+ *		a slow host from a slow device.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "u3.h"
+#include "u3_scsi.h"
+
+#define U3_STATS_SUB_BITS	3
+#define U3_STATS_SUB_BUCKETS	(1 << U3_STATS_SUB_BITS)
+#define U3_STATS_BUCKETS	(U3_STATS_SUB_BUCKETS * (64 - U3_STATS_SUB_BITS + 1))
+
+/**
+ * Output format of statistics
+ */
+enum u3_stats_format {
+	U3_STATS_NONE = 0,	// don't print statistics
+	U3_STATS_TEXT = 1,	// human readable table
+	U3_STATS_JSON = 2,	// JSON object
+};
+
+/**
+ * Record a command
+ *
+ * This is called by u3_send_cmd() for every command. Subsystems that send
+ * commands of their own can use it as well.
+ *
+ * @param cmd			SCSI CDB
+ * @param dxfer_direction	Direction of extra data, U3_DATA_*
+ * @param dxfer_length		Length of extra data
+ * @param start_us		Start time, see u3_stats_now()
+ * @param end_us		End time, see u3_stats_now()
+ * @param result		U3_SUCCESS or U3_FAILURE
+ * @param status		SCSI status returned by the device
+ */
+void u3_stats_record(const uint8_t cmd[U3_CMD_LEN], int dxfer_direction,
+		int dxfer_length, uint64_t start_us, uint64_t end_us,
+		int result, uint8_t status);
+
+/**
+ * Record a retry of a command
+ *
+ * Subsystems call this when they resend a command, for example after a busy
+ * status.
+ *
+ * @param cmd			SCSI CDB
+ */
+void u3_stats_retry(const uint8_t cmd[U3_CMD_LEN]);
+
+/**
+ * Get monotonic time in microseconds
+ */
+uint64_t u3_stats_now(void);
+
+/**
+ * Print statistics
+ *
+ * @param fp		Stream to print to
+ * @param format	Output format
+ */
+void u3_stats_print(FILE *fp, enum u3_stats_format format);
+
+#endif // __U3_STATS_H__
@@ -0,0 +1,261 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if defined(SUBSYS_SG) || defined(SUBSYS_BSG)
+#include "u3_scsi.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+
+#include <linux/netlink.h>
+
+#include "uevent.h"
+
+#define UEVENT_GROUP_KERNEL	1	// multicast group of kernel uevents
+#define UEVENT_RCVBUF	(1024 * 1024)	// a stick causes dozens of events, keep
+					// a burst of sticks from overflowing
+
+/**
+ * Check if an event is about a USB device of the class arriving or leaving
+ *
+ * @param vars		KEY=value strings of the event, NUL separated
+ * @param len		Length of 'vars'
+ * @param class		Device class watched
+ * @param action	Action if the event doesn't contain one, or NULL
+ * @param devpath	Path of the device if the event doesn't contain one,
+ * 			or NULL
+ * @param name		Buffer to return the device node in
+ * @param name_len	Size of 'name'
+ *
+ * @returns		One of the U3_WATCH_* enum values
+ */
+static int parse_event(const char *vars, size_t len, const char *class,
+	const char *action, const char *devpath, char *name, size_t name_len)
+{
+	const char *subsystem = class;
+	const char *devname = NULL;
+	const char *var;
+
+	for (var = vars; var < vars + len; var += strlen(var) + 1) {
+		if (strncmp(var, "ACTION=", 7) == 0)
+			action = var + 7;
+		else if (strncmp(var, "SUBSYSTEM=", 10) == 0)
+			subsystem = var + 10;
+		else if (strncmp(var, "DEVPATH=", 8) == 0)
+			devpath = var + 8;
+		else if (strncmp(var, "DEVNAME=", 8) == 0)
+			devname = var + 8;
+	}
+
+	if (action == NULL || devpath == NULL || devname == NULL ||
+	    strcmp(subsystem, class) != 0)
+	{
+		return U3_WATCH_TIMEOUT;
+	}
+	// only devices behind a USB host controller can be U3 devices
+	if (strstr(devpath, "/usb") == NULL)
+		return U3_WATCH_TIMEOUT;
+
+	// devtmpfs creates the node before the event is sent
+	snprintf(name, name_len, "/dev/%s", devname);
+	if (strcmp(action, "add") == 0)
+		return U3_WATCH_ARRIVED;
+	if (strcmp(action, "remove") == 0)
+		return U3_WATCH_LEFT;
+	return U3_WATCH_TIMEOUT;
+}
+
+/**
+ * Start reporting the devices present as arrived
+ *
+ * The class is missing if the driver isn't loaded yet, then there are none.
+ */
+static void scan_present(struct uevent_watch *watch) {
+	char path[PATH_MAX];
+
+	if (watch->present != NULL)
+		closedir(watch->present);
+
+	snprintf(path, sizeof(path), "/sys/class/%s", watch->class);
+	watch->present = opendir(path);
+}
+
+/**
+ * Report the next device present when the watch was opened, or when
+ * events were lost
+ *
+ * @returns		U3_WATCH_ARRIVED, or U3_WATCH_TIMEOUT if all devices
+ * 			present have been reported
+ */
+static int next_present(struct uevent_watch *watch, char *name, size_t len)
+{
+	struct dirent *entry;
+	char path[PATH_MAX];
+	char devpath[PATH_MAX];
+	ssize_t n;
+	int fd;
+	int i;
+
+	while ((entry = readdir(watch->present)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/%s/%s", watch->class,
+			entry->d_name);
+		if (realpath(path, devpath) == NULL)
+			continue;
+		strncat(path, "/uevent", sizeof(path) - strlen(path) - 1);
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+		n = read(fd, watch->buffer, sizeof(watch->buffer) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+
+		// the uevent file holds the variables one per line
+		for (i = 0; i < n; i++) {
+			if (watch->buffer[i] == '\n')
+				watch->buffer[i] = '\0';
+		}
+		watch->buffer[n] = '\0';
+
+		if (parse_event(watch->buffer, n, watch->class, "add", devpath,
+				name, len) == U3_WATCH_ARRIVED)
+		{
+			return U3_WATCH_ARRIVED;
+		}
+	}
+
+	closedir(watch->present);
+	watch->present = NULL;
+	return U3_WATCH_TIMEOUT;
+}
+
+int uevent_watch_open(struct uevent_watch *watch, const char *class) {
+	struct sockaddr_nl addr;
+	int rcvbuf = UEVENT_RCVBUF;
+	int err;
+
+	watch->class = class;
+	watch->present = NULL;
+
+	watch->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (watch->fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_GROUP_KERNEL;
+	if (bind(watch->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		err = errno;
+		close(watch->fd);
+		errno = err;
+		return -1;
+	}
+	// too small a buffer only loses events in a burst
+	setsockopt(watch->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	// the socket is bound first, so no device is missed in between
+	scan_present(watch);
+
+	return 0;
+}
+
+int uevent_watch_next(struct uevent_watch *watch, char *name, size_t len,
+		int timeout)
+{
+	struct sockaddr_nl addr;
+	struct pollfd pfd;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t n;
+	int event;
+
+	if (watch->present != NULL &&
+	    next_present(watch, name, len) == U3_WATCH_ARRIVED)
+	{
+		return U3_WATCH_ARRIVED;
+	}
+
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, timeout);
+	if (n == -1 && errno != EINTR)
+		return -1;
+	if (n <= 0)
+		return U3_WATCH_TIMEOUT;
+
+	for (;;) {
+		iov.iov_base = watch->buffer;
+		iov.iov_len = sizeof(watch->buffer) - 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		n = recvmsg(watch->fd, &msg, MSG_DONTWAIT);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return U3_WATCH_TIMEOUT;
+			// Events were lost in a burst. Devices that arrived
+			// are found by scanning the devices present again.
+			if (errno == ENOBUFS) {
+				scan_present(watch);
+				if (watch->present != NULL &&
+				    next_present(watch, name, len) ==
+					U3_WATCH_ARRIVED)
+				{
+					return U3_WATCH_ARRIVED;
+				}
+				continue;
+			}
+			return -1;
+		}
+		// only trust events sent by the kernel
+		if (addr.nl_pid != 0)
+			continue;
+		watch->buffer[n] = '\0';
+
+		event = parse_event(watch->buffer, n, watch->class, NULL, NULL,
+				name, len);
+		if (event != U3_WATCH_TIMEOUT)
+			return event;
+	}
+}
+
+void uevent_watch_close(struct uevent_watch *watch) {
+	if (watch->present != NULL)
+		closedir(watch->present);
+	close(watch->fd);
+}
+
+#endif // SUBSYS_SG || SUBSYS_BSG
@@ -0,0 +1,80 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __UEVENT_H__
+#define __UEVENT_H__
+/**
+ * @file	uevent.h
+ *
+ *		Watch for device nodes of a kernel device class arriving and
+ *		leaving, using the kernel uevent netlink socket. Used by the
+ *		Linux subsystems to implement u3_watch_next(). Only devices
+ *		connected by USB are reported.
+ */
+
+#include <stddef.h>
+#include <dirent.h>
+
+/**
+ * Watch on a device class
+ */
+struct uevent_watch {
+	int		fd;		// netlink socket
+	const char	*class;		// device class, e.g. "scsi_generic"
+	DIR		*present;	// devices present not reported yet, or
+					// NULL
+	char		buffer[4096];	// last event received
+};
+
+/**
+ * Start watching a device class
+ *
+ * @param watch		Watch to initialize
+ * @param class		Kernel device class, e.g. "scsi_generic" or "bsg"
+ *
+ * @returns		0 if successful, else -1 and errno is set
+ */
+int uevent_watch_open(struct uevent_watch *watch, const char *class);
+
+/**
+ * Wait for a device of the class to arrive or leave
+ *
+ * Devices present when the watch was opened are reported as arrived first.
+ * If events were lost because the socket buffer overflowed, the devices
+ * present are reported as arrived again, so no arrival is missed. Devices
+ * that left in the meantime aren't reported.
+ *
+ * @param watch		Watch opened using uevent_watch_open()
+ * @param name		Buffer to return the device node in, e.g. "/dev/sg3"
+ * @param len		Size of 'name'
+ * @param timeout	Longest time to wait in milliseconds
+ *
+ * @returns		One of the U3_WATCH_* enum values, else -1 and errno
+ * 			is set
+ */
+int uevent_watch_next(struct uevent_watch *watch, char *name, size_t len,
+		int timeout);
+
+/**
+ * Stop watching a device class
+ *
+ * @param watch		Watch opened using uevent_watch_open()
+ */
+void uevent_watch_close(struct uevent_watch *watch);
+
+#endif // __UEVENT_H__
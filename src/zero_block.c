@@ -0,0 +1,124 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "zero_block.h"
+#include "u3.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+# define USE_SSE2 1
+# include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled for a target of its own and only called if the CPU
+// supports it, so the rest of the program runs on any x86 CPU.
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define USE_AVX2 1
+# include <immintrin.h>
+#endif
+
+#ifndef USE_SSE2
+/**
+ * Portable check, OR's the block together a word at a time
+ */
+static int zero_block_scalar(const uint8_t *block) {
+	uint64_t acc = 0;
+	uint64_t word;
+	unsigned int i;
+
+	for (i = 0; i < U3_BLOCK_SIZE; i += sizeof(word)) {
+		memcpy(&word, block + i, sizeof(word));
+		acc |= word;
+	}
+
+	return acc == 0;
+}
+#endif
+
+#ifdef USE_SSE2
+static int zero_block_sse2(const uint8_t *block) {
+	__m128i acc = _mm_setzero_si128();
+	unsigned int i;
+
+	for (i = 0; i < U3_BLOCK_SIZE; i += 4 * sizeof(__m128i)) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128(
+				(const __m128i *) (block + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(
+				(const __m128i *) (block + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(
+				(const __m128i *) (block + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(
+				(const __m128i *) (block + i + 48)));
+	}
+
+	acc = _mm_cmpeq_epi8(acc, _mm_setzero_si128());
+	return _mm_movemask_epi8(acc) == 0xffff;
+}
+#endif
+
+#ifdef USE_AVX2
+__attribute__ ((target("avx2")))
+static int zero_block_avx2(const uint8_t *block) {
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int i;
+
+	for (i = 0; i < U3_BLOCK_SIZE; i += 4 * sizeof(__m256i)) {
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(
+				(const __m256i *) (block + i)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(
+				(const __m256i *) (block + i + 32)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(
+				(const __m256i *) (block + i + 64)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(
+				(const __m256i *) (block + i + 96)));
+	}
+
+	return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+/**
+ * Select the fastest check the CPU supports
+ */
+static int (*select_check(void))(const uint8_t *) {
+#ifdef USE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return zero_block_avx2;
+#endif
+#ifdef USE_SSE2
+	return zero_block_sse2;
+#else
+	return zero_block_scalar;
+#endif
+}
+
+int zero_block(const uint8_t *block) {
+	static int (*check)(const uint8_t *) = NULL;
+
+	if (check == NULL)
+		check = select_check();
+
+	return check(block);
+}
@@ -0,0 +1,40 @@
+/**
+ * u3-tool - U3 USB stick manager
+ * Copyright (C) 2009 Daviedev, daviedev@users.sourceforge.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef __ZERO_BLOCK_H__
+#define __ZERO_BLOCK_H__
+/**
+ * @file	zero_block.h
+ *
+ *		Detection of CD blocks that contain only zero bytes. On x86
+ *		the check uses AVX2 if the CPU supports it, else SSE2. Other
+ *		platforms use a portable word-at-a-time check.
+ */
+
+#include <stdint.h>
+
+/**
+ * Check if a block is all zero
+ *
+ * @param block		Block of U3_BLOCK_SIZE bytes, no alignment needed
+ *
+ * @returns		1 if all bytes of the block are zero, else 0
+ */
+int zero_block(const uint8_t *block);
+
+#endif // __ZERO_BLOCK_H__